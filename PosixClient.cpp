@@ -0,0 +1,333 @@
+#if defined(__linux__)
+
+#include "PosixClient.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+PosixClient::PosixClient() {
+    _fd = -1;
+    _eof = false;
+    _linger = false;
+    _lingering = false;
+    _rx = NULL;
+    _rxCapacity = 0;
+    _memory = NULL;
+    _rxStart = 0;
+    _rxEnd = 0;
+    _tx = NULL;
+    _txCapacity = 0;
+    _txStart = 0;
+    _txEnd = 0;
+}
+
+PosixClient::PosixClient(int fd) {
+    _fd = -1;
+    _eof = false;
+    _linger = false;
+    _lingering = false;
+    _rx = NULL;
+    _rxCapacity = 0;
+    _memory = NULL;
+    _rxStart = 0;
+    _rxEnd = 0;
+    _tx = NULL;
+    _txCapacity = 0;
+    _txStart = 0;
+    _txEnd = 0;
+    attach(fd);
+}
+
+PosixClient::~PosixClient() {
+    close();
+    ws_free(_memory, _rx, _rxCapacity);
+}
+
+void PosixClient::attach(int fd) {
+    close();
+    _fd = fd;
+    _eof = false;
+    configure();
+}
+
+void PosixClient::attach(int fd, uint8_t *tx, size_t txCapacity) {
+    attach(fd);
+    _tx = tx;
+    _txCapacity = txCapacity;
+}
+
+void PosixClient::configure() {
+    int one = 1;
+
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+bool PosixClient::connectAddress(const struct sockaddr *address, unsigned int length) {
+    close();
+
+    _fd = socket(address->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_fd < 0) {
+        return false;
+    }
+
+    // Connect blocking, like the Arduino clients do, then switch over
+    if (::connect(_fd, address, length) != 0) {
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    _eof = false;
+    configure();
+    return true;
+}
+
+int PosixClient::connect(IPAddress ip, uint16_t port) {
+    struct sockaddr_in address;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = (uint32_t) ip;
+
+    return connectAddress((struct sockaddr *) &address, sizeof(address));
+}
+
+int PosixClient::connect(const char *host, uint16_t port) {
+    struct addrinfo hints;
+    struct addrinfo *result;
+    char service[8];
+    bool connected = false;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+
+    if (getaddrinfo(host, service, &hints, &result) != 0) {
+        return 0;
+    }
+    for (struct addrinfo *ai = result; ai != NULL && !connected; ai = ai->ai_next) {
+        connected = connectAddress(ai->ai_addr, ai->ai_addrlen);
+    }
+    freeaddrinfo(result);
+
+    return connected;
+}
+
+size_t PosixClient::write(uint8_t bite) {
+    return write(&bite, 1);
+}
+
+size_t PosixClient::write(const uint8_t *buf, size_t size) {
+    if (_fd < 0 || _lingering || size == 0) {
+        return 0;
+    }
+
+    if (_tx != NULL) {
+        // Staged bytes are only moved once all of them have been sent, as
+        // the kernel may be reading them
+        if (size > _txCapacity - _txEnd) {
+            size = _txCapacity - _txEnd;
+        }
+        memcpy(_tx + _txEnd, buf, size);
+        _txEnd += size;
+        return size;
+    }
+
+    ssize_t sent = ::send(_fd, buf, size, MSG_NOSIGNAL);
+    if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            _eof = true;
+        }
+        return 0;
+    }
+    return sent;
+}
+
+bool PosixClient::reserve(size_t length) {
+    // Reuse the front of the buffer once it has been consumed
+    if (_rxStart == _rxEnd) {
+        _rxStart = 0;
+        _rxEnd = 0;
+    } else if (_rxStart > 0 && _rxCapacity - _rxEnd < length) {
+        memmove(_rx, _rx + _rxStart, _rxEnd - _rxStart);
+        _rxEnd -= _rxStart;
+        _rxStart = 0;
+    }
+    if (_rxCapacity - _rxEnd >= length) {
+        return true;
+    }
+
+    size_t capacity = _rxCapacity ? _rxCapacity : 2048;
+    while (capacity - _rxEnd < length) {
+        capacity *= 2;
+    }
+    uint8_t *rx = (uint8_t *) ws_realloc(_memory, _rx, _rxCapacity, capacity);
+    if (rx == NULL) {
+        return false;
+    }
+    _rx = rx;
+    _rxCapacity = capacity;
+    return true;
+}
+
+bool PosixClient::fill() {
+    if (_fd < 0 || _eof || _tx != NULL) {
+        return true;
+    }
+
+    while (true) {
+        if (_lingering) {
+            // Nobody reads it any more
+            _rxStart = 0;
+            _rxEnd = 0;
+        }
+        if (_rxEnd == _rxCapacity && (buffered() >= WS_POSIX_RX_LIMIT || !reserve(1))) {
+            return false;
+        }
+
+        ssize_t count = ::recv(_fd, _rx + _rxEnd, _rxCapacity - _rxEnd, 0);
+        if (count > 0) {
+            _rxEnd += count;
+        } else if (count == 0) {
+            _eof = true;
+            return true;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                _eof = true;
+            }
+            return true;
+        }
+    }
+}
+
+void PosixClient::deliver(const uint8_t *data, size_t length) {
+    if (length == 0) {
+        _eof = true;
+    } else if (_lingering) {
+        // Nobody reads it any more
+    } else if (reserve(length)) {
+        memcpy(_rx + _rxEnd, data, length);
+        _rxEnd += length;
+    } else {
+        _eof = true;
+    }
+}
+
+const uint8_t *PosixClient::staged(size_t &length) const {
+    length = _txEnd - _txStart;
+    return _tx + _txStart;
+}
+
+void PosixClient::sent(size_t length) {
+    _txStart += length;
+    if (_txStart >= _txEnd) {
+        _txStart = 0;
+        _txEnd = 0;
+        // The last of it is out; the peer sees the end after it
+        if (_lingering) {
+            shutdown(_fd, SHUT_WR);
+        }
+    }
+}
+
+bool PosixClient::headersComplete() const {
+    for (size_t i = _rxStart; i + 3 < _rxEnd; ++i) {
+        if (_rx[i] == '\r' && _rx[i + 1] == '\n' && _rx[i + 2] == '\r' && _rx[i + 3] == '\n') {
+            return true;
+        }
+    }
+    return false;
+}
+
+int PosixClient::available() {
+    if (_rxStart == _rxEnd) {
+        fill();
+    }
+    return _rxEnd - _rxStart;
+}
+
+int PosixClient::read() {
+    if (available() <= 0) {
+        return -1;
+    }
+    return _rx[_rxStart++];
+}
+
+int PosixClient::read(uint8_t *buf, size_t size) {
+    size_t count = available();
+
+    if (count > size) {
+        count = size;
+    }
+    memcpy(buf, _rx + _rxStart, count);
+    _rxStart += count;
+    return count;
+}
+
+int PosixClient::peek() {
+    if (available() <= 0) {
+        return -1;
+    }
+    return _rx[_rxStart];
+}
+
+void PosixClient::flush() {
+    // Nothing buffered on the way out; the send queue owns pending output
+}
+
+void PosixClient::stop() {
+    if (_fd >= 0 && _linger) {
+        // Written or staged output still goes out; what arrives from now on
+        // is of no interest
+        if (!_lingering && _txStart == _txEnd) {
+            shutdown(_fd, SHUT_WR);
+        }
+        _lingering = true;
+        _rxStart = 0;
+        _rxEnd = 0;
+        return;
+    }
+    close();
+}
+
+void PosixClient::close() {
+    if (_fd >= 0) {
+        // Reads and writes the caller has in flight would otherwise keep
+        // the socket open after close()
+        if (_tx != NULL) {
+            shutdown(_fd, SHUT_RDWR);
+        }
+        ::close(_fd);
+        _fd = -1;
+    }
+    _eof = false;
+    _lingering = false;
+    _rxStart = 0;
+    _rxEnd = 0;
+    _tx = NULL;
+    _txCapacity = 0;
+    _txStart = 0;
+    _txEnd = 0;
+}
+
+uint8_t PosixClient::connected() {
+    // Like the Arduino clients: still "connected" while unread data remains
+    return _fd >= 0 && !_lingering && (!_eof || _rxStart < _rxEnd);
+}
+
+PosixClient::operator bool() {
+    return _fd >= 0;
+}
+
+#endif
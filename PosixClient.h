@@ -0,0 +1,115 @@
+/*
+ *  PosixClient.h
+ *
+ *  Description:
+ *      Arduino Client implementation over a non-blocking POSIX socket, so
+ *      WebSocketServer and WebSocketClient can run unchanged on a Linux
+ *      gateway. Incoming bytes are buffered in user space: fill() drains
+ *      the kernel buffer, which is what an edge-triggered reactor needs,
+ *      and available()/read() serve the protocol code from the buffer.
+ *      write() never blocks; it returns how much the kernel accepted and
+ *      the send queue keeps the rest.
+ */
+
+#ifndef POSIXCLIENT_H_
+#define POSIXCLIENT_H_
+
+#if defined(__linux__)
+
+#include <Arduino.h>
+#include "Client.h"
+#include "WebSocketMemory.h"
+
+struct sockaddr;
+
+// Most bytes buffered per connection before fill() stops reading.
+#ifndef WS_POSIX_RX_LIMIT
+#define WS_POSIX_RX_LIMIT 65536
+#endif
+
+class PosixClient : public Client {
+public:
+    PosixClient();
+    // Take ownership of an accepted socket.
+    explicit PosixClient(int fd);
+    virtual ~PosixClient();
+
+    virtual int connect(IPAddress ip, uint16_t port);
+    virtual int connect(const char *host, uint16_t port);
+    virtual size_t write(uint8_t bite);
+    virtual size_t write(const uint8_t *buf, size_t size);
+    virtual int available();
+    virtual int read();
+    virtual int read(uint8_t *buf, size_t size);
+    virtual int peek();
+    virtual void flush();
+    virtual void stop();
+    virtual uint8_t connected();
+    virtual operator bool();
+
+    // Adopt an accepted socket, closing any previous one.
+    void attach(int fd);
+    // Adopt a socket whose reads and writes the caller submits itself, as
+    // the io_uring reactor does: write() stages into tx and deliver() hands
+    // in received bytes. fill() never touches the socket in this mode.
+    void attach(int fd, uint8_t *tx, size_t txCapacity);
+    int fd() const { return _fd; }
+
+    // Read everything the kernel has, up to WS_POSIX_RX_LIMIT buffered bytes.
+    // Returns false once the buffer is full and more may be waiting.
+    bool fill();
+
+    // The buffer holds a complete HTTP header block.
+    bool headersComplete() const;
+
+    size_t buffered() const { return _rxEnd - _rxStart; }
+
+    // Grow the receive buffer to length bytes now rather than on the first
+    // fill(). stop() and attach() keep it.
+    bool preallocate(size_t length) { return reserve(length); }
+
+    // Charge the receive buffer to memory; without one only the library
+    // total and budget see it. Call before the buffer is first grown.
+    void setMemory(WebSocketMemory *memory) { _memory = memory; }
+
+    // Append received bytes; a length of 0 means the peer is gone.
+    void deliver(const uint8_t *data, size_t length);
+    // Staged output not yet handed to the kernel, and how much it took.
+    const uint8_t *staged(size_t &length) const;
+    void sent(size_t length);
+
+    // With linger set, stop() keeps the socket open for the caller: output
+    // already staged still goes out, the socket is then shut down for
+    // writing, and connected() is false from then on. Whatever arrives is
+    // discarded until the peer closes its side. close() ends it.
+    void setLinger(bool linger) { _linger = linger; }
+    // stop() was called with linger set, and close() not yet.
+    bool lingering() const { return _lingering; }
+    // The peer closed its side, or the socket failed.
+    bool eof() const { return _eof; }
+    // Close the socket now, dropping whatever is still staged.
+    void close();
+
+private:
+    int _fd;
+    bool _eof;
+    bool _linger;
+    bool _lingering;
+    uint8_t *_rx;
+    size_t _rxCapacity;
+    WebSocketMemory *_memory;
+    size_t _rxStart;
+    size_t _rxEnd;
+    uint8_t *_tx;
+    size_t _txCapacity;
+    size_t _txStart;
+    size_t _txEnd;
+
+    bool connectAddress(const struct sockaddr *address, unsigned int length);
+    void configure();
+    bool reserve(size_t length);
+};
+
+#endif
+
+#endif
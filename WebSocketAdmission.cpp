@@ -0,0 +1,149 @@
+//#define DEBUGGING
+
+#include "WebSocketAdmission.h"
+
+#define WS_ADMISSION_STRING(x) #x
+#define WS_ADMISSION_EXPAND(x) WS_ADMISSION_STRING(x)
+
+// Built once at compile time; refusing costs a single write
+static const char admissionResponse[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: " WS_ADMISSION_EXPAND(WS_ADMISSION_RETRY_AFTER) "\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+// Slots looked at for a source before one is recycled
+#define WS_ADMISSION_PROBES 8
+
+WebSocketAdmission::WebSocketAdmission() {
+    _maxConnections = 0;
+    _maxHandshakes = 0;
+    _connections = 0;
+    _handshakes = 0;
+    _rate = 0;
+    _burst = 0;
+    memset(_sources, 0, sizeof(_sources));
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void WebSocketAdmission::setLimits(size_t maxConnections, size_t maxHandshakes) {
+    _maxConnections = maxConnections;
+    _maxHandshakes = maxHandshakes;
+}
+
+void WebSocketAdmission::setRate(uint16_t perSecond, uint16_t burst) {
+    _rate = perSecond;
+    _burst = burst > 0 ? burst : 1;
+    memset(_sources, 0, sizeof(_sources));
+}
+
+const char *WebSocketAdmission::response() {
+    return admissionResponse;
+}
+
+size_t WebSocketAdmission::responseLength() {
+    return sizeof(admissionResponse) - 1;
+}
+
+bool WebSocketAdmission::takeToken(uint32_t address) {
+    unsigned long now = millis();
+    size_t start = (address * 2654435761UL) % WS_ADMISSION_SOURCES;
+    Source *source = NULL;
+    Source *oldest = NULL;
+
+    for (size_t i = 0; i < WS_ADMISSION_PROBES && i < WS_ADMISSION_SOURCES; ++i) {
+        Source *slot = &_sources[(start + i) % WS_ADMISSION_SOURCES];
+
+        if (slot->used && slot->address == address) {
+            source = slot;
+            break;
+        }
+        if (!slot->used) {
+            if (oldest == NULL || oldest->used) {
+                oldest = slot;
+            }
+        } else if (oldest == NULL || (oldest->used && now - slot->updated > now - oldest->updated)) {
+            oldest = slot;
+        }
+    }
+
+    if (source == NULL) {
+        // New source, or one we had forgotten: start with a full bucket
+        source = oldest;
+        source->address = address;
+        source->tokens = (uint32_t) _burst * 1000;
+        source->updated = now;
+        source->used = true;
+    }
+
+    // A rate of r per second refills r thousandths per millisecond
+    uint32_t limit = (uint32_t) _burst * 1000;
+    unsigned long elapsed = now - source->updated;
+    source->updated = now;
+    if (elapsed >= limit / _rate) {
+        source->tokens = limit;
+    } else {
+        source->tokens += elapsed * _rate;
+        if (source->tokens > limit) {
+            source->tokens = limit;
+        }
+    }
+
+    if (source->tokens < 1000) {
+        return false;
+    }
+    source->tokens -= 1000;
+    return true;
+}
+
+WebSocketAdmissionResult WebSocketAdmission::check(uint32_t source) {
+    if (_maxConnections > 0 && _connections + _handshakes >= _maxConnections) {
+        _stats.refusedConnections++;
+        return WS_REFUSE_CONNECTIONS;
+    }
+    if (_maxHandshakes > 0 && _handshakes >= _maxHandshakes) {
+        _stats.refusedHandshakes++;
+        return WS_REFUSE_HANDSHAKES;
+    }
+    if (_rate > 0 && !takeToken(source)) {
+        _stats.refusedRate++;
+        return WS_REFUSE_RATE;
+    }
+
+    _handshakes++;
+    _stats.admitted++;
+    return WS_ADMIT;
+}
+
+bool WebSocketAdmission::admit(Client &client, uint32_t source) {
+    WebSocketAdmissionResult result = check(source);
+
+    if (result == WS_ADMIT) {
+        return true;
+    }
+
+#ifdef DEBUGGING
+    Serial.print(F("Refusing connection: "));
+    Serial.println(result);
+#endif
+
+    client.write((const uint8_t *) admissionResponse, sizeof(admissionResponse) - 1);
+    client.stop();
+    return false;
+}
+
+void WebSocketAdmission::handshakeFinished(bool established) {
+    if (_handshakes > 0) {
+        _handshakes--;
+    }
+    if (established) {
+        _connections++;
+    }
+}
+
+void WebSocketAdmission::connectionClosed() {
+    if (_connections > 0) {
+        _connections--;
+    }
+}
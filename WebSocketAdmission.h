@@ -0,0 +1,97 @@
+/*
+ *  WebSocketAdmission.h
+ *
+ *  Description:
+ *      Admission control for incoming connections, decided before a
+ *      single header byte is parsed. A connection is refused when too
+ *      many are open, too many handshakes are in flight, or its source
+ *      address has used up its token bucket. A refused client gets a
+ *      prebuilt 503 response and is closed at once, so a reconnect storm
+ *      costs one write per attempt instead of a header parse and a SHA-1.
+ */
+
+#ifndef WEBSOCKETADMISSION_H_
+#define WEBSOCKETADMISSION_H_
+
+#include <Arduino.h>
+#include "Client.h"
+
+// Source addresses tracked for rate limiting. When the table is full the
+// least recently seen source in the probed range is forgotten.
+#ifndef WS_ADMISSION_SOURCES
+#define WS_ADMISSION_SOURCES 64
+#endif
+
+// Seconds a refused client is asked to wait before trying again.
+#ifndef WS_ADMISSION_RETRY_AFTER
+#define WS_ADMISSION_RETRY_AFTER 5
+#endif
+
+enum WebSocketAdmissionResult {
+    WS_ADMIT,
+    WS_REFUSE_CONNECTIONS,  // maxConnections open or being set up
+    WS_REFUSE_HANDSHAKES,   // maxHandshakes in flight
+    WS_REFUSE_RATE          // the source's token bucket is empty
+};
+
+struct WebSocketAdmissionStats {
+    unsigned long admitted;
+    unsigned long refusedConnections;
+    unsigned long refusedHandshakes;
+    unsigned long refusedRate;
+};
+
+class WebSocketAdmission {
+public:
+    WebSocketAdmission();
+
+    // Zero lifts either limit.
+    void setLimits(size_t maxConnections, size_t maxHandshakes);
+
+    // Let each source address open perSecond connections, with bursts of up
+    // to burst. Zero perSecond turns rate limiting off.
+    void setRate(uint16_t perSecond, uint16_t burst);
+
+    // Decide on a new connection from source. An admitted connection counts
+    // as a handshake in flight until handshakeFinished().
+    WebSocketAdmissionResult check(uint32_t source);
+
+    // check(), and if refused send the 503 response and stop the client.
+    bool admit(Client &client, uint32_t source);
+
+    // Report the outcome of an admitted connection's handshake, and later
+    // the end of an established connection.
+    void handshakeFinished(bool established);
+    void connectionClosed();
+
+    size_t connections() const { return _connections; }
+    size_t handshakes() const { return _handshakes; }
+    const WebSocketAdmissionStats &stats() const { return _stats; }
+
+    // The prebuilt refusal, for callers that write to the socket themselves.
+    static const char *response();
+    static size_t responseLength();
+
+private:
+    struct Source {
+        uint32_t address;
+        uint32_t tokens;        // thousandths of a connection
+        unsigned long updated;
+        bool used;
+    };
+
+    size_t _maxConnections;
+    size_t _maxHandshakes;
+    size_t _connections;
+    size_t _handshakes;
+
+    uint16_t _rate;
+    uint16_t _burst;
+    Source _sources[WS_ADMISSION_SOURCES];
+
+    WebSocketAdmissionStats _stats;
+
+    bool takeToken(uint32_t address);
+};
+
+#endif
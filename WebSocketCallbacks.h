@@ -0,0 +1,84 @@
+/*
+ *  WebSocketCallbacks.h
+ *
+ *  Description:
+ *      Handler registration shared by WebSocketServer and WebSocketClient.
+ *      Handlers are plain function pointers with a user supplied context
+ *      pointer, and are invoked from poll() with a view of the payload that
+ *      is only valid for the duration of the call.
+ */
+
+#ifndef WEBSOCKETCALLBACKS_H_
+#define WEBSOCKETCALLBACKS_H_
+
+#include <Arduino.h>
+#include "WebSocketFrame.h"
+
+// Text, binary, ping and pong handlers. Text payloads are not NUL terminated.
+typedef void (*WebSocketDataCallback)(void *context, const uint8_t *payload, size_t length);
+
+// Events without payload, e.g. the send queue draining.
+typedef void (*WebSocketEventCallback)(void *context);
+
+// Close handler. code is WS_CLOSE_NO_STATUS when the peer did not send one.
+typedef void (*WebSocketCloseCallback)(void *context, uint16_t code);
+
+// Pseudo opcode for the send queue draining, which has no frame of its own.
+#define WS_EVENT_DRAIN 0x10
+// Pseudo opcode for an automatic reconnect having succeeded.
+#define WS_EVENT_CONNECT 0x11
+
+struct WebSocketCallbacks {
+    WebSocketDataCallback text;
+    void *textContext;
+    WebSocketDataCallback binary;
+    void *binaryContext;
+    WebSocketDataCallback ping;
+    void *pingContext;
+    WebSocketDataCallback pong;
+    void *pongContext;
+    WebSocketCloseCallback close;
+    void *closeContext;
+    WebSocketEventCallback drain;
+    void *drainContext;
+    WebSocketEventCallback connect;
+    void *connectContext;
+
+    WebSocketCallbacks()
+        : text(NULL), textContext(NULL), binary(NULL), binaryContext(NULL),
+          ping(NULL), pingContext(NULL), pong(NULL), pongContext(NULL),
+          close(NULL), closeContext(NULL), drain(NULL), drainContext(NULL),
+          connect(NULL), connectContext(NULL) {
+    }
+
+    // Hand a decoded frame to whichever handler is registered for it. Close
+    // payloads start with the status code.
+    void dispatch(uint8_t opcode, const uint8_t *payload, size_t length) const {
+        switch (opcode) {
+        case WS_OPCODE_TEXT:
+            if (text) text(textContext, payload, length);
+            break;
+        case WS_OPCODE_BINARY:
+            if (binary) binary(binaryContext, payload, length);
+            break;
+        case WS_OPCODE_PING:
+            if (ping) ping(pingContext, payload, length);
+            break;
+        case WS_OPCODE_PONG:
+            if (pong) pong(pongContext, payload, length);
+            break;
+        case WS_OPCODE_CLOSE:
+            if (close) close(closeContext, length >= 2 ? ((uint16_t) payload[0] << 8) | payload[1]
+                                                       : WS_CLOSE_NO_STATUS);
+            break;
+        case WS_EVENT_DRAIN:
+            if (drain) drain(drainContext);
+            break;
+        case WS_EVENT_CONNECT:
+            if (connect) connect(connectContext);
+            break;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,404 @@
+//#define DEBUGGING
+
+#include "WebSocketCbor.h"
+
+#include <math.h>
+
+// Major types
+#define CBOR_UNSIGNED 0
+#define CBOR_NEGATIVE 1
+#define CBOR_BYTES    2
+#define CBOR_TEXT     3
+#define CBOR_ARRAY    4
+#define CBOR_MAP      5
+#define CBOR_TAG      6
+#define CBOR_SIMPLE   7
+
+// Simple values and floats under major type 7
+#define CBOR_FALSE    20
+#define CBOR_TRUE     21
+#define CBOR_NULLVAL  22
+#define CBOR_HALF     25
+#define CBOR_SINGLE   26
+#define CBOR_DOUBLE   27
+
+WebSocketCborWriter::WebSocketCborWriter(uint8_t *buffer, size_t capacity) {
+    _buffer = buffer;
+    _capacity = buffer != NULL ? capacity : 0;
+    _length = 0;
+    _ok = buffer != NULL;
+}
+
+void WebSocketCborWriter::append(const void *data, size_t length) {
+    if (!_ok || length > _capacity - _length) {
+        _ok = false;
+        return;
+    }
+    memcpy(_buffer + _length, data, length);
+    _length += length;
+}
+
+// The shortest head that holds value, as the spec prefers
+void WebSocketCborWriter::writeHead(uint8_t major, uint64_t value) {
+    uint8_t head[9];
+    size_t n = 1;
+
+    major <<= 5;
+    if (value < 24) {
+        head[0] = major | (uint8_t) value;
+    } else if (value <= 0xFF) {
+        head[0] = major | 24;
+        head[n++] = (uint8_t) value;
+    } else if (value <= 0xFFFF) {
+        head[0] = major | 25;
+        head[n++] = (uint8_t) (value >> 8);
+        head[n++] = (uint8_t) value;
+    } else if (value <= 0xFFFFFFFFULL) {
+        head[0] = major | 26;
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            head[n++] = (uint8_t) (value >> shift);
+        }
+    } else {
+        head[0] = major | 27;
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            head[n++] = (uint8_t) (value >> shift);
+        }
+    }
+    append(head, n);
+}
+
+void WebSocketCborWriter::beginArray(size_t count) {
+    writeHead(CBOR_ARRAY, count);
+}
+
+void WebSocketCborWriter::beginMap(size_t count) {
+    writeHead(CBOR_MAP, count);
+}
+
+void WebSocketCborWriter::writeUnsigned(uint64_t value) {
+    writeHead(CBOR_UNSIGNED, value);
+}
+
+void WebSocketCborWriter::writeInt(int64_t value) {
+    if (value < 0) {
+        // -1 - n, computed without overflowing at INT64_MIN
+        writeHead(CBOR_NEGATIVE, ~(uint64_t) value);
+    } else {
+        writeHead(CBOR_UNSIGNED, (uint64_t) value);
+    }
+}
+
+void WebSocketCborWriter::writeFloat(float value) {
+    uint8_t item[5];
+    uint32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    item[0] = (CBOR_SIMPLE << 5) | CBOR_SINGLE;
+    item[1] = (uint8_t) (bits >> 24);
+    item[2] = (uint8_t) (bits >> 16);
+    item[3] = (uint8_t) (bits >> 8);
+    item[4] = (uint8_t) bits;
+    append(item, sizeof(item));
+}
+
+void WebSocketCborWriter::writeDouble(double value) {
+    uint8_t item[9];
+    uint64_t bits;
+
+    // Doubles that survive the round trip go out as 4 bytes instead of 8
+    if ((double) (float) value == value) {
+        writeFloat((float) value);
+        return;
+    }
+
+    memcpy(&bits, &value, sizeof(bits));
+    item[0] = (CBOR_SIMPLE << 5) | CBOR_DOUBLE;
+    for (int i = 0; i < 8; ++i) {
+        item[1 + i] = (uint8_t) (bits >> (56 - 8 * i));
+    }
+    append(item, sizeof(item));
+}
+
+void WebSocketCborWriter::writeBool(bool value) {
+    uint8_t item = (CBOR_SIMPLE << 5) | (value ? CBOR_TRUE : CBOR_FALSE);
+    append(&item, 1);
+}
+
+void WebSocketCborWriter::writeNull() {
+    uint8_t item = (CBOR_SIMPLE << 5) | CBOR_NULLVAL;
+    append(&item, 1);
+}
+
+void WebSocketCborWriter::writeString(const char *text) {
+    writeString(text, strlen(text));
+}
+
+void WebSocketCborWriter::writeString(const char *text, size_t length) {
+    writeHead(CBOR_TEXT, length);
+    append(text, length);
+}
+
+void WebSocketCborWriter::writeBytes(const uint8_t *data, size_t length) {
+    writeHead(CBOR_BYTES, length);
+    append(data, length);
+}
+
+void WebSocketCborWriter::writeTag(uint64_t tag) {
+    writeHead(CBOR_TAG, tag);
+}
+
+WebSocketCborReader::WebSocketCborReader(const uint8_t *data, size_t length) {
+    _data = data;
+    _length = data != NULL ? length : 0;
+    _offset = 0;
+}
+
+bool WebSocketCborReader::head(size_t offset, uint8_t &major, uint8_t &info, uint64_t &value,
+                               size_t &size) const {
+    if (offset >= _length) {
+        return false;
+    }
+
+    uint8_t first = _data[offset];
+    major = first >> 5;
+    info = first & 0x1F;
+
+    if (info < 24) {
+        value = info;
+        size = 1;
+        return true;
+    }
+    if (info > 27) {
+        // Indefinite lengths and reserved values
+        return false;
+    }
+
+    size_t bytes = (size_t) 1 << (info - 24);
+    if (bytes > _length - offset - 1) {
+        return false;
+    }
+    value = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        value = (value << 8) | _data[offset + 1 + i];
+    }
+    size = 1 + bytes;
+    return true;
+}
+
+WebSocketCborType WebSocketCborReader::peekType() const {
+    uint8_t major, info;
+    uint64_t value;
+    size_t size;
+
+    if (!head(_offset, major, info, value, size)) {
+        return WS_CBOR_INVALID;
+    }
+
+    switch (major) {
+    case CBOR_UNSIGNED: return WS_CBOR_UNSIGNED;
+    case CBOR_NEGATIVE: return WS_CBOR_NEGATIVE;
+    case CBOR_BYTES:    return WS_CBOR_BYTES;
+    case CBOR_TEXT:     return WS_CBOR_TEXT;
+    case CBOR_ARRAY:    return WS_CBOR_ARRAY;
+    case CBOR_MAP:      return WS_CBOR_MAP;
+    case CBOR_TAG:      return WS_CBOR_TAG;
+    default:
+        if (info == CBOR_FALSE || info == CBOR_TRUE) {
+            return WS_CBOR_BOOL;
+        }
+        if (info == CBOR_NULLVAL) {
+            return WS_CBOR_NULL;
+        }
+        if (info >= CBOR_HALF && info <= CBOR_DOUBLE) {
+            return WS_CBOR_FLOAT;
+        }
+        return WS_CBOR_INVALID;
+    }
+}
+
+bool WebSocketCborReader::readHead(uint8_t major, uint64_t &value) {
+    uint8_t itemMajor, info;
+    size_t size;
+
+    if (!head(_offset, itemMajor, info, value, size) || itemMajor != major) {
+        return false;
+    }
+    _offset += size;
+    return true;
+}
+
+bool WebSocketCborReader::readUnsigned(uint64_t &value) {
+    return readHead(CBOR_UNSIGNED, value);
+}
+
+bool WebSocketCborReader::readInt(int64_t &value) {
+    uint8_t major, info;
+    uint64_t argument;
+    size_t size;
+
+    if (!head(_offset, major, info, argument, size) || argument > (uint64_t) INT64_MAX
+        || (major != CBOR_UNSIGNED && major != CBOR_NEGATIVE)) {
+        return false;
+    }
+    value = major == CBOR_UNSIGNED ? (int64_t) argument : -1 - (int64_t) argument;
+    _offset += size;
+    return true;
+}
+
+bool WebSocketCborReader::readDouble(double &value) {
+    uint8_t major, info;
+    uint64_t bits;
+    size_t size;
+
+    if (!head(_offset, major, info, bits, size) || major != CBOR_SIMPLE) {
+        return false;
+    }
+
+    if (info == CBOR_DOUBLE) {
+        memcpy(&value, &bits, sizeof(value));
+    } else if (info == CBOR_SINGLE) {
+        uint32_t single = (uint32_t) bits;
+        float f;
+        memcpy(&f, &single, sizeof(f));
+        value = f;
+    } else if (info == CBOR_HALF) {
+        // RFC 8949 appendix D
+        int exponent = (bits >> 10) & 0x1F;
+        int mantissa = bits & 0x3FF;
+
+        if (exponent == 0) {
+            value = ldexp(mantissa, -24);
+        } else if (exponent != 31) {
+            value = ldexp(mantissa + 1024, exponent - 25);
+        } else {
+            value = mantissa == 0 ? INFINITY : NAN;
+        }
+        if (bits & 0x8000) {
+            value = -value;
+        }
+    } else {
+        return false;
+    }
+
+    _offset += size;
+    return true;
+}
+
+bool WebSocketCborReader::readBool(bool &value) {
+    if (peekType() != WS_CBOR_BOOL) {
+        return false;
+    }
+    value = (_data[_offset] & 0x1F) == CBOR_TRUE;
+    _offset++;
+    return true;
+}
+
+bool WebSocketCborReader::readNull() {
+    if (peekType() != WS_CBOR_NULL) {
+        return false;
+    }
+    _offset++;
+    return true;
+}
+
+bool WebSocketCborReader::readSpan(uint8_t major, const uint8_t *&data, size_t &length) {
+    uint8_t itemMajor, info;
+    uint64_t argument;
+    size_t size;
+
+    if (!head(_offset, itemMajor, info, argument, size) || itemMajor != major
+        || argument > _length - _offset - size) {
+        return false;
+    }
+
+    data = _data + _offset + size;
+    length = (size_t) argument;
+    _offset += size + length;
+    return true;
+}
+
+bool WebSocketCborReader::readString(const char *&text, size_t &length) {
+    const uint8_t *data;
+
+    if (!readSpan(CBOR_TEXT, data, length)) {
+        return false;
+    }
+    text = (const char *) data;
+    return true;
+}
+
+bool WebSocketCborReader::readBytes(const uint8_t *&data, size_t &length) {
+    return readSpan(CBOR_BYTES, data, length);
+}
+
+bool WebSocketCborReader::readArray(size_t &count) {
+    uint64_t value;
+
+    if (!readHead(CBOR_ARRAY, value)) {
+        return false;
+    }
+    count = (size_t) value;
+    return true;
+}
+
+bool WebSocketCborReader::readMap(size_t &count) {
+    uint64_t value;
+
+    if (!readHead(CBOR_MAP, value)) {
+        return false;
+    }
+    count = (size_t) value;
+    return true;
+}
+
+bool WebSocketCborReader::readTag(uint64_t &tag) {
+    return readHead(CBOR_TAG, tag);
+}
+
+bool WebSocketCborReader::skip() {
+    size_t offset = _offset;
+    uint64_t pending = 1;
+
+    // Count the items still owed by the containers we're inside
+    while (pending > 0) {
+        uint8_t major, info;
+        uint64_t value;
+        size_t size;
+
+        if (!head(offset, major, info, value, size)) {
+            return false;
+        }
+        offset += size;
+        pending--;
+
+        switch (major) {
+        case CBOR_BYTES:
+        case CBOR_TEXT:
+            if (value > _length - offset) {
+                return false;
+            }
+            offset += (size_t) value;
+            break;
+        case CBOR_ARRAY:
+            if (value > _length - offset) {
+                return false;
+            }
+            pending += value;
+            break;
+        case CBOR_MAP:
+            if (value > (_length - offset) / 2) {
+                return false;
+            }
+            pending += 2 * value;
+            break;
+        case CBOR_TAG:
+            pending++;
+            break;
+        default:
+            break;
+        }
+    }
+
+    _offset = offset;
+    return true;
+}
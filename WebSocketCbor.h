@@ -0,0 +1,106 @@
+/*
+ *  WebSocketCbor.h
+ *
+ *  Description:
+ *      Compact binary encoding (CBOR, RFC 8949) for telemetry. The writer
+ *      fills a caller supplied buffer, normally the payload space that
+ *      reserveFrame() hands out inside the connection's send queue, so a
+ *      message is encoded exactly once and never passes through a String.
+ *      The reader walks a received payload in place; strings and byte
+ *      strings come back as pointers into it.
+ *
+ *      Only definite lengths are written and read.
+ */
+
+#ifndef WEBSOCKETCBOR_H_
+#define WEBSOCKETCBOR_H_
+
+#include <Arduino.h>
+
+enum WebSocketCborType {
+    WS_CBOR_UNSIGNED,
+    WS_CBOR_NEGATIVE,
+    WS_CBOR_BYTES,
+    WS_CBOR_TEXT,
+    WS_CBOR_ARRAY,
+    WS_CBOR_MAP,
+    WS_CBOR_TAG,
+    WS_CBOR_FLOAT,
+    WS_CBOR_BOOL,
+    WS_CBOR_NULL,
+    WS_CBOR_INVALID     // end of data, malformed, or unsupported
+};
+
+class WebSocketCborWriter {
+public:
+    WebSocketCborWriter(uint8_t *buffer, size_t capacity);
+
+    // Containers take the number of items (pairs for a map) up front.
+    void beginArray(size_t count);
+    void beginMap(size_t count);
+
+    void writeUnsigned(uint64_t value);
+    void writeInt(int64_t value);
+    void writeFloat(float value);
+    void writeDouble(double value);
+    void writeBool(bool value);
+    void writeNull();
+    void writeString(const char *text);
+    void writeString(const char *text, size_t length);
+    void writeBytes(const uint8_t *data, size_t length);
+    void writeTag(uint64_t tag);
+
+    // False once anything didn't fit; the buffer must then not be sent.
+    bool ok() const { return _ok; }
+    size_t length() const { return _length; }
+
+private:
+    uint8_t *_buffer;
+    size_t _capacity;
+    size_t _length;
+    bool _ok;
+
+    void writeHead(uint8_t major, uint64_t value);
+    void append(const void *data, size_t length);
+};
+
+class WebSocketCborReader {
+public:
+    WebSocketCborReader(const uint8_t *data, size_t length);
+
+    // Type of the next item, without consuming it.
+    WebSocketCborType peekType() const;
+
+    // Each read consumes one item and returns false, consuming nothing, if
+    // it has a different type or doesn't fit.
+    bool readUnsigned(uint64_t &value);
+    bool readInt(int64_t &value);
+    // Half, single or double precision.
+    bool readDouble(double &value);
+    bool readBool(bool &value);
+    bool readNull();
+    // text is not terminated; it points into the payload.
+    bool readString(const char *&text, size_t &length);
+    bool readBytes(const uint8_t *&data, size_t &length);
+    bool readArray(size_t &count);
+    bool readMap(size_t &count);
+    bool readTag(uint64_t &tag);
+
+    // Skip the next item, containers and all.
+    bool skip();
+
+    bool atEnd() const { return _offset >= _length; }
+    size_t offset() const { return _offset; }
+
+private:
+    const uint8_t *_data;
+    size_t _length;
+    size_t _offset;
+
+    // Decode the head at offset: major type, argument and head length.
+    bool head(size_t offset, uint8_t &major, uint8_t &info, uint64_t &value, size_t &size) const;
+    bool readHead(uint8_t major, uint64_t &value);
+    bool readSpan(uint8_t major, const uint8_t *&data, size_t &length);
+};
+
+#endif
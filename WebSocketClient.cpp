@@ -4,14 +4,54 @@
 
 #include "global.h"
 #include "WebSocketClient.h"
+#include "WebSocketHandshake.h"
 
 #include "sha1.h"
 #include "Base64.h"
 
 
+WebSocketClient::WebSocketClient() : _sender(*this, _queue, _memory, true) {
+    path = NULL;
+    host = NULL;
+    protocol = NULL;
+    socket_client = NULL;
+    _keepaliveInterval = 0;
+    _keepaliveTimeout = 0;
+    _roundTripMicros = 0;
+    _pingSequence = 0;
+    _fragmentLength = WS_FRAGMENT_LENGTH;
+    _reconnectPort = 0;
+    _reconnectAttempts = 0;
+    _requestReady = false;
+    _replayCount = 0;
+    _decoder.setMemory(&_memory);
+    _decoder.setExpectMasked(false);
+    _queue.setMemory(&_memory);
+    _batch.setMemory(&_memory);
+#if CALLBACK_FUNCTIONS
+    _io.setMemory(&_memory);
+    _sender.setIoTask(&_io);
+#endif
+}
+
+WebSocketClient::~WebSocketClient() {
+#if CALLBACK_FUNCTIONS
+    _io.end();
+#endif
+}
+
 bool WebSocketClient::handshake(Client &client) {
 
     socket_client = &client;
+#if CALLBACK_FUNCTIONS
+    _io.claim();
+#endif
+    _decoder.reset();
+    _queue.clear();
+    _sender.reset();
+    _startMillis = millis();
+    _lastPingMillis = _startMillis;
+    _roundTripMicros = 0;
 
     // If there is a connected client->
     if (socket_client->connected()) {
@@ -23,6 +63,7 @@ bool WebSocketClient::handshake(Client &client) {
 #ifdef DEBUGGING
                 Serial.println(F("Websocket established"));
 #endif
+                sendReplay();
 
                 return true;
 
@@ -40,18 +81,17 @@ bool WebSocketClient::handshake(Client &client) {
     }
 }
 
-bool WebSocketClient::analyzeRequest() {
-    String temp;
-
-    int bite;
-    bool foundupgrade = false;
-    unsigned long intkey[2];
-    String serverKey;
+void WebSocketClient::prepareHandshake() {
     char keyStart[17];
     char b64Key[25];
-    String key = "------------------------";
+    static bool seeded = false;
 
-    randomSeed(analogRead(0));
+    // Once only: reseeding from the same floating pin on every attempt could
+    // hand out the same keys and backoff jitter again
+    if (!seeded) {
+        randomSeed(analogRead(0));
+        seeded = true;
+    }
 
     for (int i=0; i<16; ++i) {
         keyStart[i] = (char)random(1, 256);
@@ -59,270 +99,694 @@ bool WebSocketClient::analyzeRequest() {
 
     base64_encode(b64Key, keyStart, 16);
 
-    for (int i=0; i<24; ++i) {
-        key[i] = b64Key[i];
+    // One write instead of a segment per header line
+    _request = "GET ";
+    _request += path;
+    _request += " HTTP/1.1\r\n"
+                "Upgrade: websocket\r\n"
+                "Connection: Upgrade\r\n"
+                "Host: ";
+    _request += host;
+    _request += CRLF "Sec-WebSocket-Key: ";
+    _request += b64Key;
+    _request += CRLF;
+    if (protocol != NULL) {
+        _request += "Sec-WebSocket-Protocol: ";
+        _request += protocol;
+        _request += CRLF;
+    }
+    _request += "Sec-WebSocket-Version: 13\r\n" CRLF;
+
+    String key = b64Key;
+    key += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    char result[21];
+
+    SHA1Context sha;
+    uint8_t Message_Digest[20];
+
+    SHA1Reset(&sha);
+    SHA1Input(&sha, reinterpret_cast<const uint8_t *>(key.c_str()), key.length());
+    SHA1Result(&sha, Message_Digest);
+
+    for (int i=0; i<20; ++i) {
+        result[i] = (char)Message_Digest[i];
     }
+    result[20] = '\0';
+
+    base64_encode(_expectedAccept, result, 20);
+    _requestReady = true;
+}
+
+bool WebSocketClient::analyzeRequest() {
+    uint8_t chunk[WS_RX_BUFFER_LENGTH];
+    unsigned long start;
+
+    if (!_requestReady) {
+        prepareHandshake();
+    }
+    _requestReady = false;
 
 #ifdef DEBUGGING
     Serial.println(F("Sending websocket upgrade headers"));
 #endif    
 
-    socket_client->print(F("GET "));
-    socket_client->print(path);
-    socket_client->print(F(" HTTP/1.1\r\n"));
-    socket_client->print(F("Upgrade: websocket\r\n"));
-    socket_client->print(F("Connection: Upgrade\r\n"));
-    socket_client->print(F("Host: "));
-    socket_client->print(host);
-    socket_client->print(CRLF); 
-    socket_client->print(F("Sec-WebSocket-Key: "));
-    socket_client->print(key);
-    socket_client->print(CRLF);
-    socket_client->print(F("Sec-WebSocket-Protocol: "));
-    socket_client->print(protocol);
-    socket_client->print(CRLF);
-    socket_client->print(F("Sec-WebSocket-Version: 13\r\n"));
-    socket_client->print(CRLF);
+    socket_client->write(reinterpret_cast<const uint8_t *>(_request.c_str()), _request.length());
 
 #ifdef DEBUGGING
     Serial.println(F("Analyzing response headers"));
 #endif    
 
-    while (socket_client->connected() && !socket_client->available()) {
-        delay(100);
-        Serial.println("Waiting...");
-    }
-
-    // TODO: More robust string extraction
-    while ((bite = socket_client->read()) != -1) {
+    WebSocketResponseParser parser(_expectedAccept);
+    start = millis();
 
-        temp += (char)bite;
+    while (!parser.done()) {
+        int count = socket_client->available();
 
-        if ((char)bite == '\n') {
+        if (count > 0) {
+            if ((size_t) count > sizeof(chunk)) {
+                count = sizeof(chunk);
+            }
+            count = socket_client->read(chunk, count);
+        }
+        if (count <= 0) {
+            if (!socket_client->connected() || millis() - start >= WS_HANDSHAKE_TIMEOUT_MS) {
 #ifdef DEBUGGING
-            Serial.print("Got Header: " + temp);
+                Serial.println(F("No handshake response"));
 #endif
-            if (!foundupgrade && temp.startsWith("Upgrade: websocket")) {
-                foundupgrade = true;
-            } else if (temp.startsWith("Sec-WebSocket-Accept: ")) {
-                serverKey = temp.substring(22,temp.length() - 2); // Don't save last CR+LF
+                return false;
             }
-            temp = "";		
+            delay(1);
+            continue;
         }
 
-        if (!socket_client->available()) {
-          delay(20);
+        // Frames the server sent right behind the 101 go to the decoder
+        size_t used = parser.feed(chunk, count);
+        if (parser.done()) {
+            _decoder.preload(chunk + used, count - used);
         }
     }
 
-    key += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-    uint8_t *hash;
-    char result[21];
-    char b64Result[30];
+    return parser.accepted();
+}
 
-    SHA1Context sha;
-    int err;
-    uint8_t Message_Digest[20];
-    
-    err = SHA1Reset(&sha);
-    err = SHA1Input(&sha, reinterpret_cast<const uint8_t *>(key.c_str()), key.length());
-    err = SHA1Result(&sha, Message_Digest);
-    hash = Message_Digest;
 
-    for (int i=0; i<20; ++i) {
-        result[i] = (char)hash[i];
+bool WebSocketClient::handleStream(String& data, uint8_t *opcode) {
+    // Sketches that only call getData() still need queued output to drain
+    flushQueue();
+
+    while (socket_client->connected()) {
+        if (_decoder.poll(*socket_client)) {
+            uint8_t msgtype = _decoder.opcode();
+
+            _startMillis = millis();
+
+            data = "";
+            data.concat((const char *) _decoder.payload(), _decoder.length());
+            if (opcode != NULL) {
+                *opcode = msgtype;
+            }
+            if (msgtype & 0x08) {
+                handleControlFrame();
+            }
+            _decoder.release();
+            return true;
+        }
+
+        if (_decoder.failed()) {
+            closeStream(_decoder.error());
+            return false;
+        }
+
+        // Nothing has arrived yet, don't wait for it
+        if (!_decoder.busy()) {
+            return false;
+        }
+
+        // Rest of the frame is still in flight
+        delay(1);
     }
-    result[20] = '\0';
 
-    base64_encode(b64Result, result, 20);
+    return false;
+}
+
+size_t WebSocketClient::receiveBatch(WebSocketMessageView *views, size_t maxMessages) {
+    size_t count = 0;
+
+    _batch.clear();
+    if (socket_client == NULL) {
+        return 0;
+    }
+#if CALLBACK_FUNCTIONS
+    // The I/O task has already decoded the messages
+    if (_io.running()) {
+        WebSocketMessage *message;
+
+        while (count < maxMessages && (message = _io.peekIncoming()) != NULL) {
+            if (message->opcode == WS_OPCODE_TEXT || message->opcode == WS_OPCODE_BINARY) {
+                if (!_batch.append(message->data(), message->length)) {
+                    // Not even one fits: it never will, so give up on it
+                    if (count == 0) {
+                        uint8_t status[2] = { (uint8_t) (WS_CLOSE_TOO_BIG >> 8), (uint8_t) (WS_CLOSE_TOO_BIG & 0xFF) };
+
+                        _io.nextIncoming();
+                        WebSocketMessage::destroy(message);
+                        _io.send(WS_IO_FAIL, status, sizeof(status));
+                    }
+                    break;
+                }
+                views[count].opcode = message->opcode;
+                views[count].length = message->length;
+                count++;
+            } else {
+                _callbacks.dispatch(message->opcode, message->data(), message->length);
+            }
+            _io.nextIncoming();
+            WebSocketMessage::destroy(message);
+        }
+        _batch.resolve(views, count);
+        return count;
+    }
+#endif
+
+    flushQueue();
+
+    while (count < maxMessages && socket_client->connected() && _decoder.poll(*socket_client)) {
+        uint8_t opcode = _decoder.opcode();
+
+        _startMillis = millis();
+
+        if (opcode & 0x08) {
+            handleControlFrame();
+        } else {
+            // Out of memory: leave the message for the next call, unless
+            // it is the first, which would never fit
+            if (!_batch.append(_decoder.payload(), _decoder.length())) {
+                if (count == 0) {
+                    _decoder.release();
+                    closeStream(WS_CLOSE_TOO_BIG);
+                }
+                break;
+            }
+            views[count].opcode = opcode;
+            views[count].length = _decoder.length();
+            count++;
+        }
+        _decoder.release();
+    }
+
+    if (_decoder.failed() && socket_client->connected()) {
+        closeStream(_decoder.error());
+    }
+
+    _batch.resolve(views, count);
+    return count;
+}
+
+void WebSocketClient::poll() {
+#if CALLBACK_FUNCTIONS
+    if (_io.running()) {
+        dispatchIncoming();
+        return;
+    }
+    // Messages other threads sent since the last call; while reconnecting
+    // they wait for the new connection
+    if (socket_client != NULL && socket_client->connected()) {
+        sendOutgoing();
+    }
+#endif
+    if (_reconnectPort == 0) {
+        pollSocket();
+    } else if (socket_client == NULL || !socket_client->connected()) {
+        reconnect();
+    } else if (!pollSocket() && !_requestReady) {
+        // Nothing to do right now, so the next handshake costs nothing later
+        prepareHandshake();
+    }
+#if CALLBACK_FUNCTIONS
+    _io.setBlocked(_queue.blocked());
+#endif
+}
 
-    // if the keys match, good to go
-    return serverKey.equals(String(b64Result));
+void WebSocketClient::setReconnect(Client &client, uint16_t port, unsigned long minDelayMs,
+                                   unsigned long maxDelayMs) {
+    socket_client = &client;
+    _reconnectPort = port;
+    _reconnectMin = minDelayMs > 0 ? minDelayMs : 1;
+    _reconnectMax = maxDelayMs > _reconnectMin ? maxDelayMs : _reconnectMin;
+    _reconnectAttempts = 0;
 }
 
+void WebSocketClient::reconnect() {
+    // Retry at once after a drop, then only once the backoff delay is over
+    if (_reconnectAttempts > 0 && (long) (millis() - _reconnectAt) < 0) {
+        return;
+    }
 
-bool WebSocketClient::handleStream(String& data, uint8_t *opcode) {
-    uint8_t msgtype;
-    uint8_t bite;
-    unsigned int length;
-    uint8_t mask[4];
-    uint8_t index;
-    unsigned int i;
-    bool hasMask = false;
-
-    if (!socket_client->connected() || !socket_client->available())
-    {
-        return false;
-    }      
+#ifdef DEBUGGING
+    Serial.println(F("Reconnecting"));
+#endif
+    if (socket_client->connect(host, _reconnectPort) && handshake(*socket_client)) {
+        _reconnectAttempts = 0;
+        notify(WS_EVENT_CONNECT, NULL, 0);
+        return;
+    }
+    socket_client->stop();
+    _reconnectAttempts++;
+
+    unsigned long wait = _reconnectMin;
+    for (uint32_t i = 1; i < _reconnectAttempts && wait < _reconnectMax; ++i) {
+        wait *= 2;
+    }
+    if (wait > _reconnectMax) {
+        wait = _reconnectMax;
+    }
+
+    // Somewhere in the second half of it, so clients dropped together by
+    // the same outage don't all come back at the same moment
+    _reconnectAt = millis() + wait / 2 + random(0, wait / 2 + 1);
+}
 
-    msgtype = timedRead();
-    if (!socket_client->connected()) {
+bool WebSocketClient::addReplay(const char *message, uint8_t opcode) {
+    if (_replayCount >= WS_REPLAY_MESSAGES) {
         return false;
     }
 
-    length = timedRead();
+    _replay[_replayCount] = message;
+    _replayOpcodes[_replayCount] = opcode;
+    _replayCount++;
+    return true;
+}
 
-    if (length & WS_MASK) {
-        hasMask = true;
-        length = length & ~WS_MASK;
+void WebSocketClient::clearReplay() {
+    while (_replayCount > 0) {
+        _replay[--_replayCount] = "";
     }
+}
 
+void WebSocketClient::sendReplay() {
+    for (uint8_t i = 0; i < _replayCount; ++i) {
+        sendEncodedData(reinterpret_cast<const uint8_t *>(_replay[i].c_str()), _replay[i].length(),
+                        _replayOpcodes[i]);
+    }
+}
+
+bool WebSocketClient::pollSocket() {
+    bool busy = false;
 
-    if (!socket_client->connected()) {
+    if (socket_client == NULL) {
         return false;
     }
 
-    index = 6;
+    while (socket_client->connected() && canNotify() && _decoder.poll(*socket_client)) {
+        uint8_t opcode = _decoder.opcode();
 
-    if (length == WS_SIZE16) {
-        length = timedRead() << 8;
-        if (!socket_client->connected()) {
-            return false;
+        _startMillis = millis();
+        busy = true;
+
+        if (opcode & 0x08) {
+            handleControlFrame();
+        } else {
+            notify(opcode, _decoder.payload(), _decoder.length());
         }
-            
-        length |= timedRead();
-        if (!socket_client->connected()) {
-            return false;
-        }   
+        _decoder.release();
+    }
 
-    } else if (length == WS_SIZE64) {
-#ifdef DEBUGGING
-        Serial.println(F("No support for over 16 bit sized messages"));
+    if (_decoder.failed() && socket_client->connected()) {
+        closeStream(_decoder.error());
+    }
+
+    if (socket_client->connected()) {
+        keepalive();
+    }
+
+    if (socket_client->connected()) {
+        busy |= flushQueue() > 0;
+    }
+    return busy;
+}
+
+void WebSocketClient::notify(uint8_t opcode, const uint8_t *payload, size_t length) {
+#if CALLBACK_FUNCTIONS
+    // With an I/O task the handlers run on the application's thread instead
+    if (_io.running()) {
+        // Out of memory for a copy: fail rather than lose a message silently
+        if (!_io.deliver(opcode, payload, length) && opcode < WS_OPCODE_CLOSE) {
+            closeStream(WS_CLOSE_INTERNAL_ERROR);
+        }
+        return;
+    }
+    _callbacks.dispatch(opcode, payload, length);
+#else
+    (void) opcode;
+    (void) payload;
+    (void) length;
+#endif
+}
+
+bool WebSocketClient::canNotify() const {
+#if CALLBACK_FUNCTIONS
+    // Leave data in the socket while the application is behind
+    return !_io.running() || _io.canDeliver();
+#else
+    return true;
 #endif
+}
+
+#if CALLBACK_FUNCTIONS
+bool WebSocketClient::beginIoTask(int core) {
+    if (socket_client == NULL) {
         return false;
     }
+    return _io.begin(ioStep, this, core);
+}
 
-    if (hasMask) {
-        // get the mask
-        mask[0] = timedRead();
-        if (!socket_client->connected()) {
-            return false;
-        }
+void WebSocketClient::endIoTask() {
+    _io.end();
+}
 
-        mask[1] = timedRead();
-        if (!socket_client->connected()) {
+void WebSocketClient::onOutgoing(WebSocketEventCallback callback, void *context) {
+    _io.onOutgoing(callback, context);
+}
 
-            return false;
-        }
+bool WebSocketClient::ioStep(void *owner) {
+    WebSocketClient *client = (WebSocketClient *) owner;
+    bool busy = client->sendOutgoing();
 
-        mask[2] = timedRead();
-        if (!socket_client->connected()) {
-            return false;
+    busy |= client->pollSocket();
+    client->_io.setBlocked(client->_queue.blocked());
+    return busy;
+}
+
+bool WebSocketClient::sendOutgoing() {
+    WebSocketMessage *message;
+    bool busy = false;
+
+    // What the queue had no room for last time goes first
+    _sender.releaseHeld();
+    while ((message = _io.nextOutgoing()) != NULL) {
+        // Whole messages wait while another is partly queued
+        if (!_sender.hold(message)) {
+            sendMessage(message);
+            WebSocketMessage::destroy(message);
         }
+        busy = true;
+    }
+    return busy;
+}
 
-        mask[3] = timedRead();
-        if (!socket_client->connected()) {
-            return false;
+void WebSocketClient::sendMessage(WebSocketMessage *message) {
+    if (message->opcode == WS_IO_FLUSH) {
+        flushQueue(true);
+    } else if (message->opcode == WS_IO_FAIL) {
+        closeStream((message->data()[0] << 8) | message->data()[1]);
+    } else if (_sender.queueOutgoing(message)) {
+        // A streamed piece, fragment or region
+    } else {
+        sendEncodedData(message->data(), message->length, message->opcode);
+    }
+}
+
+void WebSocketClient::dispatchIncoming() {
+    WebSocketMessage *message;
+
+    while ((message = _io.nextIncoming()) != NULL) {
+        _callbacks.dispatch(message->opcode, message->data(), message->length);
+        WebSocketMessage::destroy(message);
+    }
+}
+#endif
+
+bool WebSocketClient::sendable() {
+    return socket_client != NULL && socket_client->connected();
+}
+
+WebSocketSendStatus WebSocketClient::send(const uint8_t *data, size_t length, uint8_t opcode) {
+#if CALLBACK_FUNCTIONS
+    WebSocketSendStatus status;
+
+    // The I/O task owns the socket and the send queue
+    if (_io.offThread()) {
+        if (!_io.send(opcode, data, length)) {
+            return WS_SEND_OVERFLOW;
         }
+        return _io.blocked() ? WS_SEND_WOULD_BLOCK : WS_SEND_QUEUED;
     }
-        
-    data = "";
-        
-    if (opcode != NULL)
-    {
-      *opcode = msgtype & ~WS_FIN;
-    }
-                
-    if (hasMask) {
-        for (i=0; i<length; ++i) {
-            data += (char) (timedRead() ^ mask[i % 4]);
-            if (!socket_client->connected()) {
-                return false;
+#endif
+    if (socket_client == NULL || !socket_client->connected()) {
+        return WS_SEND_CLOSED;
+    }
+#if CALLBACK_FUNCTIONS
+    if (_sender.hold(opcode, data, length, status)) {
+        return status;
+    }
+#endif
+    return sendEncodedData(data, length, opcode);
+}
+
+void WebSocketClient::setKeepalive(unsigned long intervalMs, unsigned long timeoutMs) {
+    _keepaliveInterval = intervalMs;
+    _keepaliveTimeout = timeoutMs;
+    _lastPingMillis = millis();
+}
+
+void WebSocketClient::keepalive() {
+    unsigned long now = millis();
+
+    if (_keepaliveTimeout > 0 && now - _startMillis >= _keepaliveTimeout) {
+#ifdef DEBUGGING
+        Serial.println(F("Connection idle, closing"));
+#endif
+        closeStream(WS_CLOSE_GOING_AWAY);
+        return;
+    }
+
+    if (_keepaliveInterval > 0 && now - _lastPingMillis >= _keepaliveInterval) {
+        // The payload carries a sequence number so a late pong for an older
+        // ping is not mistaken for the current one.
+        uint8_t payload[4];
+
+        _pingSequence++;
+        payload[0] = (uint8_t) (_pingSequence >> 24);
+        payload[1] = (uint8_t) (_pingSequence >> 16);
+        payload[2] = (uint8_t) (_pingSequence >> 8);
+        payload[3] = (uint8_t) _pingSequence;
+
+        _lastPingMillis = now;
+        _pingSentMicros = micros();
+        sendEncodedData(payload, sizeof(payload), WS_OPCODE_PING);
+    }
+}
+
+void WebSocketClient::handleControlFrame() {
+    const uint8_t *payload = _decoder.payload();
+    size_t length = _decoder.length();
+
+    switch (_decoder.opcode()) {
+    case WS_OPCODE_PING:
+        sendEncodedData(payload, length, WS_OPCODE_PONG);
+        notify(WS_OPCODE_PING, payload, length);
+        break;
+
+    case WS_OPCODE_PONG:
+        if (length == 4 && _pingSequence != 0) {
+            uint32_t sequence = ((uint32_t) payload[0] << 24) | ((uint32_t) payload[1] << 16)
+                              | ((uint32_t) payload[2] << 8) | payload[3];
+            if (sequence == _pingSequence) {
+                _roundTripMicros = micros() - _pingSentMicros;
             }
         }
-    } else {
-        for (i=0; i<length; ++i) {
-            data += (char) timedRead();
-            if (!socket_client->connected()) {
-                return false;
-            }
-        }            
+        notify(WS_OPCODE_PONG, payload, length);
+        break;
+
+    case WS_OPCODE_CLOSE:
+        notify(WS_OPCODE_CLOSE, payload, length);
+        closeStream(_decoder.closeCode() == WS_CLOSE_NO_STATUS ? WS_CLOSE_NORMAL : _decoder.closeCode());
+        break;
     }
-    
-    return true;
 }
 
+#if CALLBACK_FUNCTIONS
+void WebSocketClient::onDrain(WebSocketEventCallback callback, void *context) {
+    _callbacks.drain = callback;
+    _callbacks.drainContext = context;
+}
+
+void WebSocketClient::onConnect(WebSocketEventCallback callback, void *context) {
+    _callbacks.connect = callback;
+    _callbacks.connectContext = context;
+}
+
+void WebSocketClient::onText(WebSocketDataCallback callback, void *context) {
+    _callbacks.text = callback;
+    _callbacks.textContext = context;
+}
+
+void WebSocketClient::onBinary(WebSocketDataCallback callback, void *context) {
+    _callbacks.binary = callback;
+    _callbacks.binaryContext = context;
+}
+
+void WebSocketClient::onPing(WebSocketDataCallback callback, void *context) {
+    _callbacks.ping = callback;
+    _callbacks.pingContext = context;
+}
+
+void WebSocketClient::onPong(WebSocketDataCallback callback, void *context) {
+    _callbacks.pong = callback;
+    _callbacks.pongContext = context;
+}
+
+void WebSocketClient::onClose(WebSocketCloseCallback callback, void *context) {
+    _callbacks.close = callback;
+    _callbacks.closeContext = context;
+}
+#endif
+
 void WebSocketClient::disconnectStream() {
 #ifdef DEBUGGING
     Serial.println(F("Terminating socket"));
 #endif
-    // Should send 0x8700 to server to tell it I'm quitting here.
-    socket_client->write((uint8_t) 0x87);
-    socket_client->write((uint8_t) 0x00);
+    // A masked close with a normal status, ahead of any queued data
+    uint8_t status[2] = { (uint8_t) (WS_CLOSE_NORMAL >> 8), (uint8_t) (WS_CLOSE_NORMAL & 0xFF) };
+    _queue.pushFrame(WS_FIN | WS_OPCODE_CLOSE, status, sizeof(status), true);
+    _queue.flush(*socket_client);
     
     socket_client->flush();
     delay(10);
     socket_client->stop();
 }
 
+void WebSocketClient::closeStream(uint16_t code) {
+#ifdef DEBUGGING
+    Serial.print(F("Closing socket with status "));
+    Serial.println(code);
+#endif
+    uint8_t status[2] = { (uint8_t) (code >> 8), (uint8_t) (code & 0xFF) };
+
+    sendEncodedData(status, sizeof(status), WS_OPCODE_CLOSE);
+    socket_client->flush();
+    delay(10);
+    socket_client->stop();
+}
+
 bool WebSocketClient::getData(String& data, uint8_t *opcode) {
+#if CALLBACK_FUNCTIONS
+    // Messages go to the handlers while the I/O task runs
+    if (_io.running()) {
+        return false;
+    }
+#endif
     return handleStream(data, opcode);
 }    
 
-void WebSocketClient::sendData(const char *str, uint8_t opcode) {
+WebSocketSendStatus WebSocketClient::sendData(const char *str, uint8_t opcode) {
 #ifdef DEBUGGING
     Serial.print(F("Sending data: "));
     Serial.println(str);
 #endif
-    if (socket_client->connected()) {
-        sendEncodedData(str, opcode);       
-    }
+    return send((const uint8_t *) str, strlen(str), opcode);
 }
 
-void WebSocketClient::sendData(String str, uint8_t opcode) {
-#ifdef DEBUGGING
-    Serial.print(F("Sending data: "));
-    Serial.println(str);
-#endif
-    if (socket_client->connected()) {
-        sendEncodedData(str, opcode);
-    }
+WebSocketSendStatus WebSocketClient::sendData(String str, uint8_t opcode) {
+    return sendData(str.c_str(), opcode);
+}
+
+void WebSocketClient::setSendQueueWatermarks(size_t high, size_t low) {
+    _queue.setWatermarks(high, low);
+}
+
+void WebSocketClient::setFragmentSize(size_t length) {
+    _fragmentLength = length;
+    _queue.setFragmentLength(length);
+}
+
+uint8_t *WebSocketClient::reserveFrame(size_t maxLength) {
+    return _sender.reserveFrame(maxLength);
 }
 
-int WebSocketClient::timedRead() {
-  while (!socket_client->available()) {
-    delay(20);  
-  }
+WebSocketSendStatus WebSocketClient::commitFrame(uint8_t opcode, size_t length, bool final) {
+    return _sender.commitFrame(opcode, length, final);
+}
 
-  return socket_client->read();
+WebSocketSendStatus WebSocketClient::beginMessage(uint8_t opcode, uint64_t length) {
+    return _sender.beginMessage(opcode, length);
 }
 
-void WebSocketClient::sendEncodedData(char *str, uint8_t opcode) {
-    uint8_t mask[4];
-    int size = strlen(str);
+WebSocketSendStatus WebSocketClient::write(const uint8_t *data, size_t length) {
+    return _sender.write(data, length);
+}
 
-    // Opcode; final fragment
-    socket_client->write(opcode | WS_FIN);
+WebSocketSendStatus WebSocketClient::endMessage() {
+    return _sender.endMessage();
+}
 
-    // NOTE: no support for > 16-bit sized messages
-    if (size > 125) {
-        socket_client->write(WS_SIZE16 | WS_MASK);
-        socket_client->write((uint8_t) (size >> 8));
-        socket_client->write((uint8_t) (size & 0xFF));
-    } else {
-        socket_client->write((uint8_t) size | WS_MASK);
+WebSocketSendStatus WebSocketClient::sendRegion(const uint8_t *data, size_t length, uint8_t opcode,
+                                             WebSocketRegionRelease release, void *context) {
+    return _sender.sendRegion(data, length, opcode, release, context);
+}
+
+#if defined(__linux__)
+WebSocketSendStatus WebSocketClient::sendFile(const char *path, uint8_t opcode) {
+    return _sender.sendFile(path, opcode);
+}
+#endif
+
+#if defined(ESP32)
+WebSocketSendStatus WebSocketClient::sendPartition(const esp_partition_t *partition, size_t offset, size_t length,
+                                                uint8_t opcode) {
+    return _sender.sendPartition(partition, offset, length, opcode);
+}
+#endif
+
+void WebSocketClient::setCoalescing(size_t bytes, unsigned long windowMicros) {
+    _queue.setCoalescing(bytes, windowMicros);
+}
+
+void WebSocketClient::flush() {
+#if CALLBACK_FUNCTIONS
+    if (_io.offThread()) {
+        _io.send(WS_IO_FLUSH, NULL, 0);
+        return;
+    }
+#endif
+    if (socket_client != NULL && socket_client->connected()) {
+        flushQueue(true);
     }
+}
 
-    mask[0] = random(0, 256);
-    mask[1] = random(0, 256);
-    mask[2] = random(0, 256);
-    mask[3] = random(0, 256);
-    
-    socket_client->write(mask[0]);
-    socket_client->write(mask[1]);
-    socket_client->write(mask[2]);
-    socket_client->write(mask[3]);
-     
-    for (int i=0; i<size; ++i) {
-        socket_client->write(str[i] ^ mask[i % 4]);
+size_t WebSocketClient::flushQueue(bool force) {
+    if (_queue.empty() || !(force || _queue.due())) {
+        return 0;
+    }
+
+    size_t written = _queue.flush(*socket_client);
+    if (_queue.drained()) {
+        notify(WS_EVENT_DRAIN, NULL, 0);
     }
+    return written;
 }
 
-void WebSocketClient::sendEncodedData(String str, uint8_t opcode) {
-    int size = str.length() + 1;
-    char cstr[size];
+WebSocketSendStatus WebSocketClient::sendEncodedData(char *str, uint8_t opcode) {
+    return sendEncodedData((const uint8_t *) str, strlen(str), opcode);
+}
+
+WebSocketSendStatus WebSocketClient::sendEncodedData(const uint8_t *str, size_t size, uint8_t opcode) {
+    bool queued;
 
-    str.toCharArray(cstr, size);
+    // Control frames jump ahead of queued data at the next frame boundary
+    if (opcode & 0x08) {
+        queued = _queue.pushFrame(opcode | WS_FIN, str, size, true);
+    } else {
+        queued = _queue.pushMessage(opcode, str, size, true, _fragmentLength);
+    }
+    if (!queued) {
+        return WS_SEND_OVERFLOW;
+    }
+
+    flushQueue();
+    return _queue.blocked() ? WS_SEND_WOULD_BLOCK : WS_SEND_QUEUED;
+}
 
-    sendEncodedData(cstr, opcode);
+WebSocketSendStatus WebSocketClient::sendEncodedData(String str, uint8_t opcode) {
+    return sendEncodedData((const uint8_t *) str.c_str(), str.length(), opcode);
 }
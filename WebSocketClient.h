@@ -46,16 +46,23 @@ http://tools.ietf.org/html/draft-hixie-thewebsocketprotocol-75
 #include <Arduino.h>
 #include <Stream.h>
 #include "Client.h"
+#include "WebSocketFrame.h"
+#include "WebSocketCallbacks.h"
+#include "WebSocketSendQueue.h"
+#include "WebSocketSender.h"
+#include "WebSocketRegion.h"
+#include "WebSocketIoTask.h"
 
 // CRLF characters to terminate lines/handshakes in headers.
 #define CRLF "\r\n"
 
 // Amount of time (in ms) a user may be connected before getting disconnected 
-// for timing out (i.e. not sending any data to the server).
+// for timing out (i.e. not sending any data to the server). Used as the
+// default idle timeout by setKeepalive().
 #define TIMEOUT_IN_MS 10000
 
-// ACTION_SPACE is how many actions are allowed in a program. Defaults to 
-// 5 unless overwritten by user.
+// CALLBACK_FUNCTIONS enables the onText()/onBinary()/onPing()/onPong()/onClose()
+// handlers invoked from poll(). Set to 0 to compile them out.
 #ifndef CALLBACK_FUNCTIONS
 #define CALLBACK_FUNCTIONS 1
 #endif
@@ -68,22 +75,25 @@ http://tools.ietf.org/html/draft-hixie-thewebsocketprotocol-75
 
 #define SIZE(array) (sizeof(array) / sizeof(*array))
 
-// WebSocket protocol constants
-// First byte
-#define WS_FIN            0x80
-#define WS_OPCODE_TEXT    0x01
-#define WS_OPCODE_BINARY  0x02
-#define WS_OPCODE_CLOSE   0x08
-#define WS_OPCODE_PING    0x09
-#define WS_OPCODE_PONG    0x0a
-// Second byte
-#define WS_MASK           0x80
-#define WS_SIZE16         126
-#define WS_SIZE64         127
+// Reconnect backoff: the first retry waits about WS_RECONNECT_MIN_MS, each
+// further one twice as long, up to WS_RECONNECT_MAX_MS.
+#ifndef WS_RECONNECT_MIN_MS
+#define WS_RECONNECT_MIN_MS 250
+#endif
+#ifndef WS_RECONNECT_MAX_MS
+#define WS_RECONNECT_MAX_MS 30000
+#endif
+
+// Messages addReplay() keeps for sending after each handshake.
+#ifndef WS_REPLAY_MESSAGES
+#define WS_REPLAY_MESSAGES 8
+#endif
 
   
-class WebSocketClient {
+class WebSocketClient : private WebSocketSender::Connection {
 public:
+    WebSocketClient();
+    ~WebSocketClient();
 
     // Handle connection requests to validate and process/refuse
     // connections.
@@ -92,9 +102,148 @@ public:
     // Get data off of the stream
     bool getData(String& data, uint8_t *opcode = NULL);
 
-    // Write data to the stream
-    void sendData(const char *str, uint8_t opcode = WS_OPCODE_TEXT);
-    void sendData(String str, uint8_t opcode = WS_OPCODE_TEXT);
+    // Decode every complete message the socket already holds, up to
+    // maxMessages, without waiting for more. Data messages are returned in
+    // views, their payloads back to back in one buffer that stays valid
+    // until the next call; control frames are answered as in poll(). Returns
+    // the number of views filled.
+    size_t receiveBatch(WebSocketMessageView *views, size_t maxMessages = WS_RECEIVE_BATCH);
+
+    // Decode every frame the server has sent so far and hand it to the
+    // registered handlers. Never waits for data; call it from loop().
+    void poll();
+
+    // Keep the connection up by itself: whenever it is down, poll() connects
+    // client to host:port and repeats the handshake, at once after a drop
+    // and then after jittered delays that double from minDelayMs up to
+    // maxDelayMs. The request for the next handshake, key and expected
+    // accept value included, is prepared while the link is idle. Not with
+    // the I/O task running. A port of 0 turns it off.
+    void setReconnect(Client &client, uint16_t port, unsigned long minDelayMs = WS_RECONNECT_MIN_MS,
+                      unsigned long maxDelayMs = WS_RECONNECT_MAX_MS);
+
+    // Failed connection attempts since the link was last up.
+    uint32_t reconnectAttempts() const { return _reconnectAttempts; }
+
+    // Send message after every successful handshake, e.g. subscriptions,
+    // so a reconnect restores them. False if WS_REPLAY_MESSAGES are kept
+    // already.
+    bool addReplay(const char *message, uint8_t opcode = WS_OPCODE_TEXT);
+    void clearReplay();
+
+    // Send a ping every intervalMs from poll() and close the connection when
+    // nothing has been received for timeoutMs. Zero disables either part.
+    void setKeepalive(unsigned long intervalMs, unsigned long timeoutMs = TIMEOUT_IN_MS);
+
+    // Round trip time of the last answered keepalive ping, in microseconds.
+    // Zero until the first pong arrives.
+    unsigned long getRoundTripTime() const { return _roundTripMicros; }
+
+#if CALLBACK_FUNCTIONS
+    // Called from poll() once a queue that reported WS_SEND_WOULD_BLOCK has
+    // drained below its low-water mark.
+    void onDrain(WebSocketEventCallback callback, void *context = NULL);
+
+    void onText(WebSocketDataCallback callback, void *context = NULL);
+    void onBinary(WebSocketDataCallback callback, void *context = NULL);
+    void onPing(WebSocketDataCallback callback, void *context = NULL);
+    void onPong(WebSocketDataCallback callback, void *context = NULL);
+    void onClose(WebSocketCloseCallback callback, void *context = NULL);
+    // Called from poll() once an automatic reconnect has succeeded and the
+    // replay messages are queued.
+    void onConnect(WebSocketEventCallback callback, void *context = NULL);
+
+    // Hand the socket to a dedicated I/O task, pinned to core on the ESP32
+    // (-1 for any). poll() then only runs the handlers for messages the task
+    // has decoded, sendData() passes messages to the task, and getData() is
+    // unavailable. Don't use the Client directly while the task runs.
+    bool beginIoTask(int core = -1);
+    void endIoTask();
+
+    // Sends from a thread other than the one that ran handshake() and
+    // calls poll() are queued, and poll() writes them out. callback runs
+    // on the sending thread after each. Must be thread safe.
+    void onOutgoing(WebSocketEventCallback callback, void *context = NULL);
+#endif
+
+    // Write data to the stream. The frame is queued and written as far as
+    // the socket allows; poll() sends the rest. WS_SEND_WOULD_BLOCK asks the
+    // producer to back off until the queue drains (see onDrain()). With
+    // CALLBACK_FUNCTIONS, sendData(), sendRegion() and flush() may be called
+    // from any thread; each thread's messages go out in order. A
+    // reserveFrame() or beginMessage() message must come from one thread at
+    // a time.
+    WebSocketSendStatus sendData(const char *str, uint8_t opcode = WS_OPCODE_TEXT);
+    WebSocketSendStatus sendData(String str, uint8_t opcode = WS_OPCODE_TEXT);
+
+    // Queue sizes (in bytes) at which sendData() starts and stops reporting
+    // WS_SEND_WOULD_BLOCK.
+    void setSendQueueWatermarks(size_t high, size_t low);
+
+    // Heap held by this connection's buffers: the message being received,
+    // queued output, receiveBatch() payloads and I/O task messages.
+    const WebSocketMemory &memory() const { return _memory; }
+
+    // Messages longer than length bytes are sent as several fragments so
+    // pongs and closes can go out in between. 0 sends every message whole.
+    void setFragmentSize(size_t length);
+
+    // Gather small messages into fewer, larger writes. Queued frames are
+    // held until bytes are waiting or windowMicros has passed since the
+    // first of them; poll() sends them once the window closes. Control
+    // frames go out at once. 0 bytes turns coalescing off.
+    void setCoalescing(size_t bytes, unsigned long windowMicros);
+
+    // Encode a message straight into the send queue, e.g. with a
+    // WebSocketCborWriter: reserveFrame() returns room for up to maxLength
+    // payload bytes (NULL if that doesn't fit), commitFrame() sends the
+    // length bytes written there as one frame. A reservation that is never
+    // committed is simply dropped; on another thread than the owner's it
+    // lasts until that thread's next reserveFrame(). With final false the
+    // frame is a fragment: the message goes on in frames with opcode
+    // WS_OPCODE_CONTINUATION, and no other data may be sent until the final
+    // one. Data other threads send meanwhile waits for it, and
+    // reserveFrame() returns NULL on them.
+    uint8_t *reserveFrame(size_t maxLength);
+    WebSocketSendStatus commitFrame(uint8_t opcode, size_t length, bool final = true);
+
+    // Stream a message larger than memory, e.g. a log dump from flash.
+    // Given its length, beginMessage() sends one frame with that length in
+    // the header, and write() must supply exactly that many bytes before
+    // endMessage(); ending short drops the connection. With
+    // WS_LENGTH_UNKNOWN every write() goes out as a fragment. Back off on
+    // WS_SEND_WOULD_BLOCK; a chunk refused with WS_SEND_OVERFLOW was not
+    // sent and can be offered again after poll(). Send no other data until
+    // endMessage(). Data other threads send meanwhile waits for it, and
+    // beginMessage() returns WS_SEND_OVERFLOW on them. Control frames wait
+    // for the end of a known length frame.
+    WebSocketSendStatus beginMessage(uint8_t opcode, uint64_t length = WS_LENGTH_UNKNOWN);
+    WebSocketSendStatus write(const uint8_t *data, size_t length);
+    WebSocketSendStatus endMessage();
+
+    // Send length bytes from memory that stays put until they are out, e.g. a
+    // constant asset or mapped flash, without copying them into the send queue.
+    // The payload is written straight from data as the socket drains, masked a
+    // chunk at a time, in setFragmentSize() fragments whose headers are
+    // generated on the way. release(context, data, length) is called once it has
+    // been, also if the connection goes away first; on a status other than
+    // WS_SEND_QUEUED or WS_SEND_WOULD_BLOCK the region is still the caller's. Up
+    // to WS_SEND_QUEUE_REGIONS may wait.
+    WebSocketSendStatus sendRegion(const uint8_t *data, size_t length, uint8_t opcode = WS_OPCODE_BINARY,
+                                   WebSocketRegionRelease release = NULL, void *context = NULL);
+#if defined(__linux__)
+    // Send a whole file as one message, mapped instead of read.
+    WebSocketSendStatus sendFile(const char *path, uint8_t opcode = WS_OPCODE_BINARY);
+#endif
+#if defined(ESP32)
+    // Send part of a flash data partition as one message.
+    WebSocketSendStatus sendPartition(const esp_partition_t *partition, size_t offset, size_t length,
+                                      uint8_t opcode = WS_OPCODE_BINARY);
+#endif
+
+    // Send everything queued right away, e.g. after a latency critical
+    // message.
+    void flush();
 
     char *path;
     char *host;
@@ -102,23 +251,101 @@ public:
 
 private:
     Client *socket_client;
+
+    // Start of the current idle period, i.e. when the last frame arrived
     unsigned long _startMillis;
 
+    unsigned long _keepaliveInterval;
+    unsigned long _keepaliveTimeout;
+    unsigned long _lastPingMillis;
+    unsigned long _pingSentMicros;
+    unsigned long _roundTripMicros;
+    uint32_t _pingSequence;
+
     const char *socket_urlPrefix;
 
+    // Declared first so it outlives the buffers charged to it
+    WebSocketMemory _memory;
+    WebSocketFrameDecoder _decoder;
+    WebSocketSendQueue _queue;
+    WebSocketBatchBuffer _batch;
+    WebSocketSender _sender;
+    size_t _fragmentLength;
+
+    uint16_t _reconnectPort;
+    unsigned long _reconnectMin;
+    unsigned long _reconnectMax;
+    unsigned long _reconnectAt;
+    uint32_t _reconnectAttempts;
+
+    // The next handshake request and the accept value it must get back
+    String _request;
+    char _expectedAccept[29];
+    bool _requestReady;
+
+    String _replay[WS_REPLAY_MESSAGES];
+    uint8_t _replayOpcodes[WS_REPLAY_MESSAGES];
+    uint8_t _replayCount;
+
+#if CALLBACK_FUNCTIONS
+    WebSocketCallbacks _callbacks;
+    WebSocketIoTask _io;
+#endif
+
     // Discovers if the client's header is requesting an upgrade to a
     // websocket connection.
     bool analyzeRequest();
 
     bool handleStream(String& data, uint8_t *opcode);    
+
+    // Answer pings and closes, then pass the frame on to the handlers.
+    void handleControlFrame();
+
+    // Generate a key and build the request around it.
+    void prepareHandshake();
+    // Try to connect again if the backoff delay has passed.
+    void reconnect();
+    void sendReplay();
+
+    // Read, decode and write whatever the socket allows. Returns true if
+    // anything happened.
+    bool pollSocket();
+
+    // Pass a decoded frame or event to the handlers, or to the application
+    // thread when the I/O task runs.
+    void notify(uint8_t opcode, const uint8_t *payload, size_t length);
+    bool canNotify() const;
+
+#if CALLBACK_FUNCTIONS
+    static bool ioStep(void *owner);
+    // Queue what other threads sent, on the thread that owns the socket.
+    bool sendOutgoing();
+    virtual void sendMessage(WebSocketMessage *message);
+    void dispatchIncoming();
+#endif
+
+    // Send from the application, through the I/O task if there is one.
+    WebSocketSendStatus send(const uint8_t *data, size_t length, uint8_t opcode);
+    // The socket is there and connected, for the sender.
+    virtual bool sendable();
+
+    // Send due keepalive pings and drop the connection once it is idle.
+    void keepalive();
     
     // Disconnect user gracefully.
-    void disconnectStream();
-    
-    int timedRead();
+    virtual void disconnectStream();
+
+    // Send a close frame carrying a status code and drop the connection.
+    void closeStream(uint16_t code);
+
+    WebSocketSendStatus sendEncodedData(char *str, uint8_t opcode);
+    WebSocketSendStatus sendEncodedData(String str, uint8_t opcode);
+    WebSocketSendStatus sendEncodedData(const uint8_t *data, size_t length, uint8_t opcode);
+
 
-    void sendEncodedData(char *str, uint8_t opcode);
-    void sendEncodedData(String str, uint8_t opcode);
+    // Write out as much queued data as the socket takes, unless coalescing
+    // says to wait and force is false.
+    virtual size_t flushQueue(bool force = false);
 };
 
 
@@ -0,0 +1,367 @@
+//#define DEBUGGING
+
+#include "WebSocketExecutor.h"
+
+#if defined(__linux__) && CALLBACK_FUNCTIONS
+
+// The worker the current thread runs, if any
+static thread_local WebSocketExecutor *currentExecutor = NULL;
+static thread_local size_t currentWorker = 0;
+
+WebSocketExecutor::WebSocketExecutor() : _workers(NULL), _count(0), _next(0), _queued(0),
+                                         _sleeping(0), _running(false) {
+    _readyCallback = NULL;
+    _readyContext = NULL;
+}
+
+WebSocketExecutor::~WebSocketExecutor() {
+    end();
+}
+
+bool WebSocketExecutor::begin(size_t threads) {
+    if (_workers != NULL) {
+        return false;
+    }
+
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    _workers = new Worker[threads];
+    _count = threads;
+    _running = true;
+    for (size_t i = 0; i < _count; ++i) {
+        _workers[i].thread = std::thread(&WebSocketExecutor::run, this, i);
+    }
+    return true;
+}
+
+void WebSocketExecutor::end() {
+    if (_workers == NULL) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_idleLock);
+        _running = false;
+    }
+    _idle.notify_all();
+
+    for (size_t i = 0; i < _count; ++i) {
+        _workers[i].thread.join();
+    }
+    delete[] _workers;
+    _workers = NULL;
+    _count = 0;
+}
+
+void WebSocketExecutor::onReady(WebSocketEventCallback callback, void *context) {
+    _readyCallback = callback;
+    _readyContext = context;
+}
+
+void WebSocketExecutor::submit(Task task, void *arg) {
+    size_t index;
+    Job job = { task, arg };
+
+    // Not started: run it right here
+    if (_workers == NULL) {
+        task(arg);
+        return;
+    }
+
+    if (currentExecutor == this) {
+        index = currentWorker;
+    } else {
+        index = _next.fetch_add(1, std::memory_order_relaxed) % _count;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_workers[index].lock);
+        _workers[index].jobs.push_back(job);
+    }
+
+    // A sleeper counts itself under _idleLock before it checks _queued, so
+    // it either sees this job or gets the notification
+    _queued.fetch_add(1);
+    if (_sleeping.load() > 0) {
+        std::lock_guard<std::mutex> guard(_idleLock);
+        _idle.notify_one();
+    }
+}
+
+bool WebSocketExecutor::take(size_t self, Job &job) {
+    // Own jobs oldest first, so strands that resubmit themselves take
+    // turns; thieves take from the other end
+    {
+        Worker &worker = _workers[self];
+        std::lock_guard<std::mutex> guard(worker.lock);
+        if (!worker.jobs.empty()) {
+            job = worker.jobs.front();
+            worker.jobs.pop_front();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < _count; ++i) {
+        Worker &victim = _workers[(self + i) % _count];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.jobs.empty()) {
+            job = victim.jobs.back();
+            victim.jobs.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WebSocketExecutor::run(size_t self) {
+    currentExecutor = this;
+    currentWorker = self;
+
+    while (true) {
+        Job job;
+
+        if (take(self, job)) {
+            _queued.fetch_sub(1);
+            job.task(job.arg);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(_idleLock);
+        _sleeping.fetch_add(1);
+        _idle.wait(guard, [this] { return _queued.load() > 0 || !_running; });
+        _sleeping.fetch_sub(1);
+
+        // Stop only once everything queued has run
+        if (!_running && _queued.load() == 0) {
+            break;
+        }
+    }
+
+    currentExecutor = NULL;
+}
+
+void WebSocketExecutor::ready(WebSocketStrand *strand) {
+    bool first;
+
+    {
+        std::lock_guard<std::mutex> guard(_readyLock);
+        first = _ready.empty();
+        _ready.push_back(strand);
+    }
+    if (first && _readyCallback) {
+        _readyCallback(_readyContext);
+    }
+}
+
+void WebSocketExecutor::forget(WebSocketStrand *strand) {
+    std::lock_guard<std::mutex> guard(_readyLock);
+
+    for (std::deque<WebSocketStrand *>::iterator it = _ready.begin(); it != _ready.end(); ++it) {
+        if (*it == strand) {
+            _ready.erase(it);
+            break;
+        }
+    }
+}
+
+WebSocketStrand *WebSocketExecutor::nextReady() {
+    std::lock_guard<std::mutex> guard(_readyLock);
+
+    if (_ready.empty()) {
+        return NULL;
+    }
+    WebSocketStrand *strand = _ready.front();
+    _ready.pop_front();
+    return strand;
+}
+
+size_t WebSocketExecutor::flushReplies() {
+    WebSocketStrand *strand;
+    size_t count = 0;
+
+    while ((strand = nextReady()) != NULL) {
+        count += strand->flush();
+    }
+    return count;
+}
+
+WebSocketStrand::WebSocketStrand(WebSocketExecutor &executor, WebSocketServer &server,
+                                 WebSocketJobHandler handler, void *context)
+    : _executor(executor), _server(server), _handler(handler), _context(context),
+      _userData(NULL), _scheduled(false), _ready(false), _closed(false) {
+    _server.onText(postText, this);
+    _server.onBinary(postBinary, this);
+}
+
+WebSocketStrand::~WebSocketStrand() {
+    drain(_inbox);
+    drain(_replies);
+}
+
+void WebSocketStrand::drain(std::deque<WebSocketMessage *> &messages) {
+    while (!messages.empty()) {
+        WebSocketMessage::destroy(messages.front());
+        messages.pop_front();
+    }
+}
+
+void WebSocketStrand::postText(void *strand, const uint8_t *payload, size_t length) {
+    ((WebSocketStrand *) strand)->post(WS_OPCODE_TEXT, payload, length);
+}
+
+void WebSocketStrand::postBinary(void *strand, const uint8_t *payload, size_t length) {
+    ((WebSocketStrand *) strand)->post(WS_OPCODE_BINARY, payload, length);
+}
+
+bool WebSocketStrand::post(uint8_t opcode, const uint8_t *payload, size_t length) {
+    bool schedule = false;
+    WebSocketMessage *message = WebSocketMessage::create(opcode, payload, length);
+
+    if (message == NULL) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_closed || _inbox.size() >= WS_STRAND_QUEUE_LENGTH) {
+#ifdef DEBUGGING
+            Serial.println(F("Strand full, message dropped"));
+#endif
+            WebSocketMessage::destroy(message);
+            return false;
+        }
+        _inbox.push_back(message);
+
+        // Only one job per strand at a time keeps its messages in order
+        if (!_scheduled) {
+            _scheduled = true;
+            schedule = true;
+        }
+    }
+
+    if (schedule) {
+        _executor.submit(run, this);
+    }
+    return true;
+}
+
+void WebSocketStrand::run(void *arg) {
+    WebSocketStrand *strand = (WebSocketStrand *) arg;
+
+    for (int i = 0; i < WS_STRAND_BATCH; ++i) {
+        WebSocketMessage *message;
+
+        {
+            std::lock_guard<std::mutex> guard(strand->_lock);
+            if (strand->_inbox.empty() || strand->_closed) {
+                break;
+            }
+            message = strand->_inbox.front();
+            strand->_inbox.pop_front();
+        }
+
+        strand->_handler(strand->_context, *strand, message->opcode, message->data(), message->length);
+        WebSocketMessage::destroy(message);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(strand->_lock);
+        if (!strand->_closed && !strand->_inbox.empty()) {
+            // Back of the line, so one busy connection can't hog a worker
+            strand->_executor.submit(run, strand);
+            return;
+        }
+        strand->_scheduled = false;
+        if (!strand->_closed) {
+            return;
+        }
+    }
+
+    // Closed while the handler ran; nobody else refers to it any more
+    delete strand;
+}
+
+bool WebSocketStrand::reply(const char *text) {
+    return reply((const uint8_t *) text, strlen(text), WS_OPCODE_TEXT);
+}
+
+bool WebSocketStrand::reply(const uint8_t *data, size_t length, uint8_t opcode) {
+    WebSocketMessage *message = WebSocketMessage::create(opcode, data, length);
+
+    if (message == NULL) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(_lock);
+    if (_closed) {
+        WebSocketMessage::destroy(message);
+        return false;
+    }
+    _replies.push_back(message);
+
+    // Lock order is strand, then executor, here and in close()
+    if (!_ready) {
+        _ready = true;
+        _executor.ready(this);
+    }
+    return true;
+}
+
+size_t WebSocketStrand::flush() {
+    std::deque<WebSocketMessage *> replies;
+
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        replies.swap(_replies);
+        _ready = false;
+    }
+
+    size_t count = replies.size();
+    while (!replies.empty()) {
+        WebSocketMessage *message = replies.front();
+        replies.pop_front();
+        // As one frame, copied straight into the send queue
+        uint8_t *frame = _server.reserveFrame(message->length);
+        if (frame != NULL) {
+            memcpy(frame, message->data(), message->length);
+            _server.commitFrame(message->opcode, message->length);
+        } else {
+#ifdef DEBUGGING
+            Serial.println(F("Reply doesn't fit, dropped"));
+#endif
+        }
+        WebSocketMessage::destroy(message);
+    }
+    return count;
+}
+
+void WebSocketStrand::close() {
+    bool idle;
+
+    _server.onText(NULL, NULL);
+    _server.onBinary(NULL, NULL);
+
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _closed = true;
+        drain(_inbox);
+        drain(_replies);
+        if (_ready) {
+            _executor.forget(this);
+            _ready = false;
+        }
+        idle = !_scheduled;
+    }
+
+    // Otherwise the worker frees it once the handler returns
+    if (idle) {
+        delete this;
+    }
+}
+
+#endif
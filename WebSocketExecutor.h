@@ -0,0 +1,160 @@
+/*
+ *  WebSocketExecutor.h
+ *
+ *  Description:
+ *      Thread pool for message handlers that are too slow to run on the
+ *      thread that polls the connections. Each worker has its own job
+ *      queue and steals from the others when it runs dry.
+ *
+ *      A WebSocketStrand ties one connection to the pool: it takes over
+ *      the server's onText()/onBinary() handlers and runs the job handler
+ *      for one message at a time, so each connection sees its messages in
+ *      order while different connections run in parallel. Replies from the
+ *      handler are queued on the strand and sent by the polling thread,
+ *      since WebSocketServer itself isn't thread safe.
+ */
+
+#ifndef WEBSOCKETEXECUTOR_H_
+#define WEBSOCKETEXECUTOR_H_
+
+#if defined(__linux__)
+
+#include <Arduino.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "WebSocketServer.h"
+
+#if CALLBACK_FUNCTIONS
+
+// Messages a strand holds for its handler before it drops new ones.
+#ifndef WS_STRAND_QUEUE_LENGTH
+#define WS_STRAND_QUEUE_LENGTH 1024
+#endif
+
+// Messages a strand handles per turn before it lets other strands run.
+#ifndef WS_STRAND_BATCH
+#define WS_STRAND_BATCH 8
+#endif
+
+class WebSocketStrand;
+
+// Runs on a worker thread. Call strand.reply() to answer.
+typedef void (*WebSocketJobHandler)(void *context, WebSocketStrand &strand, uint8_t opcode,
+                                    const uint8_t *payload, size_t length);
+
+class WebSocketExecutor {
+public:
+    typedef void (*Task)(void *arg);
+
+    WebSocketExecutor();
+    ~WebSocketExecutor();
+
+    // Start the workers; 0 means one per core.
+    bool begin(size_t threads = 0);
+    // Finish the queued jobs and stop the workers.
+    void end();
+    size_t threads() const { return _count; }
+
+    // Run task(arg) on a worker. Jobs submitted from a worker go on its own
+    // queue; idle workers steal them from there.
+    void submit(Task task, void *arg);
+
+    // Called on a worker thread when a strand has its first reply waiting,
+    // e.g. to wake the polling thread. Must be thread safe.
+    void onReady(WebSocketEventCallback callback, void *context = NULL);
+
+    // Polling thread: the next strand with replies to send, or NULL.
+    WebSocketStrand *nextReady();
+    // Polling thread: send the replies of every ready strand.
+    size_t flushReplies();
+
+private:
+    friend class WebSocketStrand;
+
+    struct Job {
+        Task task;
+        void *arg;
+    };
+
+    struct Worker {
+        std::mutex lock;
+        std::deque<Job> jobs;
+        std::thread thread;
+    };
+
+    Worker *_workers;
+    size_t _count;
+    std::atomic<size_t> _next;
+    std::atomic<size_t> _queued;
+    std::atomic<size_t> _sleeping;
+    std::atomic<bool> _running;
+    std::mutex _idleLock;
+    std::condition_variable _idle;
+
+    std::mutex _readyLock;
+    std::deque<WebSocketStrand *> _ready;
+    WebSocketEventCallback _readyCallback;
+    void *_readyContext;
+
+    void run(size_t self);
+    bool take(size_t self, Job &job);
+    void ready(WebSocketStrand *strand);
+    void forget(WebSocketStrand *strand);
+};
+
+class WebSocketStrand {
+public:
+    // Registers itself as the server's onText() and onBinary() handler.
+    WebSocketStrand(WebSocketExecutor &executor, WebSocketServer &server,
+                    WebSocketJobHandler handler, void *context = NULL);
+
+    // Polling thread: queue a message for the handler. False if the strand
+    // is closed or already holds WS_STRAND_QUEUE_LENGTH messages.
+    bool post(uint8_t opcode, const uint8_t *payload, size_t length);
+
+    // Handler: queue a reply for the polling thread to send. The handler
+    // never touches the server itself; once the strand is closed the
+    // server may already belong to the next connection.
+    bool reply(const char *text);
+    bool reply(const uint8_t *data, size_t length, uint8_t opcode = WS_OPCODE_BINARY);
+
+    // Polling thread: send the queued replies.
+    size_t flush();
+
+    // Detach from the server and free the strand once the handler returns.
+    // The strand must not be used afterwards.
+    void close();
+
+    void setUserData(void *data) { _userData = data; }
+    void *userData() const { return _userData; }
+
+private:
+    WebSocketExecutor &_executor;
+    WebSocketServer &_server;
+    WebSocketJobHandler _handler;
+    void *_context;
+    void *_userData;
+
+    std::mutex _lock;
+    std::deque<WebSocketMessage *> _inbox;
+    std::deque<WebSocketMessage *> _replies;
+    bool _scheduled;
+    bool _ready;
+    bool _closed;
+
+    ~WebSocketStrand();
+
+    static void run(void *arg);
+    static void postText(void *strand, const uint8_t *payload, size_t length);
+    static void postBinary(void *strand, const uint8_t *payload, size_t length);
+    static void drain(std::deque<WebSocketMessage *> &messages);
+};
+
+#endif
+
+#endif
+
+#endif
@@ -0,0 +1,336 @@
+//#define DEBUGGING
+
+#include "WebSocketFrame.h"
+
+WebSocketFrameDecoder::WebSocketFrameDecoder() {
+    _buffer = NULL;
+    _capacity = 0;
+    _memory = NULL;
+    _expectMasked = true;
+    reset();
+}
+
+WebSocketFrameDecoder::~WebSocketFrameDecoder() {
+    ws_free(_memory, _buffer, _capacity);
+}
+
+void WebSocketFrameDecoder::reset() {
+    _state = WS_STATE_OPCODE;
+    _ready = false;
+    _error = 0;
+    _messageOpcode = 0;
+    _length = 0;
+    _controlLength = 0;
+    _readyOpcode = 0;
+    _rxStart = 0;
+    _rxEnd = 0;
+}
+
+bool WebSocketFrameDecoder::preload(const uint8_t *data, size_t length) {
+    if (_rxStart != _rxEnd || length > sizeof(_rx)) {
+        return false;
+    }
+
+    memcpy(_rx, data, length);
+    _rxStart = 0;
+    _rxEnd = length;
+    return true;
+}
+
+bool WebSocketFrameDecoder::busy() const {
+    return _state != WS_STATE_OPCODE || _messageOpcode != 0 || _rxStart < _rxEnd;
+}
+
+const uint8_t *WebSocketFrameDecoder::payload() const {
+    return (_readyOpcode & 0x08) ? _control : _buffer;
+}
+
+size_t WebSocketFrameDecoder::length() const {
+    return (_readyOpcode & 0x08) ? _controlLength : _length;
+}
+
+uint16_t WebSocketFrameDecoder::closeCode() const {
+    if (_readyOpcode != WS_OPCODE_CLOSE || _controlLength < 2) {
+        return WS_CLOSE_NO_STATUS;
+    }
+    return ((uint16_t) _control[0] << 8) | _control[1];
+}
+
+void WebSocketFrameDecoder::release() {
+    if (!_ready) {
+        return;
+    }
+    _ready = false;
+    if (_readyOpcode & 0x08) {
+        _controlLength = 0;
+    } else {
+        _length = 0;
+    }
+    _readyOpcode = 0;
+}
+
+bool WebSocketFrameDecoder::poll(Client &client) {
+    while (!_ready && !failed()) {
+        if (_rxStart == _rxEnd) {
+            int count = client.available();
+            if (count <= 0) {
+                break;
+            }
+            if (count > (int) sizeof(_rx)) {
+                count = sizeof(_rx);
+            }
+            count = client.read(_rx, count);
+            if (count <= 0) {
+                break;
+            }
+            _rxStart = 0;
+            _rxEnd = count;
+        }
+        _rxStart += feed(_rx + _rxStart, _rxEnd - _rxStart);
+    }
+
+    return _ready;
+}
+
+void WebSocketFrameDecoder::fail(uint16_t code) {
+#ifdef DEBUGGING
+    Serial.print(F("Frame rejected, closing with "));
+    Serial.println(code);
+#endif
+    _error = code;
+}
+
+bool WebSocketFrameDecoder::reserve(size_t length) {
+    if (length <= _capacity) {
+        return true;
+    }
+
+    size_t capacity = _capacity ? _capacity : 64;
+    while (capacity < length) {
+        capacity *= 2;
+    }
+    if (capacity > WS_MAX_MESSAGE_LENGTH) {
+        capacity = WS_MAX_MESSAGE_LENGTH;
+    }
+
+    uint8_t *buffer = (uint8_t *) ws_realloc(_memory, _buffer, _capacity, capacity);
+    if (buffer == NULL) {
+        return false;
+    }
+    _buffer = buffer;
+    _capacity = capacity;
+    return true;
+}
+
+// Validate the header that was just completed and get ready for the payload.
+bool WebSocketFrameDecoder::beginPayload() {
+    if (_frameOpcode & 0x08) {
+        if (!_frameFin || _frameLength > WS_MAX_CONTROL_LENGTH) {
+            fail(WS_CLOSE_PROTOCOL_ERROR);
+            return false;
+        }
+    } else if (_frameLength > WS_MAX_MESSAGE_LENGTH - _length) {
+        fail(WS_CLOSE_TOO_BIG);
+        return false;
+    } else if (!reserve(_length + _frameLength)) {
+        fail(WS_CLOSE_TOO_BIG);
+        return false;
+    }
+
+    _frameOffset = 0;
+    _headerBytes = 0;
+    _state = _frameMasked ? WS_STATE_MASK : WS_STATE_PAYLOAD;
+    if (_state == WS_STATE_PAYLOAD && _frameLength == 0) {
+        finishFrame();
+    }
+    return true;
+}
+
+void WebSocketFrameDecoder::finishFrame() {
+    _state = WS_STATE_OPCODE;
+
+    if (_frameOpcode & 0x08) {
+        // A close reason is text too
+        if (_frameOpcode == WS_OPCODE_CLOSE && _frameLength > 2
+            && !WebSocketUtf8Validator::validate(_control + 2, _frameLength - 2)) {
+            fail(WS_CLOSE_INVALID_DATA);
+            return;
+        }
+        _controlLength = _frameLength;
+        _readyOpcode = _frameOpcode;
+        _ready = true;
+        return;
+    }
+
+    _length += _frameLength;
+    if (_frameFin) {
+        if (_messageOpcode == WS_OPCODE_TEXT && !_utf8.complete()) {
+            fail(WS_CLOSE_INVALID_DATA);
+            return;
+        }
+        _readyOpcode = _messageOpcode;
+        _messageOpcode = 0;
+        _ready = true;
+    }
+}
+
+size_t WebSocketFrameDecoder::feed(const uint8_t *data, size_t length) {
+    size_t i = 0;
+
+    while (i < length && !_ready && !failed()) {
+        uint8_t bite;
+
+        switch (_state) {
+        case WS_STATE_OPCODE:
+#if WS_LATENCY_HISTOGRAMS
+            // Control frames between fragments don't restart the clock
+            if (_messageOpcode == 0) {
+                _startTicks = wsTicks();
+                _unmaskTicks = 0;
+            }
+#endif
+            bite = data[i++];
+            _frameFin = bite & WS_FIN;
+            _frameOpcode = bite & 0x0F;
+
+            // No extensions are negotiated, so reserved bits must be clear
+            if (bite & 0x70) {
+                fail(WS_CLOSE_PROTOCOL_ERROR);
+            } else if (_frameOpcode == WS_OPCODE_CONTINUATION) {
+                if (_messageOpcode == 0) {
+                    fail(WS_CLOSE_PROTOCOL_ERROR);
+                }
+            } else if (_frameOpcode == WS_OPCODE_TEXT || _frameOpcode == WS_OPCODE_BINARY) {
+                if (_messageOpcode != 0) {
+                    fail(WS_CLOSE_PROTOCOL_ERROR);
+                }
+                _messageOpcode = _frameOpcode;
+                _utf8.reset();
+            } else if (_frameOpcode != WS_OPCODE_CLOSE && _frameOpcode != WS_OPCODE_PING
+                       && _frameOpcode != WS_OPCODE_PONG) {
+                fail(WS_CLOSE_PROTOCOL_ERROR);
+            }
+            _state = WS_STATE_LENGTH;
+            break;
+
+        case WS_STATE_LENGTH:
+            bite = data[i++];
+            _frameMasked = bite & WS_MASK;
+            _frameLength = bite & ~WS_MASK;
+            _headerBytes = 0;
+
+            // Clients always mask, servers never do
+            if (_frameMasked != _expectMasked) {
+                fail(WS_CLOSE_PROTOCOL_ERROR);
+                break;
+            }
+
+            if (_frameLength == WS_SIZE16 || _frameLength == WS_SIZE64) {
+                _headerBytes = (_frameLength == WS_SIZE16) ? 2 : 8;
+                _frameLength = 0;
+                _state = WS_STATE_EXTENDED_LENGTH;
+            } else {
+                beginPayload();
+            }
+            break;
+
+        case WS_STATE_EXTENDED_LENGTH:
+            _frameLength = (_frameLength << 8) | data[i++];
+            if (--_headerBytes == 0) {
+                beginPayload();
+            }
+            break;
+
+        case WS_STATE_MASK:
+            _mask[_headerBytes++] = data[i++];
+            if (_headerBytes == 4) {
+                _state = WS_STATE_PAYLOAD;
+                if (_frameLength == 0) {
+                    finishFrame();
+                }
+            }
+            break;
+
+        case WS_STATE_PAYLOAD: {
+            size_t count = length - i;
+            if (count > _frameLength - _frameOffset) {
+                count = _frameLength - _frameOffset;
+            }
+
+#if WS_LATENCY_HISTOGRAMS
+            WebSocketTicks unmaskStart = wsTicks();
+#endif
+            uint8_t *dest = (_frameOpcode & 0x08) ? _control : _buffer + _length;
+            dest += _frameOffset;
+
+            if (_frameMasked) {
+                for (size_t j = 0; j < count; ++j) {
+                    dest[j] = data[i + j] ^ _mask[(_frameOffset + j) & 3];
+                }
+            } else {
+                memcpy(dest, data + i, count);
+            }
+
+            if (_messageOpcode == WS_OPCODE_TEXT && !(_frameOpcode & 0x08)
+                && !_utf8.update(dest, count)) {
+                fail(WS_CLOSE_INVALID_DATA);
+                break;
+            }
+#if WS_LATENCY_HISTOGRAMS
+            _unmaskTicks += wsTicks() - unmaskStart;
+#endif
+
+            i += count;
+            _frameOffset += count;
+            if (_frameOffset == _frameLength) {
+                finishFrame();
+            }
+            break;
+        }
+        }
+    }
+
+    return i;
+}
+
+WebSocketBatchBuffer::WebSocketBatchBuffer() {
+    _buffer = NULL;
+    _capacity = 0;
+    _length = 0;
+    _memory = NULL;
+}
+
+WebSocketBatchBuffer::~WebSocketBatchBuffer() {
+    ws_free(_memory, _buffer, _capacity);
+}
+
+bool WebSocketBatchBuffer::append(const uint8_t *data, size_t length) {
+    if (length > _capacity - _length) {
+        size_t capacity = _capacity ? _capacity : 256;
+        while (capacity - _length < length) {
+            capacity *= 2;
+        }
+
+        uint8_t *buffer = (uint8_t *) ws_realloc(_memory, _buffer, _capacity, capacity);
+        if (buffer == NULL) {
+            return false;
+        }
+        _buffer = buffer;
+        _capacity = capacity;
+    }
+
+    if (length > 0) {
+        memcpy(_buffer + _length, data, length);
+    }
+    _length += length;
+    return true;
+}
+
+void WebSocketBatchBuffer::resolve(WebSocketMessageView *views, size_t count) const {
+    size_t offset = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        views[i].payload = _buffer + offset;
+        offset += views[i].length;
+    }
+}
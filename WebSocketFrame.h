@@ -0,0 +1,213 @@
+/*
+ *  WebSocketFrame.h
+ *
+ *  Description:
+ *      RFC 6455 frame constants and an incremental frame decoder shared
+ *      by WebSocketServer and WebSocketClient. The decoder consumes
+ *      whatever bytes the socket has ready and never waits for more, so
+ *      it can be driven from a poll loop instead of timedRead().
+ */
+
+#ifndef WEBSOCKETFRAME_H_
+#define WEBSOCKETFRAME_H_
+
+#include <Arduino.h>
+#include "Client.h"
+#include "WebSocketUtf8.h"
+#include "WebSocketLatency.h"
+#include "WebSocketMemory.h"
+
+// WebSocket protocol constants
+// First byte
+#define WS_FIN            0x80
+#define WS_OPCODE_CONTINUATION 0x00
+#define WS_OPCODE_TEXT    0x01
+#define WS_OPCODE_BINARY  0x02
+#define WS_OPCODE_CLOSE   0x08
+#define WS_OPCODE_PING    0x09
+#define WS_OPCODE_PONG    0x0a
+// Second byte
+#define WS_MASK           0x80
+#define WS_SIZE16         126
+#define WS_SIZE64         127
+
+// Close status codes (RFC 6455 section 7.4.1)
+#define WS_CLOSE_NORMAL         1000
+#define WS_CLOSE_GOING_AWAY     1001
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_NO_STATUS      1005
+#define WS_CLOSE_INVALID_DATA   1007
+#define WS_CLOSE_TOO_BIG        1009
+#define WS_CLOSE_INTERNAL_ERROR 1011
+
+// Control frames never carry more than 125 bytes of payload.
+#define WS_MAX_CONTROL_LENGTH 125
+
+// Largest reassembled message the decoder will buffer. Bigger messages are
+// refused with WS_CLOSE_TOO_BIG. The default matches the 16-bit frames the
+// library always accepted.
+#ifndef WS_MAX_MESSAGE_LENGTH
+#define WS_MAX_MESSAGE_LENGTH 0xFFFF
+#endif
+
+// Bytes pulled from the Client per read() call.
+#ifndef WS_RX_BUFFER_LENGTH
+#define WS_RX_BUFFER_LENGTH 128
+#endif
+
+class WebSocketFrameDecoder {
+public:
+    WebSocketFrameDecoder();
+    ~WebSocketFrameDecoder();
+
+    // Pull whatever the client has ready and decode it. Returns true once a
+    // complete data message or control frame is available; the frame stays
+    // available until release() is called.
+    bool poll(Client &client);
+
+    // Decode bytes that were already read off the socket. Stops as soon as a
+    // frame is ready and returns the number of bytes consumed.
+    size_t feed(const uint8_t *data, size_t length);
+
+    // Hand over bytes read past the end of the handshake, to be decoded
+    // ahead of anything still in the socket. Only while nothing else is
+    // buffered; at most WS_RX_BUFFER_LENGTH bytes.
+    bool preload(const uint8_t *data, size_t length);
+
+    bool ready() const { return _ready; }
+
+    // A frame or fragmented message has been started but not finished.
+    bool busy() const;
+
+    // Protocol violation, invalid UTF-8 in a text message or oversized
+    // message; error() is the close code.
+    bool failed() const { return _error != 0; }
+    uint16_t error() const { return _error; }
+
+    // The ready frame. For close frames payload() starts with the status code.
+    uint8_t opcode() const { return _readyOpcode; }
+    const uint8_t *payload() const;
+    size_t length() const;
+
+    // Status code of a ready close frame, WS_CLOSE_NO_STATUS if it had none.
+    uint16_t closeCode() const;
+
+#if WS_LATENCY_HISTOGRAMS
+    // When the first byte of the ready message was decoded, and the ticks
+    // spent unmasking and checking its payload.
+    WebSocketTicks startTicks() const { return _startTicks; }
+    WebSocketTicks unmaskTicks() const { return _unmaskTicks; }
+#endif
+
+    // Drop the ready frame so decoding can continue.
+    void release();
+
+    // Forget all state, e.g. when the socket is reused for a new connection.
+    void reset();
+
+    // Grow the message buffer to length bytes now rather than on the first
+    // messages. reset() keeps it.
+    bool preallocate(size_t length) { return reserve(length); }
+
+    // Charge the message buffer to memory.
+    void setMemory(WebSocketMemory *memory) { _memory = memory; }
+
+    // Whether frames must be masked: true when decoding what a client
+    // sent, false for a server's frames. Anything else fails with
+    // WS_CLOSE_PROTOCOL_ERROR. reset() keeps the setting.
+    void setExpectMasked(bool masked) { _expectMasked = masked; }
+
+private:
+    enum State {
+        WS_STATE_OPCODE,
+        WS_STATE_LENGTH,
+        WS_STATE_EXTENDED_LENGTH,
+        WS_STATE_MASK,
+        WS_STATE_PAYLOAD
+    };
+
+    State _state;
+    bool _ready;
+    uint16_t _error;
+    bool _expectMasked;
+
+    // Frame being decoded
+    uint8_t _frameOpcode;
+    bool _frameFin;
+    bool _frameMasked;
+    uint8_t _mask[4];
+    uint8_t _headerBytes;
+    uint64_t _frameLength;
+    uint64_t _frameOffset;
+
+    // Data message being reassembled across continuation frames
+    uint8_t _messageOpcode;
+    uint8_t *_buffer;
+    size_t _capacity;
+    size_t _length;
+    WebSocketMemory *_memory;
+
+    // Text is checked as it is unmasked, so a bad message fails early
+    WebSocketUtf8Validator _utf8;
+
+#if WS_LATENCY_HISTOGRAMS
+    WebSocketTicks _startTicks;
+    WebSocketTicks _unmaskTicks;
+#endif
+
+    // Control frames may arrive between fragments, so they get their own space
+    uint8_t _control[WS_MAX_CONTROL_LENGTH];
+    uint8_t _controlLength;
+    uint8_t _readyOpcode;
+
+    // Bytes read off the client but not yet decoded
+    uint8_t _rx[WS_RX_BUFFER_LENGTH];
+    size_t _rxStart;
+    size_t _rxEnd;
+
+    void fail(uint16_t code);
+    bool beginPayload();
+    bool reserve(size_t length);
+    void finishFrame();
+};
+
+// Messages returned per receiveBatch() call when no cap is given.
+#ifndef WS_RECEIVE_BATCH
+#define WS_RECEIVE_BATCH 16
+#endif
+
+// A received data message. payload points into the connection's batch
+// buffer and stays valid until the next receiveBatch() call.
+struct WebSocketMessageView {
+    uint8_t opcode;
+    const uint8_t *payload;
+    size_t length;
+};
+
+// Payload storage for receiveBatch(): messages are copied back to back into
+// one buffer that is kept from call to call.
+class WebSocketBatchBuffer {
+public:
+    WebSocketBatchBuffer();
+    ~WebSocketBatchBuffer();
+
+    void clear() { _length = 0; }
+
+    void setMemory(WebSocketMemory *memory) { _memory = memory; }
+
+    // Copy a payload after the previous ones. Returns false if it doesn't fit
+    // in memory.
+    bool append(const uint8_t *data, size_t length);
+
+    // Point the views at their payloads. Must wait until the last append(),
+    // since growing the buffer can move it.
+    void resolve(WebSocketMessageView *views, size_t count) const;
+
+private:
+    uint8_t *_buffer;
+    size_t _capacity;
+    size_t _length;
+    WebSocketMemory *_memory;
+};
+
+#endif
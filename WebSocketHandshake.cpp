@@ -0,0 +1,175 @@
+//#define DEBUGGING
+
+#include "WebSocketHandshake.h"
+
+static char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char) (c + ('a' - 'A')) : c;
+}
+
+static bool equalsIgnoreCase(const char *a, size_t length, const char *b) {
+    size_t i = 0;
+
+    for (; i < length && b[i] != '\0'; ++i) {
+        if (lower(a[i]) != lower(b[i])) {
+            return false;
+        }
+    }
+    return i == length && b[i] == '\0';
+}
+
+// Whether a comma separated list holds the token, e.g. "keep-alive, Upgrade"
+static bool hasToken(const char *list, size_t length, const char *token) {
+    size_t start = 0;
+
+    while (start < length) {
+        size_t end = start;
+        size_t last;
+
+        while (end < length && list[end] != ',') {
+            end++;
+        }
+        last = end;
+        while (start < last && (list[start] == ' ' || list[start] == '\t')) {
+            start++;
+        }
+        while (last > start && (list[last - 1] == ' ' || list[last - 1] == '\t')) {
+            last--;
+        }
+        if (equalsIgnoreCase(list + start, last - start, token)) {
+            return true;
+        }
+        start = end + 1;
+    }
+    return false;
+}
+
+WebSocketResponseParser::WebSocketResponseParser(const char *expectedAccept) {
+    _expectedAccept = expectedAccept;
+    _lineLength = 0;
+    _total = 0;
+    _lineTruncated = false;
+    _statusSeen = false;
+    _done = false;
+    _failed = false;
+    _upgrade = false;
+    _connection = false;
+    _accept = false;
+}
+
+bool WebSocketResponseParser::accepted() const {
+    return _done && !_failed && _upgrade && _connection && _accept;
+}
+
+size_t WebSocketResponseParser::feed(const uint8_t *data, size_t length) {
+    size_t used = 0;
+
+    while (used < length && !done()) {
+        char c = (char) data[used++];
+
+        if (++_total > WS_HANDSHAKE_MAX_HEADERS) {
+#ifdef DEBUGGING
+            Serial.println(F("Handshake response headers too long"));
+#endif
+            _failed = true;
+            break;
+        }
+
+        if (c != '\n') {
+            if (_lineLength < sizeof(_line)) {
+                _line[_lineLength++] = c;
+            } else {
+                _lineTruncated = true;
+            }
+            continue;
+        }
+
+        // Lines end in CRLF; a bare LF is tolerated
+        if (_lineLength > 0 && _line[_lineLength - 1] == '\r' && !_lineTruncated) {
+            _lineLength--;
+        }
+
+        if (_lineLength == 0 && !_lineTruncated) {
+            // The blank line: headers are complete, or there was no status
+            if (_statusSeen) {
+                _done = true;
+            } else {
+                _failed = true;
+            }
+        } else {
+            parseLine();
+        }
+        _lineLength = 0;
+        _lineTruncated = false;
+    }
+
+    return used;
+}
+
+void WebSocketResponseParser::parseLine() {
+    if (!_statusSeen) {
+        _statusSeen = true;
+        if (_lineTruncated || !parseStatus()) {
+#ifdef DEBUGGING
+            Serial.println(F("Server didn't switch protocols"));
+#endif
+            _failed = true;
+        }
+        return;
+    }
+
+    // None of the headers we look at come close to the line buffer's size
+    if (_lineTruncated) {
+        return;
+    }
+
+    size_t colon = 0;
+    while (colon < _lineLength && _line[colon] != ':') {
+        colon++;
+    }
+    if (colon == _lineLength) {
+        return;
+    }
+
+    const char *value = _line + colon + 1;
+    size_t length = _lineLength - colon - 1;
+
+    while (length > 0 && (*value == ' ' || *value == '\t')) {
+        value++;
+        length--;
+    }
+    while (length > 0 && (value[length - 1] == ' ' || value[length - 1] == '\t')) {
+        length--;
+    }
+
+    if (equalsIgnoreCase(_line, colon, "Upgrade")) {
+        _upgrade = equalsIgnoreCase(value, length, "websocket");
+    } else if (equalsIgnoreCase(_line, colon, "Connection")) {
+        _connection = hasToken(value, length, "upgrade");
+    } else if (equalsIgnoreCase(_line, colon, "Sec-WebSocket-Accept")) {
+        // base64 is case sensitive
+        _accept = length == strlen(_expectedAccept) && memcmp(value, _expectedAccept, length) == 0;
+#ifdef DEBUGGING
+        if (!_accept) {
+            Serial.println(F("Sec-WebSocket-Accept doesn't match the key"));
+        }
+#endif
+    }
+}
+
+// "HTTP/1.1 101 Switching Protocols"; the reason phrase is not checked
+bool WebSocketResponseParser::parseStatus() {
+    static const char version[] = "HTTP/1.";
+    const size_t prefix = sizeof(version) - 1;
+
+    if (_lineLength < prefix + 5 || memcmp(_line, version, prefix) != 0) {
+        return false;
+    }
+    if (_line[prefix] < '0' || _line[prefix] > '9' || _line[prefix + 1] != ' ') {
+        return false;
+    }
+
+    const char *code = _line + prefix + 2;
+    size_t rest = _lineLength - prefix - 2;
+
+    return rest >= 3 && memcmp(code, "101", 3) == 0 && (rest == 3 || code[3] == ' ');
+}
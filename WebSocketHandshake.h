@@ -0,0 +1,67 @@
+/*
+ *  WebSocketHandshake.h
+ *
+ *  Description:
+ *      Incremental parser for the server's answer to the client handshake.
+ *      Bytes are fed in as they arrive; the parser keeps one header line in
+ *      a fixed buffer and stops at the blank line ending the header block,
+ *      so whatever follows it (frames the server sent straight after the
+ *      101) is left for the frame decoder. Header names and the Upgrade and
+ *      Connection tokens are compared case-insensitively.
+ */
+
+#ifndef WEBSOCKETHANDSHAKE_H_
+#define WEBSOCKETHANDSHAKE_H_
+
+#include <Arduino.h>
+
+// Longest header line kept. Longer lines can only be headers the parser
+// doesn't look at; a longer status line fails the handshake.
+#ifndef WS_HANDSHAKE_LINE
+#define WS_HANDSHAKE_LINE 128
+#endif
+
+// Most bytes of headers accepted before giving up.
+#ifndef WS_HANDSHAKE_MAX_HEADERS
+#define WS_HANDSHAKE_MAX_HEADERS 4096
+#endif
+
+// How long the client waits for the whole response.
+#ifndef WS_HANDSHAKE_TIMEOUT_MS
+#define WS_HANDSHAKE_TIMEOUT_MS 5000
+#endif
+
+class WebSocketResponseParser {
+public:
+    // expectedAccept is the Sec-WebSocket-Accept value the key calls for;
+    // it must stay valid while parsing.
+    explicit WebSocketResponseParser(const char *expectedAccept);
+
+    // Consume bytes up to and including the end of the header block.
+    // Returns how many were used; the rest belong to the first frames.
+    size_t feed(const uint8_t *data, size_t length);
+
+    // The header block is complete, or the response is already known bad.
+    bool done() const { return _done || _failed; }
+    // A 101 with Upgrade: websocket, Connection: upgrade and the expected
+    // accept value.
+    bool accepted() const;
+
+private:
+    const char *_expectedAccept;
+    char _line[WS_HANDSHAKE_LINE];
+    size_t _lineLength;
+    size_t _total;
+    bool _lineTruncated;
+    bool _statusSeen;
+    bool _done;
+    bool _failed;
+    bool _upgrade;
+    bool _connection;
+    bool _accept;
+
+    void parseLine();
+    bool parseStatus();
+};
+
+#endif
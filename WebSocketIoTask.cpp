@@ -0,0 +1,206 @@
+//#define DEBUGGING
+
+#include "WebSocketIoTask.h"
+
+WebSocketMessage *WebSocketMessage::create(uint8_t opcode, const uint8_t *data, size_t length,
+                                           WebSocketMemory *memory) {
+    WebSocketMessage *message = (WebSocketMessage *) ws_malloc(memory, sizeof(WebSocketMessage) + length);
+    if (message == NULL) {
+        return NULL;
+    }
+
+    message->opcode = opcode;
+    message->length = length;
+    message->memory = memory;
+    message->next = NULL;
+    if (length > 0) {
+        memcpy(message->data(), data, length);
+    }
+    return message;
+}
+
+void WebSocketMessage::destroy(WebSocketMessage *message) {
+    if (message != NULL) {
+        ws_free(message->memory, message, sizeof(WebSocketMessage) + message->length);
+    }
+}
+
+WebSocketIoTask::WebSocketIoTask()
+    : _step(NULL), _owner(NULL), _memory(NULL), _running(false), _blocked(false), _wake(NULL), _wakeContext(NULL),
+      _ownerThread(ThreadId()), _taskThread(ThreadId()) {
+#if defined(ESP32)
+    _stopped = true;
+#endif
+}
+
+WebSocketIoTask::~WebSocketIoTask() {
+    end();
+}
+
+bool WebSocketIoTask::begin(StepFunction step, void *owner, int core) {
+    if (running()) {
+        return false;
+    }
+
+    _step = step;
+    _owner = owner;
+    _blocked = false;
+    _running = true;
+
+#if defined(ESP32)
+    _stopped = false;
+    BaseType_t created = xTaskCreatePinnedToCore(taskMain, "websocket", WS_IO_TASK_STACK, this,
+                                                 WS_IO_TASK_PRIORITY, NULL,
+                                                 core < 0 ? tskNO_AFFINITY : core);
+    if (created != pdPASS) {
+        _running = false;
+        _stopped = true;
+        return false;
+    }
+#else
+    (void) core;
+    _thread = std::thread(&WebSocketIoTask::run, this);
+#endif
+
+#ifdef DEBUGGING
+    Serial.println(F("I/O task started"));
+#endif
+    return true;
+}
+
+WebSocketIoTask::ThreadId WebSocketIoTask::currentThread() {
+#if defined(ESP32)
+    return xTaskGetCurrentTaskHandle();
+#else
+    return std::this_thread::get_id();
+#endif
+}
+
+bool WebSocketIoTask::onTaskThread() const {
+    return running() && currentThread() == _taskThread.load(std::memory_order_acquire);
+}
+
+void WebSocketIoTask::claim() {
+    _ownerThread.store(currentThread(), std::memory_order_release);
+}
+
+bool WebSocketIoTask::offThread() const {
+    if (running()) {
+        return !onTaskThread();
+    }
+    // Nobody claimed the connection yet: nothing to protect
+    ThreadId owner = _ownerThread.load(std::memory_order_acquire);
+    return owner != ThreadId() && currentThread() != owner;
+}
+
+void WebSocketIoTask::onOutgoing(WakeFunction wake, void *context) {
+    // The context goes first, so a sender that sees the function sees it
+    // too; clearing leaves it, for a sender that saw the old function
+    _wake.store(NULL, std::memory_order_release);
+    if (wake != NULL) {
+        _wakeContext.store(context, std::memory_order_relaxed);
+        _wake.store(wake, std::memory_order_release);
+    }
+}
+
+void WebSocketIoTask::wake() {
+    WakeFunction wake = _wake.load(std::memory_order_acquire);
+
+    // The task polls on its own; an owner may be waiting for events
+    if (wake != NULL && !running()) {
+        wake(_wakeContext.load(std::memory_order_relaxed));
+    }
+}
+
+void WebSocketIoTask::end() {
+    if (running()) {
+        _running = false;
+#if defined(ESP32)
+        while (!_stopped) {
+            delay(1);
+        }
+#else
+        _thread.join();
+#endif
+    }
+    _taskThread.store(ThreadId(), std::memory_order_release);
+    drain();
+}
+
+#if defined(ESP32)
+void WebSocketIoTask::taskMain(void *arg) {
+    WebSocketIoTask *task = (WebSocketIoTask *) arg;
+
+    task->run();
+    task->_stopped = true;
+    vTaskDelete(NULL);
+}
+#endif
+
+void WebSocketIoTask::run() {
+    _taskThread.store(currentThread(), std::memory_order_release);
+
+    while (running()) {
+        // Sleep a tick when there was nothing to do, so lower priority
+        // tasks get to run
+        if (!_step(_owner)) {
+            delay(1);
+        }
+    }
+}
+
+void WebSocketIoTask::drain() {
+    WebSocketMessage *message;
+
+    while (_inbound.pop(message)) {
+        WebSocketMessage::destroy(message);
+    }
+    while (_outbound.pop(message)) {
+        WebSocketMessage::destroy(message);
+    }
+}
+
+bool WebSocketIoTask::deliver(uint8_t opcode, const uint8_t *data, size_t length) {
+    WebSocketMessage *message = WebSocketMessage::create(opcode, data, length, _memory);
+
+    if (message == NULL || !_inbound.push(message)) {
+        WebSocketMessage::destroy(message);
+        return false;
+    }
+    return true;
+}
+
+WebSocketMessage *WebSocketIoTask::nextOutgoing() {
+    WebSocketMessage *message;
+    return _outbound.pop(message) ? message : NULL;
+}
+
+bool WebSocketIoTask::send(uint8_t opcode, const uint8_t *data, size_t length) {
+    WebSocketMessage *message = WebSocketMessage::create(opcode, data, length, _memory);
+    unsigned long start = millis();
+
+    if (message == NULL) {
+        return false;
+    }
+    // Many senders can outrun the owner for a moment; let it catch up
+    while (!_outbound.push(message)) {
+        if (millis() - start >= WS_IO_SEND_WAIT_MS) {
+            WebSocketMessage::destroy(message);
+            return false;
+        }
+        wake();
+        delay(1);
+    }
+    wake();
+    return true;
+}
+
+WebSocketMessage *WebSocketIoTask::nextIncoming() {
+    WebSocketMessage *message;
+    return _inbound.pop(message) ? message : NULL;
+}
+
+WebSocketMessage *WebSocketIoTask::peekIncoming() {
+    WebSocketMessage *message;
+    return _inbound.peek(message) ? message : NULL;
+}
@@ -0,0 +1,193 @@
+/*
+ *  WebSocketIoTask.h
+ *
+ *  Description:
+ *      Optional dedicated I/O task for a WebSocketServer or
+ *      WebSocketClient. Once started, the task owns the Client: it reads,
+ *      decodes and writes, while the application only exchanges whole
+ *      messages with it over two lock-free rings. A slow handler then no
+ *      longer holds up the socket and vice versa.
+ *
+ *      The outgoing ring takes messages from any number of threads. Without
+ *      a task it still carries sends from threads other than the one that
+ *      owns the connection, i.e. that ran its handshake and calls poll(),
+ *      and poll() writes them out; so sensor, timer and command tasks can
+ *      all send without a lock around the connection.
+ *
+ *      On the ESP32 the task is a FreeRTOS task that can be pinned to a
+ *      core; on POSIX hosts it is a std::thread.
+ */
+
+#ifndef WEBSOCKETIOTASK_H_
+#define WEBSOCKETIOTASK_H_
+
+#include <Arduino.h>
+#include <atomic>
+#include "WebSocketSpscQueue.h"
+#include "WebSocketMpscQueue.h"
+#include "WebSocketMemory.h"
+
+#if defined(ESP32)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <thread>
+#endif
+
+// Messages that may wait for the application. Must be a power of two.
+#ifndef WS_IO_QUEUE_LENGTH
+#define WS_IO_QUEUE_LENGTH 32
+#endif
+
+// Messages that may wait to be sent, from all sending threads together.
+// Must be a power of two.
+#ifndef WS_IO_OUTBOUND_LENGTH
+#define WS_IO_OUTBOUND_LENGTH 128
+#endif
+
+// How long send() waits for room in a full outgoing ring before it gives
+// up, waking the owner and yielding a tick at a time. 0 never waits.
+#ifndef WS_IO_SEND_WAIT_MS
+#define WS_IO_SEND_WAIT_MS 10
+#endif
+
+#ifndef WS_IO_TASK_STACK
+#define WS_IO_TASK_STACK 4096
+#endif
+
+#ifndef WS_IO_TASK_PRIORITY
+#define WS_IO_TASK_PRIORITY 5
+#endif
+
+// Outgoing pseudo opcode: the message is a complete frame, queued as is.
+#define WS_IO_RAW_FRAME 0x20
+// Outgoing pseudo opcode: write the send queue out now, held frames included.
+#define WS_IO_FLUSH 0x21
+// Outgoing pseudo opcodes for beginMessage(): the header of a streamed
+// frame (first byte and 64-bit length), then its payload piece by piece.
+#define WS_IO_FRAME_START 0x22
+#define WS_IO_PAYLOAD 0x23
+// Outgoing pseudo opcode for sendRegion(): the frame's first byte followed
+// by the WebSocketRegion.
+#define WS_IO_REGION 0x24
+// Outgoing pseudo opcode: close the connection with the 2-byte status code
+// that follows.
+#define WS_IO_FAIL 0x25
+// Outgoing flag on a data opcode: a fragment, more of the message follows.
+#define WS_IO_CONTINUES 0x40
+// Outgoing flag on a data opcode or WS_IO_PAYLOAD: the last piece of a
+// message streamed or built frame by frame on another thread. Not 0x80,
+// which the server's messages carry as FIN.
+#define WS_IO_LAST 0x10
+
+// A message crossing between the I/O task and the application. The payload
+// follows the header in the same allocation.
+struct WebSocketMessage {
+    uint8_t opcode;
+    size_t length;
+    WebSocketMemory *memory;    // charged for the allocation, may be NULL
+    WebSocketMessage *next;     // while the owner holds it back
+
+    uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+
+    static WebSocketMessage *create(uint8_t opcode, const uint8_t *data, size_t length,
+                                    WebSocketMemory *memory = NULL);
+    static void destroy(WebSocketMessage *message);
+};
+
+class WebSocketIoTask {
+public:
+    // Socket work done by the owning connection on every iteration of the
+    // task. Returns true if anything was read or written.
+    typedef bool (*StepFunction)(void *owner);
+    // Told that a message from another thread waits for the owner.
+    typedef void (*WakeFunction)(void *context);
+
+    // Identifies a thread or FreeRTOS task; the default value is none.
+#if defined(ESP32)
+    typedef TaskHandle_t ThreadId;
+#else
+    typedef std::thread::id ThreadId;
+#endif
+    static ThreadId currentThread();
+
+    WebSocketIoTask();
+    ~WebSocketIoTask();
+
+    // Start the task. core pins it on the ESP32, -1 lets the scheduler pick.
+    bool begin(StepFunction step, void *owner, int core = -1);
+
+    // Stop the task if it runs and free whatever is still queued.
+    void end();
+
+    // Charge the messages in both rings to memory.
+    void setMemory(WebSocketMemory *memory) { _memory = memory; }
+
+    bool running() const { return _running.load(std::memory_order_acquire); }
+
+    // True when called from the I/O task itself.
+    bool onTaskThread() const;
+
+    // Make the calling thread the connection's owner while no task runs.
+    void claim();
+
+    // True when the calling thread must not touch the socket or the send
+    // queue and has to send() instead: the task owns them, or another
+    // thread claimed them.
+    bool offThread() const;
+
+    // Called on the sending thread for every message queued while no task
+    // runs, e.g. to wake the owner's poll loop. Must be thread safe. Set it
+    // before other threads send; clearing it with NULL is safe at any time.
+    void onOutgoing(WakeFunction wake, void *context = NULL);
+
+    // I/O task side
+    bool deliver(uint8_t opcode, const uint8_t *data, size_t length);
+    bool canDeliver() const { return !_inbound.full(); }
+
+    // I/O task or owner side
+    WebSocketMessage *nextOutgoing();
+
+    // Any thread but the I/O task or owner. Waits up to WS_IO_SEND_WAIT_MS
+    // while the ring is full.
+    bool send(uint8_t opcode, const uint8_t *data, size_t length);
+
+    // Application side
+    WebSocketMessage *nextIncoming();
+    // The message nextIncoming() would return, left in the queue.
+    WebSocketMessage *peekIncoming();
+
+    // Set by the I/O task or owner from its send queue, read by senders.
+    void setBlocked(bool blocked) { _blocked.store(blocked, std::memory_order_relaxed); }
+    bool blocked() const { return _blocked.load(std::memory_order_relaxed); }
+
+private:
+    WebSocketSpscQueue<WebSocketMessage *, WS_IO_QUEUE_LENGTH> _inbound;
+    WebSocketMpscQueue<WebSocketMessage *, WS_IO_OUTBOUND_LENGTH> _outbound;
+
+    StepFunction _step;
+    void *_owner;
+    WebSocketMemory *_memory;
+    std::atomic<bool> _running;
+    std::atomic<bool> _blocked;
+    // Read by sending threads while the owner may set them
+    std::atomic<WakeFunction> _wake;
+    std::atomic<void *> _wakeContext;
+    std::atomic<ThreadId> _ownerThread;
+
+    // Set by the task itself before its first step, so it is never read
+    // half written while begin() is still returning
+    std::atomic<ThreadId> _taskThread;
+#if defined(ESP32)
+    std::atomic<bool> _stopped;
+    static void taskMain(void *arg);
+#else
+    std::thread _thread;
+#endif
+
+    void run();
+    void drain();
+    void wake();
+};
+
+#endif
@@ -0,0 +1,314 @@
+//#define DEBUGGING
+
+#include "WebSocketJson.h"
+#include "WebSocketServer.h"
+#include "WebSocketClient.h"
+
+#include <math.h>
+#include <stdio.h>
+
+WebSocketJsonWriter::WebSocketJsonWriter(WebSocketServer &server, size_t chunk) {
+    _server = &server;
+    _client = NULL;
+    _chunk = chunk;
+    start();
+}
+
+WebSocketJsonWriter::WebSocketJsonWriter(WebSocketClient &client, size_t chunk) {
+    _server = NULL;
+    _client = &client;
+    _chunk = chunk;
+    start();
+}
+
+WebSocketJsonWriter::~WebSocketJsonWriter() {
+    if (!_ended) {
+        end();
+    }
+}
+
+void WebSocketJsonWriter::start() {
+    _length = 0;
+    _spilled = false;
+    _ended = false;
+    _status = WS_SEND_QUEUED;
+    _depth = 0;
+    _comma = 0;
+    _inObject = 0;
+    _afterKey = false;
+
+    // Tiny chunks would be mostly frame headers
+    if (_chunk < 32) {
+        _chunk = 32;
+    }
+    _buffer = reserve();
+    _ok = _buffer != NULL;
+    if (!_ok) {
+        _status = WS_SEND_OVERFLOW;
+    }
+}
+
+uint8_t *WebSocketJsonWriter::reserve() {
+    return _server != NULL ? _server->reserveFrame(_chunk) : _client->reserveFrame(_chunk);
+}
+
+WebSocketSendStatus WebSocketJsonWriter::commit(uint8_t opcode, bool final) {
+    unsigned long start = millis();
+    WebSocketSendStatus status;
+
+    for (;;) {
+        status = _server != NULL ? _server->commitFrame(opcode, _length, final)
+                                 : _client->commitFrame(opcode, _length, final);
+
+        // Dropping a fragment mid-message would garble it; a full I/O task
+        // ring drains by itself, so give it a moment
+        if (status != WS_SEND_OVERFLOW || !_spilled || millis() - start >= WS_JSON_WAIT_MS) {
+            return status;
+        }
+        yield();
+    }
+}
+
+// Send what the chunk holds as a fragment and carry on in a fresh one
+bool WebSocketJsonWriter::spill() {
+    if (!_ok) {
+        return false;
+    }
+
+    _status = commit(_spilled ? WS_OPCODE_CONTINUATION : WS_OPCODE_TEXT, false);
+    _spilled = true;
+    _length = 0;
+    if (_status == WS_SEND_OVERFLOW || _status == WS_SEND_CLOSED) {
+        _ok = false;
+        return false;
+    }
+
+    _buffer = reserve();
+    if (_buffer == NULL) {
+#ifdef DEBUGGING
+        Serial.println(F("JSON message cut short, no room for the next fragment"));
+#endif
+        _status = WS_SEND_OVERFLOW;
+        _ok = false;
+        return false;
+    }
+    return true;
+}
+
+void WebSocketJsonWriter::put(char c) {
+    if (!_ok || (_length == _chunk && !spill())) {
+        return;
+    }
+    _buffer[_length++] = (uint8_t) c;
+}
+
+void WebSocketJsonWriter::put(const char *text, size_t length) {
+    while (length > 0 && _ok) {
+        if (_length == _chunk && !spill()) {
+            return;
+        }
+
+        size_t count = _chunk - _length;
+        if (count > length) {
+            count = length;
+        }
+        memcpy(_buffer + _length, text, count);
+        _length += count;
+        text += count;
+        length -= count;
+    }
+}
+
+void WebSocketJsonWriter::value() {
+    if (_afterKey) {
+        _afterKey = false;
+        return;
+    }
+    if (_depth > 0) {
+        uint32_t bit = 1UL << (_depth - 1);
+
+        if (_comma & bit) {
+            put(',');
+        }
+        _comma |= bit;
+    }
+}
+
+void WebSocketJsonWriter::open(char c, bool object) {
+    if (_depth >= WS_JSON_DEPTH || _depth >= 32) {
+        _status = WS_SEND_OVERFLOW;
+        _ok = false;
+        return;
+    }
+
+    value();
+    put(c);
+
+    uint32_t bit = 1UL << _depth;
+    _comma &= ~bit;
+    if (object) {
+        _inObject |= bit;
+    } else {
+        _inObject &= ~bit;
+    }
+    _depth++;
+}
+
+void WebSocketJsonWriter::close(char c) {
+    if (_depth == 0) {
+        return;
+    }
+    _depth--;
+    _afterKey = false;
+    put(c);
+}
+
+void WebSocketJsonWriter::beginObject() {
+    open('{', true);
+}
+
+void WebSocketJsonWriter::endObject() {
+    close('}');
+}
+
+void WebSocketJsonWriter::beginArray() {
+    open('[', false);
+}
+
+void WebSocketJsonWriter::endArray() {
+    close(']');
+}
+
+void WebSocketJsonWriter::key(const char *name) {
+    writeString(name);
+    put(':');
+    _afterKey = true;
+}
+
+void WebSocketJsonWriter::writeString(const char *text) {
+    writeString(text, strlen(text));
+}
+
+void WebSocketJsonWriter::writeString(const char *text, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    size_t run = 0;
+
+    value();
+    put('"');
+    for (size_t i = 0; i < length; ++i) {
+        uint8_t c = (uint8_t) text[i];
+        char escape;
+
+        if (c == '"' || c == '\\') {
+            escape = (char) c;
+        } else if (c >= 0x20) {
+            continue;
+        } else if (c == '\b') {
+            escape = 'b';
+        } else if (c == '\f') {
+            escape = 'f';
+        } else if (c == '\n') {
+            escape = 'n';
+        } else if (c == '\r') {
+            escape = 'r';
+        } else if (c == '\t') {
+            escape = 't';
+        } else {
+            escape = 'u';
+        }
+
+        // Plain runs are copied in one go
+        put(text + run, i - run);
+        run = i + 1;
+        put('\\');
+        put(escape);
+        if (escape == 'u') {
+            char code[4] = { '0', '0', hex[c >> 4], hex[c & 0x0F] };
+            put(code, sizeof(code));
+        }
+    }
+    put(text + run, length - run);
+    put('"');
+}
+
+void WebSocketJsonWriter::writeInt(int64_t value) {
+    this->value();
+    if (value < 0) {
+        put('-');
+        // Negated as unsigned so INT64_MIN survives
+        putDigits(0 - (uint64_t) value);
+    } else {
+        putDigits((uint64_t) value);
+    }
+}
+
+void WebSocketJsonWriter::writeUnsigned(uint64_t value) {
+    this->value();
+    putDigits(value);
+}
+
+void WebSocketJsonWriter::putDigits(uint64_t value) {
+    char digits[20];
+    size_t n = sizeof(digits);
+
+    do {
+        digits[--n] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    put(digits + n, sizeof(digits) - n);
+}
+
+void WebSocketJsonWriter::writeFloat(double value, uint8_t decimals) {
+    char text[48];
+    int n;
+
+    if (isnan(value) || isinf(value)) {
+        writeNull();
+        return;
+    }
+    if (decimals > 9) {
+        decimals = 9;
+    }
+
+    n = snprintf(text, sizeof(text), "%.*f", (int) decimals, value);
+    if (n < 0 || (size_t) n >= sizeof(text)) {
+        // Too large for fixed point to be useful on a dashboard
+        n = snprintf(text, sizeof(text), "%.*e", (int) decimals, value);
+    }
+
+    this->value();
+    put(text, (size_t) n);
+}
+
+void WebSocketJsonWriter::writeBool(bool value) {
+    this->value();
+    if (value) {
+        put("true", 4);
+    } else {
+        put("false", 5);
+    }
+}
+
+void WebSocketJsonWriter::writeNull() {
+    value();
+    put("null", 4);
+}
+
+WebSocketSendStatus WebSocketJsonWriter::end() {
+    if (_ended) {
+        return _status;
+    }
+
+    while (_depth > 0 && _ok) {
+        close((_inObject & (1UL << (_depth - 1))) ? '}' : ']');
+    }
+    _ended = true;
+
+    if (!_ok) {
+        // An uncommitted reservation is simply dropped
+        return _status;
+    }
+
+    _status = commit(_spilled ? WS_OPCODE_CONTINUATION : WS_OPCODE_TEXT, true);
+    return _status;
+}
@@ -0,0 +1,104 @@
+/*
+ *  WebSocketJson.h
+ *
+ *  Description:
+ *      Streaming JSON writer for dashboard payloads. Text goes straight into
+ *      the payload space that reserveFrame() hands out inside the
+ *      connection's send queue, a chunk at a time; when a chunk fills up it
+ *      is committed as a fragment and the message carries on in the next
+ *      one. Nothing is allocated per message and the document never exists
+ *      as a whole in memory.
+ *
+ *      While a message streams, send nothing else on the connection. If a
+ *      fragment can't be queued after an earlier one went out, the message
+ *      stays incomplete on the wire and the connection should be closed.
+ */
+
+#ifndef WEBSOCKETJSON_H_
+#define WEBSOCKETJSON_H_
+
+#include <Arduino.h>
+#include "WebSocketSendQueue.h"
+
+// Payload bytes reserved per fragment.
+#ifndef WS_JSON_CHUNK
+#define WS_JSON_CHUNK 512
+#endif
+
+// Deepest nesting of objects and arrays.
+#ifndef WS_JSON_DEPTH
+#define WS_JSON_DEPTH 16
+#endif
+
+// Once part of a message is out, how long a fragment that doesn't fit may
+// wait for the I/O task to make room rather than cutting the message short.
+#ifndef WS_JSON_WAIT_MS
+#define WS_JSON_WAIT_MS 100
+#endif
+
+class WebSocketServer;
+class WebSocketClient;
+
+class WebSocketJsonWriter {
+public:
+    WebSocketJsonWriter(WebSocketServer &server, size_t chunk = WS_JSON_CHUNK);
+    WebSocketJsonWriter(WebSocketClient &client, size_t chunk = WS_JSON_CHUNK);
+    // Ends the message if end() wasn't called.
+    ~WebSocketJsonWriter();
+
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+
+    // Member name inside an object; the value follows.
+    void key(const char *name);
+
+    void writeString(const char *text);
+    void writeString(const char *text, size_t length);
+    void writeInt(int64_t value);
+    void writeUnsigned(uint64_t value);
+    // Fixed point with decimals digits; NaN and infinities become null.
+    void writeFloat(double value, uint8_t decimals = 2);
+    void writeBool(bool value);
+    void writeNull();
+
+    // Send the last fragment. Anything still open is closed first.
+    WebSocketSendStatus end();
+
+    // False once a chunk couldn't be reserved or sent, or nesting went too
+    // deep; the rest of the message is then dropped.
+    bool ok() const { return _ok; }
+
+private:
+    WebSocketServer *_server;
+    WebSocketClient *_client;
+    size_t _chunk;
+
+    uint8_t *_buffer;   // reserved payload space
+    size_t _length;     // bytes written to it
+    bool _spilled;      // a fragment already went out
+    bool _ok;
+    bool _ended;
+    WebSocketSendStatus _status;
+
+    uint8_t _depth;
+    uint32_t _comma;    // per level: a value was written, the next needs ','
+    uint32_t _inObject; // per level: object rather than array
+    bool _afterKey;
+
+    void start();
+    uint8_t *reserve();
+    WebSocketSendStatus commit(uint8_t opcode, bool final);
+    bool spill();
+
+    void put(char c);
+    void put(const char *text, size_t length);
+    void putDigits(uint64_t value);
+    // Separator before a value or key.
+    void value();
+    void open(char c, bool object);
+    void close(char c);
+};
+
+#endif
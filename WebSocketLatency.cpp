@@ -0,0 +1,113 @@
+//#define DEBUGGING
+
+#include "WebSocketLatency.h"
+
+#if WS_LATENCY_HISTOGRAMS
+
+uint32_t wsTicksToNanos(WebSocketTicks ticks) {
+#if defined(ESP32)
+    // Cycle counts; saturate rather than wrap after 4.29 s
+    uint64_t nanos = (uint64_t) ticks * 1000 / getCpuFrequencyMhz();
+    return nanos < 0xFFFFFFFFULL ? (uint32_t) nanos : 0xFFFFFFFFUL;
+#elif defined(__linux__)
+    // Nanoseconds already; saturate like the others
+    return ticks < 0xFFFFFFFFULL ? (uint32_t) ticks : 0xFFFFFFFFUL;
+#else
+    // micros(); saturate rather than wrap after 4.29 s
+    return ticks < 4294967UL ? ticks * 1000 : 0xFFFFFFFFUL;
+#endif
+}
+
+void WebSocketHistogram::reset() {
+    memset(_buckets, 0, sizeof(_buckets));
+    _count = 0;
+    _max = 0;
+}
+
+// Values below SUB_BUCKETS get a bucket each. Above that, the highest set
+// bit picks the power of two and the next WS_LATENCY_SUB_BITS bits the
+// sub-bucket within it.
+size_t WebSocketHistogram::bucketOf(uint32_t value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+
+    unsigned shift = 31 - __builtin_clz(value) - WS_LATENCY_SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+}
+
+uint32_t WebSocketHistogram::upperBound(size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+
+    unsigned shift = bucket / SUB_BUCKETS - 1;
+    uint64_t top = ((uint64_t) (bucket % SUB_BUCKETS + SUB_BUCKETS + 1) << shift) - 1;
+    return top > 0xFFFFFFFFULL ? 0xFFFFFFFFUL : (uint32_t) top;
+}
+
+void WebSocketHistogram::record(uint32_t nanos) {
+    _buckets[bucketOf(nanos)]++;
+    _count++;
+    if (nanos > _max) {
+        _max = nanos;
+    }
+}
+
+uint32_t WebSocketHistogram::percentile(float fraction) const {
+    if (_count == 0) {
+        return 0;
+    }
+
+    uint32_t rank = (uint32_t) (fraction * _count + 0.5f);
+    uint32_t seen = 0;
+
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        seen += _buckets[i];
+        if (seen >= rank) {
+            uint32_t bound = upperBound(i);
+            return bound < _max ? bound : _max;
+        }
+    }
+    return _max;
+}
+
+void WebSocketHistogram::print(Print &out, const char *name) const {
+    out.print(name);
+    out.print(F(": n="));
+    out.print((unsigned long) _count);
+    out.print(F(" p50="));
+    out.print(percentile(0.50f) / 1000.0, 1);
+    out.print(F(" p90="));
+    out.print(percentile(0.90f) / 1000.0, 1);
+    out.print(F(" p99="));
+    out.print(percentile(0.99f) / 1000.0, 1);
+    out.print(F(" p99.9="));
+    out.print(percentile(0.999f) / 1000.0, 1);
+    out.print(F(" max="));
+    out.print(_max / 1000.0, 1);
+    out.println(F(" us"));
+}
+
+void WebSocketLatency::reset() {
+    for (size_t i = 0; i < WS_STAGE_COUNT; ++i) {
+        _stages[i].reset();
+    }
+}
+
+void WebSocketLatency::print(Print &out) const {
+    static const char *const names[WS_STAGE_COUNT] = {
+        "receive", "unmask", "string", "handler", "send", "total"
+    };
+
+    for (size_t i = 0; i < WS_STAGE_COUNT; ++i) {
+        if (_stages[i].count() > 0) {
+            _stages[i].print(out, names[i]);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ *  WebSocketLatency.h
+ *
+ *  Description:
+ *      Per connection latency histograms for the receive-to-reply path,
+ *      compiled in with WS_LATENCY_HISTOGRAMS. Stages are timed with the
+ *      cheapest monotonic counter the target has (CCOUNT on the ESP32,
+ *      CLOCK_MONOTONIC on Linux) and recorded into HDR-style log-linear
+ *      buckets: a fixed number of sub-buckets per power of two, so the
+ *      relative error is the same at 2 us and at 2 s and recording is a
+ *      couple of shifts and an increment.
+ */
+
+#ifndef WEBSOCKETLATENCY_H_
+#define WEBSOCKETLATENCY_H_
+
+#include <Arduino.h>
+
+// Set to 1 to time every message. Costs a counter read per stage and
+// WS_STAGE_COUNT histograms per connection.
+#ifndef WS_LATENCY_HISTOGRAMS
+#define WS_LATENCY_HISTOGRAMS 0
+#endif
+
+// Sub-buckets per power of two, as a power of two. 3 keeps values within
+// 12.5% and a histogram at 1 KB.
+#ifndef WS_LATENCY_SUB_BITS
+#define WS_LATENCY_SUB_BITS 3
+#endif
+
+#if WS_LATENCY_HISTOGRAMS
+
+#if defined(ESP32)
+#include <xtensa/hal.h>
+#elif defined(__linux__)
+#include <time.h>
+#endif
+
+enum WebSocketLatencyStage {
+    WS_STAGE_RECEIVE,   // first byte of a message read until the message is complete
+    WS_STAGE_UNMASK,    // unmasking, copying and UTF-8 checking its payload
+    WS_STAGE_STRING,    // building the String getData() returns
+    WS_STAGE_HANDLER,   // the onText()/onBinary() handler
+    WS_STAGE_SEND,      // encoding, queueing and writing a reply
+    WS_STAGE_TOTAL,     // first byte of a message until a reply has been written
+    WS_STAGE_COUNT
+};
+
+// Monotonic timestamp in target specific ticks. Only differences are
+// meaningful, and they wrap after a few seconds on the ESP32. Linux counts
+// nanoseconds, which need 64 bits to last longer than 4.29 s.
+#if defined(ESP32)
+typedef uint32_t WebSocketTicks;
+#elif defined(__linux__)
+typedef uint64_t WebSocketTicks;
+#else
+typedef uint32_t WebSocketTicks;
+#endif
+
+static inline WebSocketTicks wsTicks() {
+#if defined(ESP32)
+    return xthal_get_ccount();
+#elif defined(__linux__)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+#else
+    return micros();
+#endif
+}
+
+// Convert a tick difference to nanoseconds, saturating at UINT32_MAX.
+uint32_t wsTicksToNanos(WebSocketTicks ticks);
+
+class WebSocketHistogram {
+public:
+    WebSocketHistogram() { reset(); }
+
+    void reset();
+    void record(uint32_t nanos);
+
+    uint32_t count() const { return _count; }
+    uint32_t max() const { return _max; }
+
+    // Smallest value at or below which fraction (0..1) of the samples lie,
+    // rounded up to the end of its bucket.
+    uint32_t percentile(float fraction) const;
+
+    // One line: count, p50, p90, p99, p99.9 and max in microseconds.
+    void print(Print &out, const char *name) const;
+
+private:
+    enum {
+        SUB_BUCKETS = 1 << WS_LATENCY_SUB_BITS,
+        BUCKETS = (32 - WS_LATENCY_SUB_BITS + 1) * SUB_BUCKETS
+    };
+
+    uint32_t _buckets[BUCKETS];
+    uint32_t _count;
+    uint32_t _max;
+
+    static size_t bucketOf(uint32_t value);
+    static uint32_t upperBound(size_t bucket);
+};
+
+class WebSocketLatency {
+public:
+    void reset();
+
+    void record(WebSocketLatencyStage stage, WebSocketTicks startTicks) {
+        _stages[stage].record(wsTicksToNanos(wsTicks() - startTicks));
+    }
+    void recordTicks(WebSocketLatencyStage stage, WebSocketTicks ticks) {
+        _stages[stage].record(wsTicksToNanos(ticks));
+    }
+
+    const WebSocketHistogram &stage(WebSocketLatencyStage stage) const { return _stages[stage]; }
+
+    // Every stage that has samples, one per line.
+    void print(Print &out) const;
+
+private:
+    WebSocketHistogram _stages[WS_STAGE_COUNT];
+};
+
+#endif
+
+#endif
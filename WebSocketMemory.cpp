@@ -0,0 +1,67 @@
+//#define DEBUGGING
+
+#include "WebSocketMemory.h"
+
+std::atomic<size_t> WebSocketMemory::_total(0);
+std::atomic<size_t> WebSocketMemory::_totalPeak(0);
+size_t WebSocketMemory::_budget = 0;
+
+void WebSocketMemory::raise(std::atomic<size_t> &peak, size_t value) {
+    size_t seen = peak.load(std::memory_order_relaxed);
+
+    while (value > seen && !peak.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+    }
+}
+
+void *ws_realloc(WebSocketMemory *memory, void *ptr, size_t oldSize, size_t newSize) {
+    if (newSize > oldSize) {
+        size_t grow = newSize - oldSize;
+        size_t total = WebSocketMemory::_total.fetch_add(grow, std::memory_order_relaxed) + grow;
+
+        if (WebSocketMemory::_budget > 0 && total > WebSocketMemory::_budget) {
+#ifdef DEBUGGING
+            Serial.print(F("Memory budget exceeded, refusing "));
+            Serial.println(grow);
+#endif
+            WebSocketMemory::_total.fetch_sub(grow, std::memory_order_relaxed);
+            return NULL;
+        }
+
+        void *block = realloc(ptr, newSize);
+        if (block == NULL) {
+            WebSocketMemory::_total.fetch_sub(grow, std::memory_order_relaxed);
+            return NULL;
+        }
+
+        WebSocketMemory::raise(WebSocketMemory::_totalPeak, total);
+        if (memory != NULL) {
+            size_t current = memory->_current.fetch_add(grow, std::memory_order_relaxed) + grow;
+            WebSocketMemory::raise(memory->_peak, current);
+        }
+        return block;
+    }
+
+    void *block = realloc(ptr, newSize);
+    if (block == NULL && newSize > 0) {
+        return NULL;
+    }
+
+    size_t shrink = oldSize - newSize;
+    WebSocketMemory::_total.fetch_sub(shrink, std::memory_order_relaxed);
+    if (memory != NULL) {
+        memory->_current.fetch_sub(shrink, std::memory_order_relaxed);
+    }
+    return block;
+}
+
+void ws_free(WebSocketMemory *memory, void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    free(ptr);
+    WebSocketMemory::_total.fetch_sub(size, std::memory_order_relaxed);
+    if (memory != NULL) {
+        memory->_current.fetch_sub(size, std::memory_order_relaxed);
+    }
+}
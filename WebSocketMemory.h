@@ -0,0 +1,64 @@
+/*
+ *  WebSocketMemory.h
+ *
+ *  Description:
+ *      Heap accounting for the library's buffers. Every buffer a
+ *      connection owns (the message being reassembled, queued output,
+ *      receiveBatch() payloads, messages crossing to and from the I/O
+ *      task) is allocated through ws_realloc() and charged to that
+ *      connection's WebSocketMemory, which keeps the bytes in use and
+ *      their peak. A library wide total can be capped with a budget;
+ *      allocations that would exceed it fail like an out of memory
+ *      realloc(), which the callers already handle.
+ */
+
+#ifndef WEBSOCKETMEMORY_H_
+#define WEBSOCKETMEMORY_H_
+
+#include <Arduino.h>
+#include <atomic>
+
+class WebSocketMemory {
+public:
+    WebSocketMemory() : _current(0), _peak(0) {}
+
+    // Bytes this connection has allocated now, and the most it ever had.
+    size_t current() const { return _current.load(std::memory_order_relaxed); }
+    size_t peak() const { return _peak.load(std::memory_order_relaxed); }
+    void resetPeak() { _peak.store(current(), std::memory_order_relaxed); }
+
+    // Library wide: bytes allocated by every connection and their peak.
+    static size_t total() { return _total.load(std::memory_order_relaxed); }
+    static size_t totalPeak() { return _totalPeak.load(std::memory_order_relaxed); }
+
+    // Refuse allocations that would take total() past bytes. 0 lifts it.
+    static void setBudget(size_t bytes) { _budget = bytes; }
+    static size_t budget() { return _budget; }
+
+private:
+    std::atomic<size_t> _current;
+    std::atomic<size_t> _peak;
+
+    static std::atomic<size_t> _total;
+    static std::atomic<size_t> _totalPeak;
+    static size_t _budget;
+
+    static void raise(std::atomic<size_t> &peak, size_t value);
+
+    friend void *ws_realloc(WebSocketMemory *memory, void *ptr, size_t oldSize, size_t newSize);
+    friend void ws_free(WebSocketMemory *memory, void *ptr, size_t size);
+};
+
+// realloc() that charges the change in size to memory (may be NULL, then
+// only the library total is kept) and honours the budget. On failure ptr is
+// left as it was and NULL is returned.
+void *ws_realloc(WebSocketMemory *memory, void *ptr, size_t oldSize, size_t newSize);
+
+static inline void *ws_malloc(WebSocketMemory *memory, size_t size) {
+    return ws_realloc(memory, NULL, 0, size);
+}
+
+// free() a block allocated with size bytes.
+void ws_free(WebSocketMemory *memory, void *ptr, size_t size);
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ *  WebSocketMpscQueue.h
+ *
+ *  Description:
+ *      Bounded lock-free ring buffer for any number of producer threads
+ *      and exactly one consumer thread (D. Vyukov's bounded queue). Each
+ *      slot carries a sequence number telling producers whether it is free
+ *      and the consumer whether it has been filled, so producers only
+ *      contend on one compare-and-swap of the tail and never wait for each
+ *      other. Used to hand outgoing messages from any thread to the one
+ *      that owns a connection's socket.
+ */
+
+#ifndef WEBSOCKETMPSCQUEUE_H_
+#define WEBSOCKETMPSCQUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Producers and the consumer keep their counters on separate lines.
+#ifndef WS_CACHE_LINE
+#define WS_CACHE_LINE 64
+#endif
+
+// Capacity must be a power of two. Every slot can be used.
+template <typename T, size_t Capacity>
+class WebSocketMpscQueue {
+public:
+    WebSocketMpscQueue() : _head(0), _tail(0) {
+        static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+        for (size_t i = 0; i < Capacity; ++i) {
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Any thread. Returns false when the ring is full.
+    bool push(const T &item) {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        Cell *cell;
+
+        while (true) {
+            cell = &_cells[tail & (Capacity - 1)];
+            intptr_t lag = (intptr_t) cell->sequence.load(std::memory_order_acquire) - (intptr_t) tail;
+
+            if (lag == 0) {
+                // Free for this round: claim it
+                if (_tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (lag < 0) {
+                // Still holds last round's item
+                return false;
+            } else {
+                // Another producer got there first
+                tail = _tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->item = item;
+        cell->sequence.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false when the ring is empty, or the oldest
+    // slot is claimed but its producer hasn't finished writing it.
+    bool pop(T &item) {
+        size_t head = _head.load(std::memory_order_relaxed);
+        Cell &cell = _cells[head & (Capacity - 1)];
+
+        if (cell.sequence.load(std::memory_order_acquire) != head + 1) {
+            return false;
+        }
+        item = cell.item;
+        cell.sequence.store(head + Capacity, std::memory_order_release);
+        _head.store(head + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Approximate while producers are active.
+    bool empty() const {
+        return _head.load(std::memory_order_relaxed) == _tail.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    Cell _cells[Capacity];
+    alignas(WS_CACHE_LINE) std::atomic<size_t> _head;
+    alignas(WS_CACHE_LINE) std::atomic<size_t> _tail;
+};
+
+#endif
@@ -0,0 +1,847 @@
+//#define DEBUGGING
+
+#if defined(__linux__)
+
+#include "WebSocketReactor.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+// io_uring tags: a connection pointer with the operation in its low bits
+enum {
+    TAG_READ = 1,
+    TAG_WRITE = 2,
+    TAG_ACCEPT = 3,
+    TAG_TIMEOUT = 4,
+    TAG_WAKE = 5,
+    TAG_MASK = 7
+};
+
+WebSocketReactor::WebSocketReactor() {
+    _backend = WS_REACTOR_AUTO;
+    _epoll = -1;
+    _listen = -1;
+    _maxConnections = 0;
+    _count = 0;
+    _connections = NULL;
+    _pending = NULL;
+    _closing = NULL;
+    _connectCallback = NULL;
+    _connectContext = NULL;
+    _disconnectCallback = NULL;
+    _disconnectContext = NULL;
+    memset(&_stats, 0, sizeof(_stats));
+    _admission = NULL;
+#if CALLBACK_FUNCTIONS
+    _executor = NULL;
+    _jobHandler = NULL;
+    _jobContext = NULL;
+    _outgoing = NULL;
+#endif
+    _wake = -1;
+#if WS_HAVE_URING
+    _buffers = NULL;
+    _accepting = false;
+    _waking = false;
+#endif
+}
+
+WebSocketReactor::~WebSocketReactor() {
+    end();
+}
+
+bool WebSocketReactor::begin(uint16_t port, size_t maxConnections, WebSocketReactorBackend backend) {
+    struct epoll_event event;
+
+    end();
+    _maxConnections = maxConnections;
+
+    if (!listenOn(port) || !_slab.begin(maxConnections)) {
+        end();
+        return false;
+    }
+    // Grown now so the first accepts don't have to
+    for (size_t i = 0; i < maxConnections; ++i) {
+        Connection *connection = _slab.at(i);
+
+        connection->slot = i;
+        // The reactor decides when a stopped socket is closed
+        connection->client.setLinger(true);
+#if CALLBACK_FUNCTIONS
+        connection->reactor = this;
+        connection->outgoing = false;
+#endif
+        if (!connection->client.preallocate(WS_REACTOR_RX_RESERVE)
+            || !connection->server.preallocate(WS_REACTOR_SEND_RESERVE, WS_REACTOR_MESSAGE_RESERVE)) {
+            end();
+            return false;
+        }
+    }
+    _timers.begin(millis());
+
+#if CALLBACK_FUNCTIONS
+    _wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_wake < 0) {
+        end();
+        return false;
+    }
+    _outgoing = NULL;
+    if (_executor != NULL) {
+        _executor->onReady(wakeUp, this);
+    }
+#endif
+
+#if WS_HAVE_URING
+    if (backend != WS_REACTOR_EPOLL && beginUring()) {
+        _backend = WS_REACTOR_URING;
+        return true;
+    }
+#endif
+    if (backend == WS_REACTOR_URING) {
+        end();
+        return false;
+    }
+
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (_epoll < 0) {
+        end();
+        return false;
+    }
+
+    // The listening socket is the only one registered without a connection
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, _listen, &event) != 0) {
+        end();
+        return false;
+    }
+
+    if (_wake >= 0) {
+        event.events = EPOLLIN;
+        event.data.ptr = &_wake;
+        if (epoll_ctl(_epoll, EPOLL_CTL_ADD, _wake, &event) != 0) {
+            end();
+            return false;
+        }
+    }
+
+    _backend = WS_REACTOR_EPOLL;
+    return true;
+}
+
+bool WebSocketReactor::listenOn(uint16_t port) {
+    struct sockaddr_in address;
+    int one = 1;
+
+    _listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_listen < 0) {
+        return false;
+    }
+    setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    return bind(_listen, (struct sockaddr *) &address, sizeof(address)) == 0
+           && listen(_listen, SOMAXCONN) == 0;
+}
+
+void WebSocketReactor::end() {
+    while (_connections != NULL) {
+        close(_connections);
+    }
+#if WS_HAVE_URING
+    endUring();
+#endif
+    // Without the ring nothing is in flight any more
+    while (_closing != NULL) {
+        finish(_closing);
+    }
+    if (_epoll >= 0) {
+        ::close(_epoll);
+        _epoll = -1;
+    }
+    if (_listen >= 0) {
+        ::close(_listen);
+        _listen = -1;
+    }
+    if (_wake >= 0) {
+#if CALLBACK_FUNCTIONS
+        if (_executor != NULL) {
+            _executor->onReady(NULL, NULL);
+        }
+#endif
+        ::close(_wake);
+        _wake = -1;
+    }
+#if CALLBACK_FUNCTIONS
+    _outgoing = NULL;
+#endif
+    _slab.end();
+}
+
+void WebSocketReactor::onConnect(WebSocketReactorCallback callback, void *context) {
+    _connectCallback = callback;
+    _connectContext = context;
+}
+
+void WebSocketReactor::onDisconnect(WebSocketReactorCallback callback, void *context) {
+    _disconnectCallback = callback;
+    _disconnectContext = context;
+}
+
+void WebSocketReactor::setAdmission(WebSocketAdmission *admission) {
+    _admission = admission;
+}
+
+#if CALLBACK_FUNCTIONS
+void WebSocketReactor::setExecutor(WebSocketExecutor *executor, WebSocketJobHandler handler, void *context) {
+    _executor = executor;
+    _jobHandler = handler;
+    _jobContext = context;
+}
+#endif
+
+void WebSocketReactor::wakeUp(void *reactor) {
+    uint64_t one = 1;
+
+    if (write(((WebSocketReactor *) reactor)->_wake, &one, sizeof(one)) < 0) {
+        // Already signalled; the counter is just saturated
+    }
+}
+
+void WebSocketReactor::deliverReplies() {
+#if CALLBACK_FUNCTIONS
+    WebSocketStrand *strand;
+
+    if (_executor == NULL) {
+        return;
+    }
+    while ((strand = _executor->nextReady()) != NULL) {
+        Connection *connection = (Connection *) strand->userData();
+
+        strand->flush();
+#if WS_HAVE_URING
+        if (_uring.active() && connection->client.connected()) {
+            schedule(connection);
+        }
+#else
+        (void) connection;
+#endif
+    }
+#endif
+}
+
+#if CALLBACK_FUNCTIONS
+// On the sending thread. The flag keeps the connection on the list once.
+void WebSocketReactor::outgoingReady(void *context) {
+    Connection *connection = (Connection *) context;
+    WebSocketReactor *reactor = connection->reactor;
+
+    if (connection->outgoing.exchange(true)) {
+        return;
+    }
+    Connection *head = reactor->_outgoing.load(std::memory_order_relaxed);
+    do {
+        connection->nextOutgoing = head;
+    } while (!reactor->_outgoing.compare_exchange_weak(head, connection, std::memory_order_release,
+                                                       std::memory_order_relaxed));
+    wakeUp(reactor);
+}
+
+void WebSocketReactor::sendOutgoing() {
+    Connection *connection = _outgoing.exchange(NULL, std::memory_order_acquire);
+
+    while (connection != NULL) {
+        Connection *next = connection->nextOutgoing;
+
+        // Cleared first, so a message sent from here on lists it again
+        connection->outgoing.exchange(false);
+        // It may have closed since; poll() takes the messages
+        if (!connection->closed && connection->established) {
+            service(connection);
+        }
+        connection = next;
+    }
+}
+#endif
+
+int WebSocketReactor::run(int timeoutMs) {
+    struct epoll_event events[WS_REACTOR_EVENTS];
+
+#if WS_HAVE_URING
+    if (_uring.active()) {
+        return runUring(timeoutMs);
+    }
+#endif
+    if (_epoll < 0) {
+        return -1;
+    }
+
+    // Connections that still had unread data last time must not wait
+    timeoutMs = _pending != NULL ? 0 : waitFor(timeoutMs);
+
+    int count = epoll_wait(_epoll, events, WS_REACTOR_EVENTS, timeoutMs);
+    if (count < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    Connection *pending = _pending;
+    _pending = NULL;
+    while (pending != NULL) {
+        Connection *connection = pending;
+        pending = connection->nextPending;
+        connection->pending = false;
+        service(connection);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        Connection *connection = (Connection *) events[i].data.ptr;
+
+        if (connection == NULL) {
+            accept();
+        } else if ((void *) connection == &_wake) {
+            uint64_t signals;
+            if (read(_wake, &signals, sizeof(signals)) < 0) {
+                // Nothing to clear
+            }
+        } else if (connection->closed) {
+            linger(connection);
+        } else if (!connection->pending) {
+            service(connection);
+        }
+    }
+    deliverReplies();
+#if CALLBACK_FUNCTIONS
+    sendOutgoing();
+#endif
+
+    _timers.advance(millis(), expired, this);
+    return count;
+}
+
+void WebSocketReactor::accept() {
+    // Edge triggered: take every connection that is waiting
+    while (true) {
+        int fd = accept4(_listen, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            break;
+        }
+        adopt(fd);
+    }
+}
+
+// Over a limit: answer with the prebuilt 503 if admission control is on,
+// without waiting for the socket to become writable, and close.
+void WebSocketReactor::refuse(int fd) {
+    _stats.refused++;
+    if (_admission != NULL) {
+        if (send(fd, WebSocketAdmission::response(), WebSocketAdmission::responseLength(),
+                 MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            // Nobody to tell
+        }
+    }
+    ::close(fd);
+}
+
+WebSocketReactor::Connection *WebSocketReactor::adopt(int fd) {
+    _stats.accepted++;
+
+    // Connections still closing hold on to theirs, and their buffer slot.
+    // Rather cut one short than turn the new one away; on io_uring its slot
+    // only frees once the kernel has given up its read, too late for this one.
+    for (Connection *closing = _closing; _slab.available() == 0 && closing != NULL; closing = closing->next) {
+        if (closing->client.lingering()) {
+            closing->client.close();
+            linger(closing);
+            break;
+        }
+    }
+    if (_slab.available() == 0) {
+        refuse(fd);
+        return NULL;
+    }
+
+    if (_admission != NULL) {
+        struct sockaddr_in address;
+        socklen_t length = sizeof(address);
+        uint32_t source = 0;
+
+        if (getpeername(fd, (struct sockaddr *) &address, &length) == 0 && address.sin_family == AF_INET) {
+            source = ntohl(address.sin_addr.s_addr);
+        }
+        if (_admission->check(source) != WS_ADMIT) {
+            refuse(fd);
+            return NULL;
+        }
+    }
+
+    Connection *connection = _slab.acquire();
+    connection->acceptedMillis = millis();
+    connection->timer.owner = connection;
+    connection->established = false;
+    connection->pending = false;
+    connection->reading = false;
+    connection->writing = false;
+    connection->closed = false;
+    // The client lingers instead; waiting here would stall every connection
+    connection->server.setCloseDelay(0);
+#if CALLBACK_FUNCTIONS
+    connection->strand = NULL;
+#endif
+    connection->nextPending = NULL;
+
+#if WS_HAVE_URING
+    if (_uring.active()) {
+        uint8_t *tx = _buffers + (2 * connection->slot + 1) * WS_URING_BUFFER_LENGTH;
+        connection->client.attach(fd, tx, WS_URING_BUFFER_LENGTH);
+    } else
+#endif
+    {
+        struct epoll_event event;
+
+        connection->client.attach(fd);
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = connection;
+        if (epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+            if (_admission != NULL) {
+                _admission->handshakeFinished(false);
+            }
+            connection->client.close();
+            recycle(connection);
+            return NULL;
+        }
+    }
+
+    connection->prev = NULL;
+    connection->next = _connections;
+    if (_connections != NULL) {
+        _connections->prev = connection;
+    }
+    _connections = connection;
+    _count++;
+    _timers.schedule(connection->timer, connection->acceptedMillis + TIMEOUT_IN_MS);
+
+#if WS_HAVE_URING
+    if (_uring.active()) {
+        schedule(connection);
+    }
+#endif
+    return connection;
+}
+
+void WebSocketReactor::service(Connection *connection) {
+    // Edge triggered: read until the kernel has nothing left, or we stop
+    // because the buffer is full and come back on the next run()
+    bool drained = connection->client.fill();
+
+    if (!connection->established) {
+        if (connection->client.headersComplete()) {
+            if (!connection->server.handshake(connection->client)) {
+                _stats.failed++;
+                close(connection);
+                return;
+            }
+            connection->established = true;
+            _timers.cancel(connection->timer);
+            _stats.established++;
+            if (_admission != NULL) {
+                _admission->handshakeFinished(true);
+            }
+#if CALLBACK_FUNCTIONS
+            if (_executor != NULL) {
+                connection->strand = new WebSocketStrand(*_executor, connection->server,
+                                                         _jobHandler, _jobContext);
+                connection->strand->setUserData(connection);
+            }
+            // Before onConnect, which may hand the server to other threads
+            connection->server.onOutgoing(outgoingReady, connection);
+#endif
+            if (_connectCallback) {
+                _connectCallback(_connectContext, connection->server);
+            }
+        } else if (!drained || !connection->client.connected()) {
+            // Header too big to buffer, or the peer gave up
+            _stats.failed++;
+            close(connection);
+            return;
+        }
+    }
+
+    if (connection->established) {
+        connection->server.poll();
+    }
+
+    if (!connection->client.connected()) {
+        close(connection);
+        return;
+    }
+    // Handlers may have held output back or turned keepalive on
+    if (connection->established) {
+        arm(connection);
+    }
+
+#if WS_HAVE_URING
+    if (_uring.active()) {
+        schedule(connection);
+        return;
+    }
+#endif
+    if (!drained && !connection->pending) {
+        connection->pending = true;
+        connection->nextPending = _pending;
+        _pending = connection;
+    }
+}
+
+void WebSocketReactor::arm(Connection *connection) {
+    unsigned long at;
+
+    if (connection->server.nextDeadline(at)) {
+        _timers.schedule(connection->timer, at);
+    }
+}
+
+void WebSocketReactor::expired(void *reactor, WebSocketTimer &timer) {
+    ((WebSocketReactor *) reactor)->timeout((Connection *) timer.owner);
+}
+
+int WebSocketReactor::waitFor(int timeoutMs) const {
+    long due = _timers.nextExpiry(millis());
+
+    if (due >= 0 && (timeoutMs < 0 || due < timeoutMs)) {
+        return (int) due;
+    }
+    return timeoutMs;
+}
+
+void WebSocketReactor::timeout(Connection *connection) {
+    if (connection->closed) {
+        // The peer never closed its side
+        connection->client.close();
+        linger(connection);
+        return;
+    }
+    if (!connection->established) {
+        // The request never arrived in full
+        _stats.failed++;
+        close(connection);
+        return;
+    }
+
+    // Sends the ping, held output or drops the idle connection; activity
+    // since the timer was armed just moves the deadline
+    connection->server.poll();
+    if (!connection->client.connected()) {
+        close(connection);
+        return;
+    }
+    arm(connection);
+#if WS_HAVE_URING
+    if (_uring.active()) {
+        schedule(connection);
+    }
+#endif
+}
+
+void WebSocketReactor::unlink(Connection *&list, Connection *connection) {
+    if (connection->prev != NULL) {
+        connection->prev->next = connection->next;
+    } else {
+        list = connection->next;
+    }
+    if (connection->next != NULL) {
+        connection->next->prev = connection->prev;
+    }
+    connection->prev = NULL;
+    connection->next = NULL;
+}
+
+void WebSocketReactor::close(Connection *connection) {
+    if (connection->established && _disconnectCallback) {
+        _disconnectCallback(_disconnectContext, connection->server);
+    }
+    if (_admission != NULL) {
+        if (connection->established) {
+            _admission->connectionClosed();
+        } else {
+            _admission->handshakeFinished(false);
+        }
+    }
+
+    if (connection->pending) {
+        Connection **link = &_pending;
+        while (*link != connection) {
+            link = &(*link)->nextPending;
+        }
+        *link = connection->nextPending;
+        connection->pending = false;
+    }
+    unlink(_connections, connection);
+    _timers.cancel(connection->timer);
+
+#if CALLBACK_FUNCTIONS
+    // Frees itself once a worker running its handler is done
+    if (connection->strand != NULL) {
+        connection->strand->close();
+        connection->strand = NULL;
+    }
+#endif
+
+    // The socket stays open until the close frame is out and the peer has
+    // answered it by closing its side (RFC 6455 7.1.1)
+    connection->client.stop();
+    connection->closed = true;
+
+    _count--;
+    _stats.closed++;
+
+    connection->next = _closing;
+    if (_closing != NULL) {
+        _closing->prev = connection;
+    }
+    _closing = connection;
+    _timers.schedule(connection->timer, millis() + WS_REACTOR_LINGER_MS);
+    linger(connection);
+}
+
+void WebSocketReactor::linger(Connection *connection) {
+    PosixClient &client = connection->client;
+
+#if WS_HAVE_URING
+    if (_uring.active()) {
+        uint64_t tag = (uint64_t) (uintptr_t) connection;
+        uint8_t *rx = _buffers + 2 * connection->slot * WS_URING_BUFFER_LENGTH;
+        size_t length;
+        const uint8_t *data = client.staged(length);
+
+        if (client.lingering() && !client.eof()) {
+            // Whatever is staged, usually the close frame, goes out first
+            if (!connection->writing && length > 0) {
+                connection->writing = _uring.write(client.fd(), data, length, tag | TAG_WRITE);
+            }
+            // The peer's end shows as an empty read
+            if (!connection->reading) {
+                connection->reading = _uring.read(client.fd(), rx, WS_URING_BUFFER_LENGTH, tag | TAG_READ);
+            }
+            if (!connection->reading || (length > 0 && !connection->writing)) {
+                // No room in the ring
+                client.close();
+            }
+        } else {
+            // Makes whatever is still in flight complete
+            client.close();
+        }
+        // The kernel still owns its buffers until then
+        if (!connection->reading && !connection->writing) {
+            finish(connection);
+        }
+        return;
+    }
+#endif
+    // Edge triggered: read away whatever came meanwhile
+    client.fill();
+    if (!client.lingering() || client.eof()) {
+        finish(connection);
+    }
+}
+
+void WebSocketReactor::finish(Connection *connection) {
+    _timers.cancel(connection->timer);
+    // Also removes it from the epoll set
+    connection->client.close();
+    unlink(_closing, connection);
+    recycle(connection);
+}
+
+void WebSocketReactor::recycle(Connection *connection) {
+    connection->server.reset();
+    _slab.release(connection);
+}
+
+#if WS_HAVE_URING
+
+bool WebSocketReactor::beginUring() {
+    size_t length = 2 * WS_URING_BUFFER_LENGTH * _maxConnections;
+
+    // One slot per connection in the slab, at its index there
+    _buffers = (uint8_t *) malloc(length);
+    if (_buffers == NULL) {
+        endUring();
+        return false;
+    }
+
+    // Room for a read and a write per connection, the accept and the timer
+    if (!_uring.begin(2 * _maxConnections + 2, _buffers, length)) {
+        endUring();
+        return false;
+    }
+
+    _accepting = false;
+    return true;
+}
+
+void WebSocketReactor::endUring() {
+    // Closing the ring cancels whatever is still in flight, so connections
+    // waiting for their last completion can go now
+    _uring.end();
+    for (Connection *connection = _closing; connection != NULL; connection = connection->next) {
+        connection->reading = false;
+        connection->writing = false;
+    }
+
+    free(_buffers);
+    _buffers = NULL;
+    _accepting = false;
+    _waking = false;
+}
+
+int WebSocketReactor::runUring(int timeoutMs) {
+    uint64_t tag;
+    int result;
+    int count = 0;
+
+    // Connections that had no room for another read get served first
+    Connection *pending = _pending;
+    _pending = NULL;
+    while (pending != NULL) {
+        Connection *connection = pending;
+        pending = connection->nextPending;
+        connection->pending = false;
+        service(connection);
+    }
+
+    if (!_accepting) {
+        _accepting = _uring.accept(_listen, TAG_ACCEPT);
+    }
+    if (_wake >= 0 && !_waking) {
+        _waking = _uring.poll(_wake, TAG_WAKE);
+    }
+
+    // Everything prepared since the last call goes in with the wait
+    timeoutMs = waitFor(timeoutMs);
+    bool wait = timeoutMs != 0 && _pending == NULL;
+    if (wait && timeoutMs > 0) {
+        wait = _uring.timeout(timeoutMs, TAG_TIMEOUT);
+    }
+    if (_uring.submit(wait) < 0) {
+        return -1;
+    }
+
+    while (_uring.complete(tag, result)) {
+        complete(tag, result);
+        count++;
+    }
+    deliverReplies();
+#if CALLBACK_FUNCTIONS
+    sendOutgoing();
+#endif
+
+    _timers.advance(millis(), expired, this);
+    return count;
+}
+
+void WebSocketReactor::schedule(Connection *connection) {
+    uint64_t tag = (uint64_t) (uintptr_t) connection;
+    uint8_t *rx = _buffers + 2 * connection->slot * WS_URING_BUFFER_LENGTH;
+    int fd = connection->client.fd();
+    bool stalled = false;
+    size_t length;
+    const uint8_t *data = connection->client.staged(length);
+
+    if (!connection->reading) {
+        // Only read once the bytes will fit next to what is unread
+        if (connection->client.buffered() + WS_URING_BUFFER_LENGTH <= WS_POSIX_RX_LIMIT
+            && _uring.read(fd, rx, WS_URING_BUFFER_LENGTH, tag | TAG_READ)) {
+            connection->reading = true;
+        } else {
+            stalled = true;
+        }
+    }
+
+    if (!connection->writing && length > 0) {
+        if (_uring.write(fd, data, length, tag | TAG_WRITE)) {
+            connection->writing = true;
+        } else {
+            stalled = true;
+        }
+    }
+
+    if (stalled && !connection->pending) {
+        connection->pending = true;
+        connection->nextPending = _pending;
+        _pending = connection;
+    }
+}
+
+void WebSocketReactor::complete(uint64_t tag, int result) {
+    Connection *connection = (Connection *) (uintptr_t) (tag & ~(uint64_t) TAG_MASK);
+
+    switch (tag & TAG_MASK) {
+    case TAG_ACCEPT:
+        // Re-armed on the next run()
+        _accepting = false;
+        if (result >= 0) {
+            adopt(result);
+            accept();
+        }
+        return;
+
+    case TAG_TIMEOUT:
+        return;
+
+    case TAG_WAKE:
+        // Re-armed on the next run(); the replies go out after completions
+        _waking = false;
+        {
+            uint64_t signals;
+            if (read(_wake, &signals, sizeof(signals)) < 0) {
+                // Nothing to clear
+            }
+        }
+        return;
+
+    case TAG_READ:
+        connection->reading = false;
+        if (result > 0) {
+            connection->client.deliver(_buffers + 2 * connection->slot * WS_URING_BUFFER_LENGTH, result);
+        } else if (result != -EAGAIN && result != -EINTR) {
+            connection->client.deliver(NULL, 0);
+        }
+        if (connection->closed) {
+            linger(connection);
+            return;
+        }
+        service(connection);
+        return;
+
+    case TAG_WRITE:
+        connection->writing = false;
+        if (connection->closed) {
+            if (result >= 0) {
+                connection->client.sent(result);
+            } else {
+                connection->client.close();
+            }
+            linger(connection);
+            return;
+        }
+        if (result >= 0) {
+            connection->client.sent(result);
+        } else if (result != -EAGAIN && result != -EINTR) {
+            connection->client.deliver(NULL, 0);
+        }
+        service(connection);
+        return;
+    }
+}
+
+#endif
+
+#endif
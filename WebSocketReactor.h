@@ -0,0 +1,244 @@
+/*
+ *  WebSocketReactor.h
+ *
+ *  Description:
+ *      Edge-triggered epoll loop that serves many WebSocketServer
+ *      connections from one thread on Linux. Each accepted socket gets a
+ *      PosixClient and a WebSocketServer; the handshake runs once the
+ *      complete request header has arrived, so it never waits on the
+ *      network, and established connections are polled whenever their
+ *      socket becomes readable or writable.
+ *
+ *      Where the kernel supports it the reactor runs on io_uring instead:
+ *      every connection keeps a read in flight into its slot of one
+ *      registered buffer, output is staged into the slot's other half, and
+ *      all reads and writes prepared in one run() go to the kernel in a
+ *      single system call, together with the wait for the next events.
+ *
+ *      Handshake deadlines and keepalive pings and idle timeouts are kept
+ *      on a timer wheel, so run() only touches the connections that are
+ *      due instead of polling every one of them.
+ *
+ *      A closed connection keeps its socket until the close frame is out
+ *      and the peer has closed its side too, or WS_REACTOR_LINGER_MS has
+ *      passed, so the server doesn't close TCP under the peer's feet.
+ *
+ *      Connections come from a slab built by begin() for maxConnections,
+ *      with their receive, send and message buffers already grown, and go
+ *      back to it on close with the buffers kept. Accepting and closing
+ *      connections therefore doesn't touch the heap until a connection
+ *      outgrows what was reserved.
+ *
+ *      Other threads may send on a connection (see WebSocketServer::
+ *      sendData()): the message waits in the connection's lock-free queue,
+ *      the connection goes on a lock-free list of those with messages
+ *      waiting, and run() is woken to write them out.
+ */
+
+#ifndef WEBSOCKETREACTOR_H_
+#define WEBSOCKETREACTOR_H_
+
+#if defined(__linux__)
+
+#include <Arduino.h>
+#include "PosixClient.h"
+#include "WebSocketServer.h"
+#include "WebSocketAdmission.h"
+#include "WebSocketExecutor.h"
+#include "WebSocketUring.h"
+#include "WebSocketTimer.h"
+#include "WebSocketSlab.h"
+
+#ifndef WS_REACTOR_MAX_CONNECTIONS
+#define WS_REACTOR_MAX_CONNECTIONS 4096
+#endif
+
+// Socket events handled per epoll_wait() call.
+#ifndef WS_REACTOR_EVENTS
+#define WS_REACTOR_EVENTS 256
+#endif
+
+// Buffer space each connection gets up front: received bytes not yet
+// decoded, queued output and the message being reassembled.
+#ifndef WS_REACTOR_RX_RESERVE
+#define WS_REACTOR_RX_RESERVE 2048
+#endif
+#ifndef WS_REACTOR_SEND_RESERVE
+#define WS_REACTOR_SEND_RESERVE 1024
+#endif
+#ifndef WS_REACTOR_MESSAGE_RESERVE
+#define WS_REACTOR_MESSAGE_RESERVE 256
+#endif
+
+// How long (in ms) a closed connection waits for the peer to close its side
+// after the close frame, before the socket is closed anyway.
+#ifndef WS_REACTOR_LINGER_MS
+#define WS_REACTOR_LINGER_MS 1000
+#endif
+
+// Bytes per connection and direction in the io_uring registered buffer.
+#ifndef WS_URING_BUFFER_LENGTH
+#define WS_URING_BUFFER_LENGTH 2048
+#endif
+
+enum WebSocketReactorBackend {
+    WS_REACTOR_AUTO,    // io_uring when the kernel has it, else epoll
+    WS_REACTOR_EPOLL,
+    WS_REACTOR_URING
+};
+
+// Called with the connection's server, e.g. to register its handlers.
+typedef void (*WebSocketReactorCallback)(void *context, WebSocketServer &server);
+
+struct WebSocketReactorStats {
+    unsigned long accepted;     // sockets accepted
+    unsigned long refused;      // sockets closed at once, over a limit
+    unsigned long established;  // successful handshakes
+    unsigned long failed;       // failed or timed out handshakes
+    unsigned long closed;       // connections torn down, for any reason
+};
+
+class WebSocketReactor {
+public:
+    WebSocketReactor();
+    ~WebSocketReactor();
+
+    // Listen on port and get ready to accept up to maxConnections, setting
+    // aside memory for all of them. Asking for WS_REACTOR_URING fails if
+    // io_uring can't be set up; AUTO falls back to epoll.
+    bool begin(uint16_t port, size_t maxConnections = WS_REACTOR_MAX_CONNECTIONS,
+               WebSocketReactorBackend backend = WS_REACTOR_AUTO);
+    void end();
+
+    // The backend actually in use.
+    WebSocketReactorBackend backend() const { return _backend; }
+
+    // Wait up to timeoutMs (-1 for ever) for socket activity and service
+    // it, waking early for the next timer. Returns the number of events
+    // handled, or -1 if the reactor isn't running.
+    int run(int timeoutMs);
+
+    // After a successful handshake, before any frame is dispatched.
+    void onConnect(WebSocketReactorCallback callback, void *context = NULL);
+    // Before an established connection is freed.
+    void onDisconnect(WebSocketReactorCallback callback, void *context = NULL);
+
+#if CALLBACK_FUNCTIONS
+    // Run handler for every text and binary message on the executor's
+    // workers instead of the reactor thread; replies go out from run().
+    // Call before begin(). onConnect() must not replace onText()/onBinary().
+    void setExecutor(WebSocketExecutor *executor, WebSocketJobHandler handler, void *context = NULL);
+#endif
+
+    // Screen every accepted socket before its handshake: refused ones get a
+    // 503 and are closed without reading the request. Call before begin().
+    void setAdmission(WebSocketAdmission *admission);
+
+    size_t connections() const { return _count; }
+    const WebSocketReactorStats &stats() const { return _stats; }
+
+private:
+    struct Connection {
+        PosixClient client;
+        WebSocketServer server;
+        unsigned long acceptedMillis;
+        // Handshake deadline, then the server's next timed work
+        WebSocketTimer timer;
+        bool established;
+        bool pending;
+        // io_uring: buffer slot, the connection's place in the slab, and
+        // operations in flight
+        size_t slot;
+        bool reading;
+        bool writing;
+        bool closed;
+#if CALLBACK_FUNCTIONS
+        WebSocketStrand *strand;
+        // On the list of connections with messages from other threads
+        WebSocketReactor *reactor;
+        std::atomic<bool> outgoing;
+        Connection *nextOutgoing;
+#endif
+        Connection *prev;
+        Connection *next;
+        Connection *nextPending;
+    };
+
+    WebSocketReactorBackend _backend;
+    int _epoll;
+    int _listen;
+    size_t _maxConnections;
+    size_t _count;
+    WebSocketTimerWheel _timers;
+
+    // Every connection, in use or not; closing ones hold on to theirs
+    WebSocketSlab<Connection> _slab;
+    Connection *_connections;
+    Connection *_pending;
+    Connection *_closing;
+
+#if WS_HAVE_URING
+    WebSocketUring _uring;
+    uint8_t *_buffers;
+    bool _accepting;
+    bool _waking;
+#endif
+
+    WebSocketReactorCallback _connectCallback;
+    void *_connectContext;
+    WebSocketReactorCallback _disconnectCallback;
+    void *_disconnectContext;
+
+    WebSocketReactorStats _stats;
+    WebSocketAdmission *_admission;
+
+#if CALLBACK_FUNCTIONS
+    WebSocketExecutor *_executor;
+    WebSocketJobHandler _jobHandler;
+    void *_jobContext;
+    // Pushed by sending threads, taken whole by run()
+    std::atomic<Connection *> _outgoing;
+#endif
+    // eventfd the executor's workers and sending threads signal when
+    // replies or messages are waiting
+    int _wake;
+
+    bool listenOn(uint16_t port);
+    void accept();
+    Connection *adopt(int fd);
+    void refuse(int fd);
+    void service(Connection *connection);
+    void close(Connection *connection);
+    // Keep a closed connection's socket until the peer has closed its side
+    // too, and io_uring has nothing in flight on it, then finish it.
+    void linger(Connection *connection);
+    // Close the socket and hand the connection back to the slab.
+    void finish(Connection *connection);
+    // Back to the slab, ready for the next accept.
+    void recycle(Connection *connection);
+    // Arm the connection's timer for its next timed work, if any.
+    void arm(Connection *connection);
+    void timeout(Connection *connection);
+    static void expired(void *reactor, WebSocketTimer &timer);
+    // The caller's timeout, cut short for the next timer that is due.
+    int waitFor(int timeoutMs) const;
+    void unlink(Connection *&list, Connection *connection);
+    void deliverReplies();
+    static void wakeUp(void *reactor);
+#if CALLBACK_FUNCTIONS
+    static void outgoingReady(void *connection);
+    void sendOutgoing();
+#endif
+
+#if WS_HAVE_URING
+    bool beginUring();
+    void endUring();
+    int runUring(int timeoutMs);
+    void schedule(Connection *connection);
+    void complete(uint64_t tag, int result);
+#endif
+};
+
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+//#define DEBUGGING
+
+#include "WebSocketRegion.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void unmapFile(void *context, const uint8_t *data, size_t length) {
+    (void) context;
+    munmap((void *) data, length);
+}
+
+bool wsMapFile(const char *path, WebSocketRegion &region) {
+    struct stat info;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+#ifdef DEBUGGING
+        Serial.print(F("Can't open "));
+        Serial.println(path);
+#endif
+        return false;
+    }
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return false;
+    }
+
+    region.data = NULL;
+    region.length = info.st_size;
+    region.release = NULL;
+    region.context = NULL;
+
+    // mmap() refuses empty mappings
+    if (region.length > 0) {
+        void *map = mmap(NULL, region.length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        // Read front to back exactly once
+        madvise(map, region.length, MADV_SEQUENTIAL);
+        region.data = (const uint8_t *) map;
+        region.release = unmapFile;
+    }
+
+    // The mapping holds its own reference to the file
+    close(fd);
+    return true;
+}
+#endif
+
+#if defined(ESP32)
+#include <esp_spi_flash.h>
+
+static void unmapPartition(void *context, const uint8_t *data, size_t length) {
+    (void) data;
+    (void) length;
+    spi_flash_munmap((spi_flash_mmap_handle_t) (uintptr_t) context);
+}
+
+bool wsMapPartition(const esp_partition_t *partition, size_t offset, size_t length,
+                    WebSocketRegion &region) {
+    spi_flash_mmap_handle_t handle;
+    const void *map;
+
+    if (partition == NULL || offset > partition->size || length > partition->size - offset) {
+        return false;
+    }
+
+    region.data = NULL;
+    region.length = length;
+    region.release = NULL;
+    region.context = NULL;
+    if (length == 0) {
+        return true;
+    }
+
+    if (esp_partition_mmap(partition, offset, length, SPI_FLASH_MMAP_DATA, &map, &handle) != ESP_OK) {
+#ifdef DEBUGGING
+        Serial.println(F("Can't map partition"));
+#endif
+        return false;
+    }
+
+    region.data = (const uint8_t *) map;
+    region.release = unmapPartition;
+    region.context = (void *) (uintptr_t) handle;
+    return true;
+}
+#endif
@@ -0,0 +1,40 @@
+/*
+ *  WebSocketRegion.h
+ *
+ *  Description:
+ *      Payloads for sendRegion() that are mapped rather than read: a file
+ *      on Linux (mmap), a flash partition on the ESP32 (the flash cache
+ *      mapping). The socket is fed straight from the mapping, so a large
+ *      asset or recorded log never takes up heap or passes through a
+ *      String. The region's release function unmaps it once sent.
+ */
+
+#ifndef WEBSOCKETREGION_H_
+#define WEBSOCKETREGION_H_
+
+#include <Arduino.h>
+#include "WebSocketSendQueue.h"
+
+#if defined(ESP32)
+#include <esp_partition.h>
+#endif
+
+#if defined(__linux__)
+// Map a whole file read only. An empty file gives an empty region.
+bool wsMapFile(const char *path, WebSocketRegion &region);
+#endif
+
+#if defined(ESP32)
+// Map length bytes of a data partition, starting at offset.
+bool wsMapPartition(const esp_partition_t *partition, size_t offset, size_t length,
+                    WebSocketRegion &region);
+#endif
+
+// Give the region back without sending it.
+static inline void wsReleaseRegion(const WebSocketRegion &region) {
+    if (region.release != NULL) {
+        region.release(region.context, region.data, region.length);
+    }
+}
+
+#endif
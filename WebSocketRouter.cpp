@@ -0,0 +1,281 @@
+//#define DEBUGGING
+
+#include "WebSocketRouter.h"
+
+#if CALLBACK_FUNCTIONS
+
+WebSocketRouter::WebSocketRouter() {
+    _buckets = NULL;
+    _bucketCount = 0;
+    _topicCount = 0;
+    _peers = NULL;
+    _messageCallback = NULL;
+    _messageContext = NULL;
+}
+
+WebSocketRouter::~WebSocketRouter() {
+    while (_peers != NULL) {
+        detach(*_peers->server);
+    }
+    ws_free(&_memory, _buckets, _bucketCount * sizeof(Topic *));
+}
+
+void WebSocketRouter::onMessage(WebSocketRouterCallback callback, void *context) {
+    _messageCallback = callback;
+    _messageContext = context;
+}
+
+bool WebSocketRouter::attach(WebSocketServer &server) {
+    Peer *peer = (Peer *) ws_malloc(&_memory, sizeof(Peer));
+    if (peer == NULL) {
+        return false;
+    }
+
+    peer->router = this;
+    peer->server = &server;
+    peer->subscriptions = NULL;
+    peer->next = _peers;
+    _peers = peer;
+
+    server.onText(handleText, peer);
+    return true;
+}
+
+void WebSocketRouter::detach(WebSocketServer &server) {
+    Peer **link = &_peers;
+
+    while (*link != NULL && (*link)->server != &server) {
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        return;
+    }
+
+    Peer *peer = *link;
+    *link = peer->next;
+
+    while (peer->subscriptions != NULL) {
+        Subscription *subscription = peer->subscriptions;
+        peer->subscriptions = subscription->nextOfPeer;
+        drop(subscription);
+    }
+    server.onText(NULL, NULL);
+    ws_free(&_memory, peer, sizeof(Peer));
+}
+
+// FNV-1a
+uint32_t WebSocketRouter::hash(const char *name, size_t length) {
+    uint32_t value = 2166136261UL;
+
+    for (size_t i = 0; i < length; ++i) {
+        value ^= (uint8_t) name[i];
+        value *= 16777619UL;
+    }
+    return value;
+}
+
+WebSocketRouter::Topic *WebSocketRouter::find(const char *name, size_t length, uint32_t hash) const {
+    if (_buckets == NULL) {
+        return NULL;
+    }
+
+    for (Topic *topic = _buckets[hash & (_bucketCount - 1)]; topic != NULL; topic = topic->next) {
+        if (topic->hash == hash && topic->length == length && memcmp(topic->name, name, length) == 0) {
+            return topic;
+        }
+    }
+    return NULL;
+}
+
+bool WebSocketRouter::grow() {
+    size_t count = _bucketCount ? _bucketCount * 2 : WS_ROUTER_BUCKETS;
+    Topic **buckets = (Topic **) ws_malloc(&_memory, count * sizeof(Topic *));
+
+    if (buckets == NULL) {
+        // Longer chains still work
+        return _buckets != NULL;
+    }
+    memset(buckets, 0, count * sizeof(Topic *));
+
+    for (size_t i = 0; i < _bucketCount; ++i) {
+        Topic *topic = _buckets[i];
+        while (topic != NULL) {
+            Topic *next = topic->next;
+            topic->next = buckets[topic->hash & (count - 1)];
+            buckets[topic->hash & (count - 1)] = topic;
+            topic = next;
+        }
+    }
+
+    ws_free(&_memory, _buckets, _bucketCount * sizeof(Topic *));
+    _buckets = buckets;
+    _bucketCount = count;
+    return true;
+}
+
+WebSocketRouter::Topic *WebSocketRouter::intern(const char *name, size_t length) {
+    uint32_t value = hash(name, length);
+    Topic *topic = find(name, length, value);
+
+    if (topic != NULL) {
+        return topic;
+    }
+    if ((_buckets == NULL || _topicCount >= _bucketCount) && !grow()) {
+        return NULL;
+    }
+
+    topic = (Topic *) ws_malloc(&_memory, sizeof(Topic) + length);
+    if (topic == NULL) {
+        return NULL;
+    }
+    topic->hash = value;
+    topic->subscribers = NULL;
+    topic->count = 0;
+    topic->length = length;
+    memcpy(topic->name, name, length);
+    topic->name[length] = '\0';
+
+    topic->next = _buckets[value & (_bucketCount - 1)];
+    _buckets[value & (_bucketCount - 1)] = topic;
+    _topicCount++;
+    return topic;
+}
+
+void WebSocketRouter::removeTopic(Topic *topic) {
+    Topic **link = &_buckets[topic->hash & (_bucketCount - 1)];
+
+    while (*link != topic) {
+        link = &(*link)->next;
+    }
+    *link = topic->next;
+    _topicCount--;
+    ws_free(&_memory, topic, sizeof(Topic) + topic->length);
+}
+
+bool WebSocketRouter::subscribe(Peer *peer, const char *name, size_t length) {
+    for (Subscription *subscription = peer->subscriptions; subscription != NULL;
+         subscription = subscription->nextOfPeer) {
+        Topic *topic = subscription->topic;
+        if (topic->length == length && memcmp(topic->name, name, length) == 0) {
+            return true;
+        }
+    }
+
+    Topic *topic = intern(name, length);
+    if (topic == NULL) {
+        return false;
+    }
+
+    Subscription *subscription = (Subscription *) ws_malloc(&_memory, sizeof(Subscription));
+    if (subscription == NULL) {
+        if (topic->count == 0) {
+            removeTopic(topic);
+        }
+        return false;
+    }
+
+    subscription->topic = topic;
+    subscription->peer = peer;
+    subscription->prevInTopic = NULL;
+    subscription->nextInTopic = topic->subscribers;
+    if (topic->subscribers != NULL) {
+        topic->subscribers->prevInTopic = subscription;
+    }
+    topic->subscribers = subscription;
+    topic->count++;
+
+    subscription->nextOfPeer = peer->subscriptions;
+    peer->subscriptions = subscription;
+    return true;
+}
+
+bool WebSocketRouter::unsubscribe(Peer *peer, const char *name, size_t length) {
+    Subscription **link = &peer->subscriptions;
+
+    while (*link != NULL) {
+        Topic *topic = (*link)->topic;
+        if (topic->length == length && memcmp(topic->name, name, length) == 0) {
+            Subscription *subscription = *link;
+            *link = subscription->nextOfPeer;
+            drop(subscription);
+            return true;
+        }
+        link = &(*link)->nextOfPeer;
+    }
+    return false;
+}
+
+// Unlink from the topic; the caller has already unlinked it from the peer
+void WebSocketRouter::drop(Subscription *subscription) {
+    Topic *topic = subscription->topic;
+
+    if (subscription->prevInTopic != NULL) {
+        subscription->prevInTopic->nextInTopic = subscription->nextInTopic;
+    } else {
+        topic->subscribers = subscription->nextInTopic;
+    }
+    if (subscription->nextInTopic != NULL) {
+        subscription->nextInTopic->prevInTopic = subscription->prevInTopic;
+    }
+    ws_free(&_memory, subscription, sizeof(Subscription));
+
+    if (--topic->count == 0) {
+        removeTopic(topic);
+    }
+}
+
+void WebSocketRouter::handleText(void *context, const uint8_t *payload, size_t length) {
+    Peer *peer = (Peer *) context;
+    WebSocketRouter *router = peer->router;
+    const char *text = (const char *) payload;
+
+    if (length > 4 && length - 4 <= WS_ROUTER_MAX_TOPIC && memcmp(text, "SUB ", 4) == 0) {
+        router->subscribe(peer, text + 4, length - 4);
+    } else if (length > 6 && length - 6 <= WS_ROUTER_MAX_TOPIC && memcmp(text, "UNSUB ", 6) == 0) {
+        router->unsubscribe(peer, text + 6, length - 6);
+    } else if (router->_messageCallback) {
+        router->_messageCallback(router->_messageContext, *peer->server, payload, length);
+    }
+}
+
+size_t WebSocketRouter::subscribers(const char *name) const {
+    size_t length = strlen(name);
+    Topic *topic = find(name, length, hash(name, length));
+
+    return topic != NULL ? topic->count : 0;
+}
+
+size_t WebSocketRouter::publish(const char *name, const char *text) {
+    return publish(name, (const uint8_t *) text, strlen(text), WS_OPCODE_TEXT);
+}
+
+size_t WebSocketRouter::publish(const char *name, const uint8_t *payload, size_t length, uint8_t opcode) {
+    size_t nameLength = strlen(name);
+    Topic *topic = find(name, nameLength, hash(name, nameLength));
+    size_t count = 0;
+
+    if (topic == NULL) {
+        return 0;
+    }
+
+    // Encode once; every subscriber gets the same bytes
+    uint8_t *frame = (uint8_t *) ws_malloc(&_memory, WS_MAX_HEADER_LENGTH + length);
+    if (frame == NULL) {
+        return 0;
+    }
+    size_t header = WebSocketSendQueue::encodeHeader(frame, WS_FIN | opcode, length, NULL);
+    memcpy(frame + header, payload, length);
+
+    for (Subscription *subscription = topic->subscribers; subscription != NULL;
+         subscription = subscription->nextInTopic) {
+        WebSocketSendStatus status = subscription->peer->server->sendFrame(frame, header + length);
+        if (status == WS_SEND_QUEUED || status == WS_SEND_WOULD_BLOCK) {
+            count++;
+        }
+    }
+
+    ws_free(&_memory, frame, WS_MAX_HEADER_LENGTH + length);
+    return count;
+}
+
+#endif
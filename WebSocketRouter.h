@@ -0,0 +1,113 @@
+/*
+ *  WebSocketRouter.h
+ *
+ *  Description:
+ *      Topic based publish/subscribe over WebSocketServer connections.
+ *      Attached clients subscribe with a "SUB <topic>" text message and
+ *      leave with "UNSUB <topic>". publish() encodes the frame once and
+ *      queues the same bytes on every subscriber. Topics are kept in a
+ *      hash table, so a publish costs one lookup plus one queue push per
+ *      subscriber, however many topics exist.
+ */
+
+#ifndef WEBSOCKETROUTER_H_
+#define WEBSOCKETROUTER_H_
+
+#include <Arduino.h>
+#include "WebSocketServer.h"
+
+#if CALLBACK_FUNCTIONS
+
+// Hash buckets to start with; the table doubles as topics are added.
+#ifndef WS_ROUTER_BUCKETS
+#define WS_ROUTER_BUCKETS 16
+#endif
+
+// Longest topic name accepted from a client.
+#ifndef WS_ROUTER_MAX_TOPIC
+#define WS_ROUTER_MAX_TOPIC 64
+#endif
+
+// Text messages that aren't subscription requests.
+typedef void (*WebSocketRouterCallback)(void *context, WebSocketServer &server,
+                                        const uint8_t *payload, size_t length);
+
+class WebSocketRouter {
+public:
+    WebSocketRouter();
+    ~WebSocketRouter();
+
+    // Take over the server's onText() handler. Other text goes to the
+    // onMessage() callback.
+    bool attach(WebSocketServer &server);
+    // Drop the server's subscriptions; call before the connection goes away.
+    void detach(WebSocketServer &server);
+
+    void onMessage(WebSocketRouterCallback callback, void *context = NULL);
+
+    // Send payload to every subscriber of topic as one frame. Returns the
+    // number of connections it was queued on.
+    size_t publish(const char *topic, const uint8_t *payload, size_t length,
+                   uint8_t opcode = WS_OPCODE_TEXT);
+    size_t publish(const char *topic, const char *text);
+
+    size_t topics() const { return _topicCount; }
+    size_t subscribers(const char *topic) const;
+
+    // Bytes held for peers, topics, subscriptions and publish frames.
+    const WebSocketMemory &memory() const { return _memory; }
+
+private:
+    struct Topic;
+    struct Peer;
+
+    // One connection subscribed to one topic, linked into both
+    struct Subscription {
+        Topic *topic;
+        Peer *peer;
+        Subscription *prevInTopic;
+        Subscription *nextInTopic;
+        Subscription *nextOfPeer;
+    };
+
+    struct Topic {
+        uint32_t hash;
+        Topic *next;
+        Subscription *subscribers;
+        size_t count;
+        size_t length;
+        char name[1];
+    };
+
+    struct Peer {
+        WebSocketRouter *router;
+        WebSocketServer *server;
+        Subscription *subscriptions;
+        Peer *next;
+    };
+
+    Topic **_buckets;
+    size_t _bucketCount;
+    size_t _topicCount;
+    Peer *_peers;
+    WebSocketMemory _memory;
+
+    WebSocketRouterCallback _messageCallback;
+    void *_messageContext;
+
+    static uint32_t hash(const char *name, size_t length);
+    Topic *find(const char *name, size_t length, uint32_t hash) const;
+    Topic *intern(const char *name, size_t length);
+    void removeTopic(Topic *topic);
+    bool grow();
+
+    bool subscribe(Peer *peer, const char *name, size_t length);
+    bool unsubscribe(Peer *peer, const char *name, size_t length);
+    void drop(Subscription *subscription);
+
+    static void handleText(void *context, const uint8_t *payload, size_t length);
+};
+
+#endif
+
+#endif
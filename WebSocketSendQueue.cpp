@@ -0,0 +1,609 @@
+#include "WebSocketSendQueue.h"
+
+WebSocketSendQueue::WebSocketSendQueue() {
+    _buffer = NULL;
+    _capacity = 0;
+    _memory = NULL;
+    _high = WS_SEND_HIGH_WATER;
+    _low = WS_SEND_LOW_WATER;
+    _fragmentLength = WS_FRAGMENT_LENGTH;
+    _coalesceThreshold = 0;
+    _coalesceWindow = 0;
+    _regionsHead = 0;
+    _regionsCount = 0;
+    clear();
+}
+
+WebSocketSendQueue::~WebSocketSendQueue() {
+    releaseRegions();
+    ws_free(_memory, _buffer, _capacity);
+}
+
+void WebSocketSendQueue::releaseRegions() {
+    while (_regionsCount > 0) {
+        WebSocketRegion &region = _regions[_regionsHead].region;
+
+        if (region.release != NULL) {
+            region.release(region.context, region.data, region.length);
+        }
+        _regionsHead = (_regionsHead + 1) % WS_SEND_QUEUE_REGIONS;
+        _regionsCount--;
+    }
+}
+
+void WebSocketSendQueue::clear() {
+    releaseRegions();
+    _head = 0;
+    _tail = 0;
+    _blocked = false;
+    _drainPending = false;
+    _holding = false;
+    _urgent = false;
+    _reserved = false;
+    _streamRemaining = 0;
+    _offset = 0;
+    _boundsHead = 0;
+    _boundsCount = 0;
+    _atBoundary = true;
+    _controlLength = 0;
+}
+
+void WebSocketSendQueue::setWatermarks(size_t high, size_t low) {
+    _high = high;
+    _low = low < high ? low : high;
+    updateWatermarks();
+}
+
+void WebSocketSendQueue::setCoalescing(size_t threshold, unsigned long windowMicros) {
+    _coalesceThreshold = threshold;
+    _coalesceWindow = windowMicros;
+}
+
+bool WebSocketSendQueue::due() const {
+    if (_coalesceThreshold == 0 || _controlLength > 0 || _regionsCount > 0 || _urgent) {
+        return true;
+    }
+    return size() >= _coalesceThreshold || (unsigned long) (micros() - _heldSince) >= _coalesceWindow;
+}
+
+unsigned long WebSocketSendQueue::holdRemaining() const {
+    if (size() == 0 || due()) {
+        return 0;
+    }
+    return _coalesceWindow - (unsigned long) (micros() - _heldSince);
+}
+
+bool WebSocketSendQueue::drained() {
+    bool drained = _drainPending;
+    _drainPending = false;
+    return drained;
+}
+
+void WebSocketSendQueue::updateWatermarks() {
+    if (!_blocked && size() > _high) {
+        _blocked = true;
+    } else if (_blocked && size() <= _low) {
+        _blocked = false;
+        _drainPending = true;
+    }
+}
+
+bool WebSocketSendQueue::reserve(size_t length) {
+    // Sliding or growing the buffer would move it under the caller
+    _reserved = false;
+
+    if (length > WS_SEND_QUEUE_LENGTH - size()) {
+        return false;
+    }
+    if (_tail + length <= _capacity) {
+        return true;
+    }
+
+    // Slide pending bytes to the front before growing
+    if (_head > 0) {
+        memmove(_buffer, _buffer + _head, size());
+        _tail -= _head;
+        _head = 0;
+        if (_tail + length <= _capacity) {
+            return true;
+        }
+    }
+
+    size_t capacity = _capacity ? _capacity : 256;
+    while (capacity < _tail + length) {
+        capacity *= 2;
+    }
+    if (capacity > WS_SEND_QUEUE_LENGTH) {
+        capacity = WS_SEND_QUEUE_LENGTH;
+    }
+
+    uint8_t *buffer = (uint8_t *) ws_realloc(_memory, _buffer, _capacity, capacity);
+    if (buffer == NULL) {
+        return false;
+    }
+    _buffer = buffer;
+    _capacity = capacity;
+    return true;
+}
+
+size_t WebSocketSendQueue::encodeHeader(uint8_t *out, uint8_t first, uint64_t length, const uint8_t *mask) {
+    size_t n = 0;
+    uint8_t maskBit = mask ? 0x80 : 0x00;
+
+    out[n++] = first;
+    if (length > 0xFFFF) {
+        out[n++] = 127 | maskBit;
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            out[n++] = (uint8_t) (length >> shift);
+        }
+    } else if (length > 125) {
+        out[n++] = 126 | maskBit;
+        out[n++] = (uint8_t) (length >> 8);
+        out[n++] = (uint8_t) (length & 0xFF);
+    } else {
+        out[n++] = (uint8_t) length | maskBit;
+    }
+
+    if (mask) {
+        memcpy(out + n, mask, 4);
+        n += 4;
+    }
+    return n;
+}
+
+void WebSocketSendQueue::markBoundary() {
+    // The coalescing window starts with the first frame held
+    if (!_holding) {
+        _holding = true;
+        _heldSince = micros();
+    }
+    size_t end = _offset + size();
+
+    // Full: forget the boundary whose neighbours are closest together, so
+    // the rest stay spread over the queue instead of running out before
+    // its end. Ties go to the later one, keeping the near ones dense.
+    if (_boundsCount == WS_SEND_QUEUE_FRAMES) {
+        uint8_t drop = 1;
+        size_t narrowest = (size_t) -1;
+
+        for (uint8_t i = 1; i < WS_SEND_QUEUE_FRAMES; ++i) {
+            size_t before = _bounds[(_boundsHead + i - 1) % WS_SEND_QUEUE_FRAMES];
+            size_t after = i + 1 < WS_SEND_QUEUE_FRAMES ? _bounds[(_boundsHead + i + 1) % WS_SEND_QUEUE_FRAMES] : end;
+
+            if (after - before <= narrowest) {
+                narrowest = after - before;
+                drop = i;
+            }
+        }
+        for (uint8_t i = drop; i + 1 < WS_SEND_QUEUE_FRAMES; ++i) {
+            _bounds[(_boundsHead + i) % WS_SEND_QUEUE_FRAMES] = _bounds[(_boundsHead + i + 1) % WS_SEND_QUEUE_FRAMES];
+        }
+        _boundsCount--;
+    }
+    _bounds[(_boundsHead + _boundsCount) % WS_SEND_QUEUE_FRAMES] = end;
+    _boundsCount++;
+}
+
+// Encode a frame at the tail. Room must have been reserved already.
+void WebSocketSendQueue::appendFrame(uint8_t first, const uint8_t *payload, size_t length, bool masked) {
+    uint8_t mask[4];
+
+    if (masked) {
+        mask[0] = random(0, 256);
+        mask[1] = random(0, 256);
+        mask[2] = random(0, 256);
+        mask[3] = random(0, 256);
+    }
+
+    _tail += encodeHeader(_buffer + _tail, first, length, masked ? mask : NULL);
+
+    if (masked) {
+        for (size_t i = 0; i < length; ++i) {
+            _buffer[_tail + i] = payload[i] ^ mask[i & 3];
+        }
+    } else if (length > 0) {
+        memcpy(_buffer + _tail, payload, length);
+    }
+    _tail += length;
+
+    markBoundary();
+}
+
+bool WebSocketSendQueue::pushFrame(uint8_t first, const uint8_t *payload, size_t length, bool masked) {
+    if (first & 0x08) {
+        uint8_t frame[WS_MAX_HEADER_LENGTH + 125];
+        uint8_t mask[4];
+
+        if (length > 125) {
+            return false;
+        }
+        if (masked) {
+            mask[0] = random(0, 256);
+            mask[1] = random(0, 256);
+            mask[2] = random(0, 256);
+            mask[3] = random(0, 256);
+        }
+
+        size_t n = encodeHeader(frame, first, length, masked ? mask : NULL);
+        for (size_t i = 0; i < length; ++i) {
+            frame[n++] = masked ? payload[i] ^ mask[i & 3] : payload[i];
+        }
+        return pushControl(frame, n);
+    }
+
+    if (_streamRemaining > 0 || length > WS_SEND_QUEUE_LENGTH
+        || !reserve(WS_MAX_HEADER_LENGTH + length)) {
+        return false;
+    }
+
+    appendFrame(first, payload, length, masked);
+    updateWatermarks();
+    return true;
+}
+
+bool WebSocketSendQueue::pushMessage(uint8_t opcode, const uint8_t *payload, size_t length, bool masked,
+                                     size_t fragmentLength) {
+    if (fragmentLength == 0 || length <= fragmentLength) {
+        return pushFrame(opcode | 0x80, payload, length, masked);
+    }
+
+    size_t fragments = (length + fragmentLength - 1) / fragmentLength;
+    if (_streamRemaining > 0 || length > WS_SEND_QUEUE_LENGTH
+        || !reserve(fragments * WS_MAX_HEADER_LENGTH + length)) {
+        return false;
+    }
+
+    for (size_t offset = 0; offset < length; offset += fragmentLength) {
+        size_t count = length - offset;
+        uint8_t first = offset == 0 ? opcode : 0x00;   // continuation
+
+        if (count > fragmentLength) {
+            count = fragmentLength;
+        } else {
+            first |= 0x80;
+        }
+        appendFrame(first, payload + offset, count, masked);
+    }
+
+    updateWatermarks();
+    return true;
+}
+
+// The payload goes after room for the shortest header, which is all small
+// messages need. Longer ones are moved up once their length is known.
+uint8_t *WebSocketSendQueue::reserveFrame(size_t maxLength, bool masked) {
+    if (_streamRemaining > 0 || maxLength > WS_SEND_QUEUE_LENGTH
+        || !reserve(WS_MAX_HEADER_LENGTH + maxLength)) {
+        return NULL;
+    }
+
+    _reserved = true;
+    _reservedMasked = masked;
+    _reservedLength = maxLength;
+    return _buffer + _tail + (masked ? 6 : 2);
+}
+
+bool WebSocketSendQueue::commitFrame(uint8_t first, size_t length) {
+    uint8_t header[WS_MAX_HEADER_LENGTH];
+    uint8_t mask[4];
+
+    if (!_reserved || length > _reservedLength) {
+        return false;
+    }
+    _reserved = false;
+
+    if (_reservedMasked) {
+        mask[0] = random(0, 256);
+        mask[1] = random(0, 256);
+        mask[2] = random(0, 256);
+        mask[3] = random(0, 256);
+    }
+
+    size_t slot = _reservedMasked ? 6 : 2;
+    size_t n = encodeHeader(header, first, length, _reservedMasked ? mask : NULL);
+    uint8_t *payload = _buffer + _tail + n;
+
+    if (n > slot) {
+        memmove(payload, _buffer + _tail + slot, length);
+    }
+    memcpy(_buffer + _tail, header, n);
+    if (_reservedMasked) {
+        for (size_t i = 0; i < length; ++i) {
+            payload[i] ^= mask[i & 3];
+        }
+    }
+    _tail += n + length;
+
+    markBoundary();
+    updateWatermarks();
+    return true;
+}
+
+bool WebSocketSendQueue::beginFrame(uint8_t first, uint64_t length, bool masked) {
+    if (_streamRemaining > 0 || !reserve(WS_MAX_HEADER_LENGTH)) {
+        return false;
+    }
+
+    if (masked) {
+        _streamMask[0] = random(0, 256);
+        _streamMask[1] = random(0, 256);
+        _streamMask[2] = random(0, 256);
+        _streamMask[3] = random(0, 256);
+    }
+    _streamMasked = masked;
+    _streamIndex = 0;
+    _streamRemaining = length;
+
+    _tail += encodeHeader(_buffer + _tail, first, length, masked ? _streamMask : NULL);
+    if (length == 0) {
+        markBoundary();
+    }
+
+    updateWatermarks();
+    return true;
+}
+
+bool WebSocketSendQueue::pushPayload(const uint8_t *data, size_t length) {
+    if (length > _streamRemaining || !reserve(length)) {
+        return false;
+    }
+
+    if (_streamMasked) {
+        for (size_t i = 0; i < length; ++i) {
+            _buffer[_tail + i] = data[i] ^ _streamMask[(_streamIndex + i) & 3];
+        }
+    } else if (length > 0) {
+        memcpy(_buffer + _tail, data, length);
+    }
+    _tail += length;
+    _streamIndex += length;
+    _streamRemaining -= length;
+
+    // Only now may a control frame go out after it
+    if (_streamRemaining == 0) {
+        markBoundary();
+    }
+
+    updateWatermarks();
+    return true;
+}
+
+bool WebSocketSendQueue::pushRegion(uint8_t first, const WebSocketRegion &region, bool masked) {
+    bool full = region.length > 0 && _regionsCount == WS_SEND_QUEUE_REGIONS;
+
+    if (_streamRemaining > 0 || full || !reserve(WS_MAX_HEADER_LENGTH)) {
+        return false;
+    }
+
+    // Nothing to send from it: just the header
+    if (region.length == 0) {
+        appendFrame(first, NULL, 0, masked);
+        updateWatermarks();
+        if (region.release != NULL) {
+            region.release(region.context, region.data, region.length);
+        }
+        return true;
+    }
+
+    // Its headers are made as its fragments go out
+    PendingRegion &pending = _regions[(_regionsHead + _regionsCount) % WS_SEND_QUEUE_REGIONS];
+    pending.region = region;
+    pending.at = _offset + size();
+    pending.sent = 0;
+    pending.first = first;
+    pending.masked = masked;
+    pending.headerLength = 0;
+    _regionsCount++;
+    return true;
+}
+
+bool WebSocketSendQueue::push(const uint8_t *data, size_t length) {
+    if (_streamRemaining > 0 || !reserve(length)) {
+        return false;
+    }
+
+    memcpy(_buffer + _tail, data, length);
+    _tail += length;
+    markBoundary();
+
+    updateWatermarks();
+    return true;
+}
+
+bool WebSocketSendQueue::pushControl(const uint8_t *data, size_t length) {
+    if (length > sizeof(_control) - _controlLength) {
+        return false;
+    }
+
+    memcpy(_control + _controlLength, data, length);
+    _controlLength += length;
+    return true;
+}
+
+size_t WebSocketSendQueue::writeControl(Client &client) {
+    size_t written = client.write(_control, _controlLength);
+
+    if (written > 0 && written < _controlLength) {
+        memmove(_control, _control + written, _controlLength - written);
+    }
+    _controlLength -= written;
+    return written;
+}
+
+size_t WebSocketSendQueue::writeData(Client &client, size_t count) {
+    size_t written = client.write(_buffer + _head, count);
+    if (written == 0) {
+        return 0;
+    }
+
+    _head += written;
+    _offset += written;
+
+    // Drop the boundaries we have passed. An empty queue is between frames
+    // unless one is still being streamed in.
+    _atBoundary = _tail == _head && _streamRemaining == 0;
+    while (_boundsCount > 0 && (size_t) (_offset - _bounds[_boundsHead]) < (size_t) -1 / 2) {
+        _atBoundary = _atBoundary || _bounds[_boundsHead] == _offset;
+        _boundsHead = (_boundsHead + 1) % WS_SEND_QUEUE_FRAMES;
+        _boundsCount--;
+    }
+
+    // A region always starts on a frame boundary
+    if (regionHere() != NULL) {
+        _atBoundary = true;
+    }
+    return written;
+}
+
+WebSocketSendQueue::PendingRegion *WebSocketSendQueue::regionHere() {
+    if (_regionsCount == 0 || _regions[_regionsHead].at != _offset) {
+        return NULL;
+    }
+    return &_regions[_regionsHead];
+}
+
+// Encode the header of the region's next fragment.
+void WebSocketSendQueue::startFragment(PendingRegion &pending) {
+    size_t length = pending.region.length - pending.sent;
+    uint8_t first = pending.sent == 0 ? pending.first & 0x0F : 0x00;   // continuation
+    uint8_t mask[4];
+
+    if (_fragmentLength > 0 && length > _fragmentLength) {
+        length = _fragmentLength;
+    } else {
+        first |= pending.first & 0x80;
+    }
+    if (pending.masked) {
+        mask[0] = random(0, 256);
+        mask[1] = random(0, 256);
+        mask[2] = random(0, 256);
+        mask[3] = random(0, 256);
+    }
+
+    // The key ends the header, where writeRegion() finds it
+    pending.headerLength = encodeHeader(pending.header, first, length, pending.masked ? mask : NULL);
+    pending.headerSent = 0;
+    pending.fragmentStart = pending.sent;
+    pending.fragmentEnd = pending.sent + length;
+}
+
+size_t WebSocketSendQueue::writeRegion(Client &client, PendingRegion &pending, size_t &count) {
+    size_t written;
+
+    if (pending.headerLength == 0) {
+        startFragment(pending);
+    }
+    // Inside a frame from the first header byte on
+    _atBoundary = false;
+
+    if (pending.headerSent < pending.headerLength) {
+        count = pending.headerLength - pending.headerSent;
+        written = client.write(pending.header + pending.headerSent, count);
+        pending.headerSent += written;
+        return written;
+    }
+
+    const uint8_t *data = pending.region.data + pending.sent;
+    count = pending.fragmentEnd - pending.sent;
+
+    if (pending.masked) {
+        // Masked a chunk at a time
+        const uint8_t *mask = pending.header + pending.headerLength - 4;
+        uint8_t chunk[WS_REGION_CHUNK];
+
+        if (count > WS_REGION_CHUNK) {
+            count = WS_REGION_CHUNK;
+        }
+        int room = client.availableForWrite();
+        if (room > 0 && (size_t) room < count) {
+            count = room;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            chunk[i] = data[i] ^ mask[(pending.sent - pending.fragmentStart + i) & 3];
+        }
+        written = client.write(chunk, count);
+    } else {
+        int room = client.availableForWrite();
+        if (room > 0 && (size_t) room < count) {
+            count = room;
+        }
+        written = client.write(data, count);
+    }
+
+    pending.sent += written;
+    if (pending.sent < pending.fragmentEnd) {
+        return written;
+    }
+
+    // Between fragments a control frame may go out
+    pending.headerLength = 0;
+    _atBoundary = true;
+
+    if (pending.sent == pending.region.length) {
+        if (pending.region.release != NULL) {
+            pending.region.release(pending.region.context, pending.region.data, pending.region.length);
+        }
+        _regionsHead = (_regionsHead + 1) % WS_SEND_QUEUE_REGIONS;
+        _regionsCount--;
+    }
+    return written;
+}
+
+size_t WebSocketSendQueue::flush(Client &client) {
+    size_t total = 0;
+
+    while (!empty()) {
+        size_t written;
+        size_t count;
+
+        PendingRegion *region = regionHere();
+
+        if (_controlLength > 0 && _atBoundary) {
+            count = _controlLength;
+            written = writeControl(client);
+        } else if (region != NULL) {
+            written = writeRegion(client, *region, count);
+        } else {
+            count = size();
+
+            // Stop at the end of the current frame if a control frame waits
+            if (_controlLength > 0 && _boundsCount > 0) {
+                count = _bounds[_boundsHead] - _offset;
+            }
+
+            // and where the next region goes out
+            if (_regionsCount > 0 && _regions[_regionsHead].at - _offset < count) {
+                count = _regions[_regionsHead].at - _offset;
+            }
+
+            // Don't hand the stack more than it says it can take right now
+            int room = client.availableForWrite();
+            if (room > 0 && (size_t) room < count) {
+                count = room;
+            }
+
+            written = writeData(client, count);
+        }
+
+        total += written;
+        if (written == 0 || written < count) {
+            break;
+        }
+    }
+
+    if (_tail == _head && _regionsCount == 0) {
+        // Rewind, unless a frame is being built at the tail
+        if (!_reserved) {
+            _head = 0;
+            _tail = 0;
+        }
+        _holding = false;
+        _urgent = false;
+    } else {
+        // The socket is full; the rest goes out as soon as it has room
+        _urgent = true;
+    }
+
+    updateWatermarks();
+    return total;
+}
@@ -0,0 +1,264 @@
+/*
+ *  WebSocketSendQueue.h
+ *
+ *  Description:
+ *      Per-connection outbound buffer. Frames are encoded into the queue
+ *      whole and written out with as many Client::write() calls as the
+ *      socket accepts, so a full TCP window never stalls the caller or
+ *      splits a frame. Whatever is left goes out on the next poll().
+ *
+ *      Control frames are kept apart and go out at the next frame
+ *      boundary of the data in flight, so a pong or close never waits
+ *      behind the rest of a large fragmented message (RFC 6455 5.4).
+ *
+ *      A frame too large to hold can be streamed in: its header first,
+ *      then the payload chunk by chunk as the socket drains. Payloads that
+ *      already sit in memory, such as a mapped file or flash partition,
+ *      aren't copied in at all; they are written out from where they are.
+ *
+ *      With coalescing on, small frames are held back until enough bytes
+ *      or enough time has gathered, so a stream of short messages goes
+ *      out in a few large writes instead of one segment per message.
+ */
+
+#ifndef WEBSOCKETSENDQUEUE_H_
+#define WEBSOCKETSENDQUEUE_H_
+
+#include <Arduino.h>
+#include "Client.h"
+#include "WebSocketMemory.h"
+
+// Most bytes a connection may have queued. Frames that would push the queue
+// past it are refused with WS_SEND_OVERFLOW. The default holds a whole
+// 64 KB message, the largest the library ever sent, with its fragment
+// headers; the buffer only grows that far when such a message is sent.
+#ifndef WS_SEND_QUEUE_LENGTH
+#define WS_SEND_QUEUE_LENGTH 0x11000
+#endif
+
+// Default watermarks. sendData() reports WS_SEND_WOULD_BLOCK from the moment
+// the queue grows past the high mark until it drains below the low one.
+#ifndef WS_SEND_HIGH_WATER
+#define WS_SEND_HIGH_WATER 8192
+#endif
+#ifndef WS_SEND_LOW_WATER
+#define WS_SEND_LOW_WATER 2048
+#endif
+
+enum WebSocketSendStatus {
+    WS_SEND_QUEUED,         // accepted
+    WS_SEND_WOULD_BLOCK,    // accepted, but the producer should back off
+    WS_SEND_OVERFLOW,       // did not fit, nothing was queued
+    WS_SEND_CLOSED          // not connected
+};
+
+// Room for queued control frames, which don't count against the watermarks.
+// Two full size control frames fit.
+#ifndef WS_CONTROL_QUEUE_LENGTH
+#define WS_CONTROL_QUEUE_LENGTH 264
+#endif
+
+// Messages longer than this are sent as fragments of this size, giving
+// control frames a chance to go out in between. 0 disables fragmenting.
+#ifndef WS_FRAGMENT_LENGTH
+#define WS_FRAGMENT_LENGTH 4096
+#endif
+
+// Frame boundaries remembered for control frame preemption, at least 2. When
+// more frames are queued the closest together are forgotten, so a control
+// frame may wait for a few more frames, but never for the rest of the queue.
+#ifndef WS_SEND_QUEUE_FRAMES
+#define WS_SEND_QUEUE_FRAMES 32
+#endif
+
+// Longest frame header: opcode, length byte, 64-bit length and mask key.
+#define WS_MAX_HEADER_LENGTH 14
+
+// beginMessage() length of a message whose size isn't known up front.
+#define WS_LENGTH_UNKNOWN ((uint64_t) -1)
+
+// Payloads sent from where they are (sendRegion()) that may be queued at
+// once.
+#ifndef WS_SEND_QUEUE_REGIONS
+#define WS_SEND_QUEUE_REGIONS 4
+#endif
+
+// Bytes masked per write when a client sends a region.
+#ifndef WS_REGION_CHUNK
+#define WS_REGION_CHUNK 512
+#endif
+
+// Called once a region has been written out, or dropped, so its memory can
+// be unmapped or freed.
+typedef void (*WebSocketRegionRelease)(void *context, const uint8_t *data, size_t length);
+
+struct WebSocketRegion {
+    const uint8_t *data;
+    size_t length;
+    WebSocketRegionRelease release;     // may be NULL
+    void *context;
+};
+
+class WebSocketSendQueue {
+public:
+    WebSocketSendQueue();
+    ~WebSocketSendQueue();
+
+    // Encode a frame. first is the opcode byte including WS_FIN. Clients
+    // must set masked. Returns false, queueing nothing, if it doesn't fit.
+    // Control frames go to the control queue.
+    bool pushFrame(uint8_t first, const uint8_t *payload, size_t length, bool masked);
+
+    // Encode a data message, split into fragments of at most fragmentLength
+    // bytes (0 for a single frame). Either every fragment is queued or none.
+    bool pushMessage(uint8_t opcode, const uint8_t *payload, size_t length, bool masked,
+                     size_t fragmentLength);
+
+    // Build a data frame in place. Returns room for up to maxLength payload
+    // bytes inside the queue, or NULL if that much doesn't fit. Nothing is
+    // queued until commitFrame(); any other push abandons the reservation.
+    uint8_t *reserveFrame(size_t maxLength, bool masked);
+
+    // Queue the frame whose first length payload bytes were written where
+    // reserveFrame() pointed, filling in (and masking) around them.
+    bool commitFrame(uint8_t first, size_t length);
+
+    // Stream a frame whose payload doesn't fit in the queue at once:
+    // beginFrame() queues the header for length payload bytes, pushPayload()
+    // appends them as they come. Until the last byte is in, other data is
+    // refused and control frames wait.
+    bool beginFrame(uint8_t first, uint64_t length, bool masked);
+    bool pushPayload(const uint8_t *data, size_t length);
+
+    // Queue a frame whose payload stays in the caller's memory and is
+    // written straight from there once the data ahead of it has gone, as
+    // fragments of setFragmentLength() bytes so control frames can go out
+    // in between. Their headers are generated as they are written.
+    // region.release runs when it has, or when the queue is cleared.
+    // Returns false, leaving the region with the caller, if it doesn't fit.
+    bool pushRegion(uint8_t first, const WebSocketRegion &region, bool masked);
+
+    // Payload bytes the streamed frame still needs; 0 when none is open.
+    uint64_t pending() const { return _streamRemaining; }
+
+    // Queue bytes that are already framed.
+    bool push(const uint8_t *data, size_t length);
+    bool pushControl(const uint8_t *data, size_t length);
+
+    // Write as much as the client takes without blocking. Returns the number
+    // of bytes written.
+    size_t flush(Client &client);
+
+    // Queued data bytes; control frames are not counted.
+    size_t size() const { return _tail - _head; }
+    bool empty() const { return _tail == _head && _controlLength == 0 && _regionsCount == 0; }
+    void clear();
+
+    // Grow the empty buffer to length bytes now rather than on the first
+    // sends. clear() keeps it.
+    bool preallocate(size_t length) { return reserve(length); }
+
+    void setWatermarks(size_t high, size_t low);
+
+    // Fragment size for regions, WS_FRAGMENT_LENGTH by default; 0 sends
+    // each one as a single frame.
+    void setFragmentLength(size_t length) { _fragmentLength = length; }
+
+    // Charge the queue's buffer to memory.
+    void setMemory(WebSocketMemory *memory) { _memory = memory; }
+
+    // Hold data until at least threshold bytes are queued or the oldest
+    // byte has waited windowMicros. A threshold of 0 turns it off.
+    void setCoalescing(size_t threshold, unsigned long windowMicros);
+
+    // Whether flushing now is worthwhile: coalescing is off, the threshold
+    // or deadline was reached, a control frame waits, or an earlier write
+    // was cut short.
+    bool due() const;
+
+    // Microseconds until held data becomes due; 0 when nothing is held.
+    unsigned long holdRemaining() const;
+
+    // Above the high-water mark and not yet drained below the low one.
+    bool blocked() const { return _blocked; }
+
+    // True once after a blocked queue drained below the low-water mark.
+    bool drained();
+
+    // Encode a frame header into out, returning its length. The mask key is
+    // written when mask is not NULL.
+    static size_t encodeHeader(uint8_t *out, uint8_t first, uint64_t length, const uint8_t *mask);
+
+private:
+    uint8_t *_buffer;
+    size_t _capacity;
+    WebSocketMemory *_memory;
+    size_t _head;
+    size_t _tail;
+    size_t _high;
+    size_t _low;
+    bool _blocked;
+    bool _drainPending;
+    size_t _fragmentLength;
+
+    // Frame being built in place by reserveFrame()
+    bool _reserved;
+    bool _reservedMasked;
+    size_t _reservedLength;
+
+    // Frame being streamed in by beginFrame()
+    uint64_t _streamRemaining;
+    bool _streamMasked;
+    uint8_t _streamMask[4];
+    size_t _streamIndex;
+
+    // Regions in the order they go out, each at a stream offset of _head
+    struct PendingRegion {
+        WebSocketRegion region;
+        size_t at;
+        size_t sent;
+        uint8_t first;
+        bool masked;
+        // Fragment on the wire: its header, and where its payload ends.
+        // headerLength is 0 between fragments.
+        uint8_t header[WS_MAX_HEADER_LENGTH];
+        uint8_t headerLength;
+        uint8_t headerSent;
+        size_t fragmentStart;
+        size_t fragmentEnd;
+    };
+    PendingRegion _regions[WS_SEND_QUEUE_REGIONS];
+    uint8_t _regionsHead;
+    uint8_t _regionsCount;
+
+    size_t _coalesceThreshold;
+    unsigned long _coalesceWindow;
+    unsigned long _heldSince;
+    bool _holding;
+    bool _urgent;
+
+    // Stream offset of _head, and of the end of each queued frame
+    size_t _offset;
+    size_t _bounds[WS_SEND_QUEUE_FRAMES];
+    uint8_t _boundsHead;
+    uint8_t _boundsCount;
+    bool _atBoundary;
+
+    uint8_t _control[WS_CONTROL_QUEUE_LENGTH];
+    size_t _controlLength;
+
+    // Make room for length more bytes at the tail.
+    bool reserve(size_t length);
+    void appendFrame(uint8_t first, const uint8_t *payload, size_t length, bool masked);
+    void markBoundary();
+    size_t writeControl(Client &client);
+    size_t writeData(Client &client, size_t count);
+    size_t writeRegion(Client &client, PendingRegion &pending, size_t &count);
+    void startFragment(PendingRegion &pending);
+    // The region due at the current offset, or NULL.
+    PendingRegion *regionHere();
+    void releaseRegions();
+    void updateWatermarks();
+};
+
+#endif
@@ -0,0 +1,699 @@
+//#define DEBUGGING
+
+#include "WebSocketSender.h"
+
+#if CALLBACK_FUNCTIONS
+// reserveFrame() space of a thread that sends on a connection it doesn't
+// own. Each thread has its own, so a reservation holds nothing until it is
+// committed; sender is the connection it was last handed out for.
+struct WebSocketScratch {
+    uint8_t *data;
+    size_t capacity;
+    const WebSocketSender *sender;
+
+    ~WebSocketScratch() { ws_free(NULL, data, capacity); }
+};
+
+static thread_local WebSocketScratch scratch;
+#endif
+
+WebSocketSender::WebSocketSender(Connection &connection, WebSocketSendQueue &queue, WebSocketMemory &memory,
+                                 bool masked)
+    : _connection(connection), _queue(queue), _memory(memory), _masked(masked) {
+#if CALLBACK_FUNCTIONS
+    _io = NULL;
+    _streamThread.store(WebSocketIoTask::ThreadId(), std::memory_order_relaxed);
+    _ownOpen = false;
+    _ringOpen = false;
+    _held = NULL;
+    _heldTail = NULL;
+    _heldPieces = 0;
+#else
+    _claimed = false;
+#endif
+    _streaming = false;
+    _building = false;
+    _streamFragmented = false;
+    _streamOpcode = 0;
+    _streamRemaining = 0;
+}
+
+WebSocketSender::~WebSocketSender() {
+#if CALLBACK_FUNCTIONS
+    dropHeld();
+#endif
+}
+
+void WebSocketSender::reset() {
+#if CALLBACK_FUNCTIONS
+    dropHeld();
+    _ownOpen = false;
+    _ringOpen = false;
+
+    // Another thread's message ends here too: the connection is free for
+    // the next one, and the pieces still to come find nothing open
+    if (!ownsStream()) {
+        _streamThread.store(WebSocketIoTask::ThreadId(), std::memory_order_release);
+        return;
+    }
+#endif
+    releaseStream();
+}
+
+bool WebSocketSender::offThread() const {
+#if CALLBACK_FUNCTIONS
+    return _io != NULL && _io->offThread();
+#else
+    return false;
+#endif
+}
+
+bool WebSocketSender::ownsStream() const {
+#if CALLBACK_FUNCTIONS
+    return _streamThread.load(std::memory_order_acquire) == WebSocketIoTask::currentThread();
+#else
+    return _claimed;
+#endif
+}
+
+bool WebSocketSender::canClaim() const {
+#if CALLBACK_FUNCTIONS
+    // The owner writes straight into the queue, so it waits for whatever
+    // is partly there or held back for it
+    if (!offThread() && (_ringOpen || _held != NULL)) {
+        return false;
+    }
+    return _streamThread.load(std::memory_order_acquire) == WebSocketIoTask::ThreadId();
+#else
+    return !_claimed;
+#endif
+}
+
+bool WebSocketSender::claimStream() {
+#if CALLBACK_FUNCTIONS
+    WebSocketIoTask::ThreadId none = WebSocketIoTask::ThreadId();
+    bool owner = !offThread();
+
+    if (owner && !canClaim()) {
+        return false;
+    }
+    if (!_streamThread.compare_exchange_strong(none, WebSocketIoTask::currentThread(),
+                                               std::memory_order_acquire)) {
+        return false;
+    }
+    _ownOpen = owner;
+#else
+    _claimed = true;
+#endif
+    _streaming = false;
+    _building = false;
+    return true;
+}
+
+void WebSocketSender::releaseStream() {
+    _streaming = false;
+    _building = false;
+#if CALLBACK_FUNCTIONS
+    // _ownOpen is the owner's to read
+    bool owner = !offThread() && _ownOpen;
+
+    _streamThread.store(WebSocketIoTask::ThreadId(), std::memory_order_release);
+    if (owner) {
+        _ownOpen = false;
+        releaseHeld();
+    }
+#else
+    _claimed = false;
+#endif
+}
+
+WebSocketSendStatus WebSocketSender::queued() const {
+    return _queue.blocked() ? WS_SEND_WOULD_BLOCK : WS_SEND_QUEUED;
+}
+
+WebSocketSendStatus WebSocketSender::handedOver() const {
+#if CALLBACK_FUNCTIONS
+    return _io->blocked() ? WS_SEND_WOULD_BLOCK : WS_SEND_QUEUED;
+#else
+    return WS_SEND_QUEUED;
+#endif
+}
+
+uint8_t *WebSocketSender::reserveFrame(size_t maxLength) {
+    // A message built frame by frame holds the connection from its first
+    // fragment to its final frame. A reservation alone holds nothing:
+    // anything the owner queues before the commit replaces it.
+    if (ownsStream()) {
+        if (_streaming) {
+            return NULL;
+        }
+    } else if (!canClaim()) {
+        return NULL;
+    }
+
+#if CALLBACK_FUNCTIONS
+    // The queue belongs to another thread; build the message aside instead,
+    // in this thread's space, valid until its next reservation
+    if (offThread()) {
+        if (maxLength > scratch.capacity) {
+            uint8_t *data = (uint8_t *) ws_realloc(NULL, scratch.data, scratch.capacity, maxLength);
+            if (data == NULL) {
+                return NULL;
+            }
+            scratch.data = data;
+            scratch.capacity = maxLength;
+        }
+        scratch.sender = this;
+        return scratch.data;
+    }
+#endif
+    return _connection.sendable() ? _queue.reserveFrame(maxLength, _masked) : NULL;
+}
+
+WebSocketSendStatus WebSocketSender::commitFrame(uint8_t opcode, size_t length, bool final) {
+    WebSocketSendStatus status;
+    bool open = ownsStream();
+
+    if (open ? _streaming : (!offThread() && !canClaim())) {
+        return WS_SEND_OVERFLOW;
+    }
+    // The rest of a message that reset() dropped
+    if (!open && (opcode & 0x0F) == WS_OPCODE_CONTINUATION) {
+        return WS_SEND_OVERFLOW;
+    }
+
+#if CALLBACK_FUNCTIONS
+    if (offThread()) {
+        // A whole message goes through the ring like sendData(); the first
+        // fragment opens the message, the final frame ends it
+        uint8_t flags = !final ? WS_IO_CONTINUES : open ? WS_IO_LAST : 0;
+
+        if (scratch.sender != this || length > scratch.capacity) {
+            return WS_SEND_OVERFLOW;
+        }
+        if (!open && !final && !claimStream()) {
+            return WS_SEND_OVERFLOW;
+        }
+        if (!_io->send((opcode & 0x0F) | flags, scratch.data, length)) {
+            if (!open && !final) {
+                releaseStream();
+            }
+            return WS_SEND_OVERFLOW;
+        }
+        scratch.sender = NULL;
+        status = handedOver();
+    } else
+#endif
+    {
+        if (!_connection.sendable()) {
+            if (open) {
+                releaseStream();
+            }
+            return WS_SEND_CLOSED;
+        }
+        // The first fragment opens the message
+        if (!open && !final && !claimStream()) {
+            return WS_SEND_OVERFLOW;
+        }
+        if (!_queue.commitFrame((final ? WS_FIN : 0) | (opcode & 0x0F), length)) {
+            if (!open && !final) {
+                releaseStream();
+            }
+            return WS_SEND_OVERFLOW;
+        }
+        _connection.flushQueue();
+        status = queued();
+    }
+
+    if (!final) {
+        _building = true;
+    } else if (open) {
+        releaseStream();
+    }
+    return status;
+}
+
+WebSocketSendStatus WebSocketSender::queueFragment(uint8_t opcode, const uint8_t *data, size_t length) {
+    if (!_queue.pushFrame(opcode & 0x0F, data, length, _masked)) {
+        return WS_SEND_OVERFLOW;
+    }
+
+    _connection.flushQueue();
+    return queued();
+}
+
+WebSocketSendStatus WebSocketSender::queueFinal(uint8_t opcode, const uint8_t *data, size_t length) {
+    if (!_queue.pushFrame(WS_FIN | (opcode & 0x0F), data, length, _masked)) {
+        return WS_SEND_OVERFLOW;
+    }
+
+    _connection.flushQueue();
+    return queued();
+}
+
+WebSocketSendStatus WebSocketSender::queueFrameStart(uint8_t first, uint64_t length) {
+    if (!_queue.beginFrame(first, length, _masked)) {
+        return WS_SEND_OVERFLOW;
+    }
+
+    _connection.flushQueue();
+    return queued();
+}
+
+WebSocketSendStatus WebSocketSender::queuePayload(const uint8_t *data, size_t length) {
+    if (!_queue.pushPayload(data, length)) {
+        return WS_SEND_OVERFLOW;
+    }
+
+    _connection.flushQueue();
+    return queued();
+}
+
+WebSocketSendStatus WebSocketSender::queueRegion(uint8_t first, const WebSocketRegion &region) {
+    if (!_queue.pushRegion(first, region, _masked)) {
+        return WS_SEND_OVERFLOW;
+    }
+
+    _connection.flushQueue();
+    return queued();
+}
+
+WebSocketSendStatus WebSocketSender::sendRegion(const uint8_t *data, size_t length, uint8_t opcode,
+                                             WebSocketRegionRelease release, void *context) {
+    WebSocketRegion region = { data, length, release, context };
+    uint8_t first = WS_FIN | (opcode & 0x0F);
+#if CALLBACK_FUNCTIONS
+    WebSocketSendStatus status;
+    uint8_t request[1 + sizeof(region)];
+
+    request[0] = first;
+    memcpy(request + 1, &region, sizeof(region));
+    if (offThread()) {
+        if (!_io->send(WS_IO_REGION, request, sizeof(request))) {
+            return WS_SEND_OVERFLOW;
+        }
+        return handedOver();
+    }
+#endif
+    if (!_connection.sendable()) {
+        return WS_SEND_CLOSED;
+    }
+#if CALLBACK_FUNCTIONS
+    if (hold(WS_IO_REGION, request, sizeof(request), status)) {
+        return status;
+    }
+#endif
+    return queueRegion(first, region);
+}
+
+WebSocketSendStatus WebSocketSender::sendMapped(const WebSocketRegion &region, uint8_t opcode) {
+    WebSocketSendStatus status = sendRegion(region.data, region.length, opcode, region.release, region.context);
+
+    if (status == WS_SEND_OVERFLOW || status == WS_SEND_CLOSED) {
+        wsReleaseRegion(region);
+    }
+    return status;
+}
+
+#if defined(__linux__)
+WebSocketSendStatus WebSocketSender::sendFile(const char *path, uint8_t opcode) {
+    WebSocketRegion region;
+
+    if (!wsMapFile(path, region)) {
+        return WS_SEND_OVERFLOW;
+    }
+    return sendMapped(region, opcode);
+}
+#endif
+
+#if defined(ESP32)
+WebSocketSendStatus WebSocketSender::sendPartition(const esp_partition_t *partition, size_t offset, size_t length,
+                                                uint8_t opcode) {
+    WebSocketRegion region;
+
+    if (!wsMapPartition(partition, offset, length, region)) {
+        return WS_SEND_OVERFLOW;
+    }
+    return sendMapped(region, opcode);
+}
+#endif
+
+WebSocketSendStatus WebSocketSender::beginMessage(uint8_t opcode, uint64_t length) {
+    // One message at a time per connection, whichever thread sends it
+    if (ownsStream() || !claimStream()) {
+        return WS_SEND_OVERFLOW;
+    }
+
+    _streamOpcode = opcode & 0x0F;
+    _streamRemaining = length;
+    _streamFragmented = false;
+
+    // Fragments go out with each write()
+    if (length == WS_LENGTH_UNKNOWN) {
+        _streaming = true;
+        return WS_SEND_QUEUED;
+    }
+
+    WebSocketSendStatus status;
+    uint8_t first = WS_FIN | _streamOpcode;
+#if CALLBACK_FUNCTIONS
+    if (offThread()) {
+        uint8_t header[9];
+
+        header[0] = first;
+        for (int i = 0; i < 8; ++i) {
+            header[1 + i] = (uint8_t) (length >> (56 - 8 * i));
+        }
+        if (!_io->send(WS_IO_FRAME_START, header, sizeof(header))) {
+            releaseStream();
+            return WS_SEND_OVERFLOW;
+        }
+        _streaming = true;
+        return handedOver();
+    }
+#endif
+    if (!_connection.sendable()) {
+        releaseStream();
+        return WS_SEND_CLOSED;
+    }
+    status = queueFrameStart(first, length);
+    if (status == WS_SEND_OVERFLOW) {
+        releaseStream();
+    } else {
+        _streaming = true;
+    }
+    return status;
+}
+
+WebSocketSendStatus WebSocketSender::sendChunk(const uint8_t *data, size_t length, bool known) {
+    uint8_t opcode = _streamFragmented ? WS_OPCODE_CONTINUATION : _streamOpcode;
+#if CALLBACK_FUNCTIONS
+    if (offThread()) {
+        if (!_io->send(known ? WS_IO_PAYLOAD : opcode | WS_IO_CONTINUES, data, length)) {
+            return WS_SEND_OVERFLOW;
+        }
+        return handedOver();
+    }
+#endif
+    if (!_connection.sendable()) {
+        return WS_SEND_CLOSED;
+    }
+    return known ? queuePayload(data, length) : queueFragment(opcode, data, length);
+}
+
+WebSocketSendStatus WebSocketSender::write(const uint8_t *data, size_t length) {
+    WebSocketSendStatus status;
+    bool known;
+
+    if (!ownsStream() || !_streaming) {
+        return WS_SEND_OVERFLOW;
+    }
+    known = _streamRemaining != WS_LENGTH_UNKNOWN;
+    if (known && length > _streamRemaining) {
+        return WS_SEND_OVERFLOW;
+    }
+    if (length == 0) {
+        return WS_SEND_QUEUED;
+    }
+
+    status = sendChunk(data, length, known);
+    if (status == WS_SEND_OVERFLOW || status == WS_SEND_CLOSED) {
+        return status;
+    }
+    if (known) {
+        _streamRemaining -= length;
+    } else {
+        _streamFragmented = true;
+    }
+    return status;
+}
+
+WebSocketSendStatus WebSocketSender::endMessage() {
+    WebSocketSendStatus status;
+
+    if (!ownsStream() || !_streaming) {
+        return WS_SEND_OVERFLOW;
+    }
+
+    if (_streamRemaining != WS_LENGTH_UNKNOWN && _streamRemaining > 0) {
+        // The peer would wait forever for the rest of the frame
+#ifdef DEBUGGING
+        Serial.println(F("Streamed message ended short, disconnecting"));
+#endif
+        _connection.disconnectStream();
+        releaseStream();
+        return WS_SEND_CLOSED;
+    }
+
+    // The last piece tells the owner that the connection is free again; a
+    // known length frame is complete already and only needs that
+#if CALLBACK_FUNCTIONS
+    if (offThread()) {
+        bool sent;
+
+        if (_streamRemaining == WS_LENGTH_UNKNOWN) {
+            // An empty final fragment, or the whole message if nothing was written
+            sent = _io->send((_streamFragmented ? WS_OPCODE_CONTINUATION : _streamOpcode) | WS_IO_LAST, NULL, 0);
+        } else {
+            sent = _io->send(WS_IO_PAYLOAD | WS_IO_LAST, NULL, 0);
+        }
+        if (!sent) {
+            return WS_SEND_OVERFLOW;
+        }
+        status = handedOver();
+    } else
+#endif
+    if (_streamRemaining == WS_LENGTH_UNKNOWN) {
+        if (!_connection.sendable()) {
+            releaseStream();
+            return WS_SEND_CLOSED;
+        }
+        status = queueFinal(_streamFragmented ? WS_OPCODE_CONTINUATION : _streamOpcode, NULL, 0);
+        if (status == WS_SEND_OVERFLOW) {
+            return status;
+        }
+    } else {
+        status = queued();
+    }
+
+    releaseStream();
+    return status;
+}
+
+#if CALLBACK_FUNCTIONS
+bool WebSocketSender::queueOutgoing(WebSocketMessage *message) {
+    uint8_t opcode = message->opcode & ~WS_IO_LAST;
+    bool last = message->opcode & WS_IO_LAST;
+
+    if (opcode == WS_IO_FRAME_START) {
+        _ringOpen = true;
+        ioFrameStart(message->data());
+    } else if (opcode == WS_IO_PAYLOAD) {
+        // Pieces of a message begun before a reconnect have no frame to go into
+        if (_ringOpen) {
+            ioPayload(message->data(), message->length);
+        }
+    } else if (opcode == WS_IO_REGION) {
+        ioRegion(message->data());
+    } else if (message->opcode & (WS_IO_CONTINUES | WS_IO_LAST)) {
+        if ((opcode & 0x0F) == WS_OPCODE_CONTINUATION && !_ringOpen) {
+            // As above
+        } else if (opcode & WS_IO_CONTINUES) {
+            _ringOpen = true;
+            ioFragment(opcode, message->data(), message->length);
+        } else {
+            ioFinal(opcode, message->data(), message->length);
+        }
+    } else {
+        return false;
+    }
+
+    if (last) {
+        _ringOpen = false;
+        releaseHeld();
+    }
+    return true;
+}
+
+// Part of a message is already on the wire, so a piece that can't be
+// queued even after flushing would garble it; drop the connection instead.
+void WebSocketSender::ioFrameStart(const uint8_t *header) {
+    uint64_t length = 0;
+
+    for (int i = 0; i < 8; ++i) {
+        length = (length << 8) | header[1 + i];
+    }
+    if (queueFrameStart(header[0], length) == WS_SEND_OVERFLOW) {
+        _connection.flushQueue(true);
+        if (queueFrameStart(header[0], length) == WS_SEND_OVERFLOW) {
+            _connection.disconnectStream();
+        }
+    }
+}
+
+void WebSocketSender::ioPayload(const uint8_t *data, size_t length) {
+    if (queuePayload(data, length) == WS_SEND_OVERFLOW) {
+        _connection.flushQueue(true);
+        if (queuePayload(data, length) == WS_SEND_OVERFLOW) {
+            _connection.disconnectStream();
+        }
+    }
+}
+
+void WebSocketSender::ioFragment(uint8_t opcode, const uint8_t *data, size_t length) {
+    if (queueFragment(opcode, data, length) == WS_SEND_OVERFLOW) {
+        _connection.flushQueue(true);
+        if (queueFragment(opcode, data, length) == WS_SEND_OVERFLOW) {
+            _connection.disconnectStream();
+        }
+    }
+}
+
+void WebSocketSender::ioFinal(uint8_t opcode, const uint8_t *data, size_t length) {
+    if (queueFinal(opcode, data, length) == WS_SEND_OVERFLOW) {
+        _connection.flushQueue(true);
+        if (queueFinal(opcode, data, length) == WS_SEND_OVERFLOW) {
+            _connection.disconnectStream();
+        }
+    }
+}
+
+void WebSocketSender::ioRegion(const uint8_t *request) {
+    WebSocketRegion region;
+
+    memcpy(&region, request + 1, sizeof(region));
+    if (queueRegion(request[0], region) == WS_SEND_OVERFLOW) {
+        _connection.flushQueue(true);
+        if (queueRegion(request[0], region) == WS_SEND_OVERFLOW) {
+            // Nothing of it was sent; the application has already let go
+#ifdef DEBUGGING
+            Serial.println(F("No room for region, dropped"));
+#endif
+            wsReleaseRegion(region);
+        }
+    }
+}
+
+// A streamed piece, fragment or frame of a message built frame by frame.
+static bool isPiece(uint8_t opcode) {
+    uint8_t base = opcode & ~WS_IO_LAST;
+
+    return base == WS_IO_FRAME_START || base == WS_IO_PAYLOAD
+           || (!(opcode & 0x20) && (opcode & (WS_IO_CONTINUES | WS_IO_LAST)));
+}
+
+// While the owner streams, everything but control frames waits, pieces
+// of another thread's message included; so does what comes through the
+// ring while the queue is over its high-water mark, which could not take
+// it. While another thread's message is partly queued its pieces go on,
+// and only whole data messages wait; once one waits, the ones after it do
+// too, to keep their order.
+bool WebSocketSender::holds(uint8_t opcode, const uint8_t *data, size_t length, bool ring) const {
+    bool piece = isPiece(opcode);
+    bool whole;
+
+    if (opcode == WS_IO_RAW_FRAME) {
+        whole = length > 0 && !(data[0] & 0x08);
+    } else {
+        whole = opcode == WS_IO_REGION || (!piece && !(opcode & 0x20) && !(opcode & 0x08));
+    }
+
+    if (_ownOpen || (ring && _queue.blocked())) {
+        return piece || whole;
+    }
+    if (piece) {
+        return _heldPieces > 0;
+    }
+    return whole && (_ringOpen || _held != NULL);
+}
+
+void WebSocketSender::append(WebSocketMessage *message) {
+    message->next = NULL;
+    if (_heldTail != NULL) {
+        _heldTail->next = message;
+    } else {
+        _held = message;
+    }
+    _heldTail = message;
+    if (isPiece(message->opcode)) {
+        ++_heldPieces;
+    }
+}
+
+bool WebSocketSender::hold(WebSocketMessage *message) {
+    if (!holds(message->opcode, message->data(), message->length, true)) {
+        return false;
+    }
+    append(message);
+    return true;
+}
+
+bool WebSocketSender::hold(uint8_t opcode, const uint8_t *data, size_t length, WebSocketSendStatus &status) {
+    WebSocketMessage *message;
+
+    if (!holds(opcode, data, length, false)) {
+        return false;
+    }
+    // The owner's own message is still open: nothing else until it ends
+    if (_ownOpen) {
+        status = WS_SEND_OVERFLOW;
+        return true;
+    }
+    message = WebSocketMessage::create(opcode, data, length, &_memory);
+    if (message == NULL) {
+        status = WS_SEND_OVERFLOW;
+    } else {
+        append(message);
+        status = queued();
+    }
+    return true;
+}
+
+void WebSocketSender::releaseHeld() {
+    WebSocketMessage *message = _held;
+
+    if (_ownOpen) {
+        return;
+    }
+
+    // Taken as a whole; whatever has to wait again goes back in order
+    _held = NULL;
+    _heldTail = NULL;
+    _heldPieces = 0;
+    while (message != NULL) {
+        WebSocketMessage *next = message->next;
+
+        if (_queue.blocked()) {
+            // The rest waits for the socket to catch up, or it would overflow
+            while (message != NULL) {
+                next = message->next;
+                append(message);
+                message = next;
+            }
+            break;
+        }
+        if (!hold(message)) {
+            _connection.sendMessage(message);
+            WebSocketMessage::destroy(message);
+        }
+        message = next;
+    }
+}
+
+void WebSocketSender::dropHeld() {
+    while (_held != NULL) {
+        WebSocketMessage *message = _held;
+
+        _held = message->next;
+        if (message->opcode == WS_IO_REGION) {
+            WebSocketRegion region;
+
+            memcpy(&region, message->data() + 1, sizeof(region));
+            wsReleaseRegion(region);
+        }
+        WebSocketMessage::destroy(message);
+    }
+    _heldTail = NULL;
+    _heldPieces = 0;
+}
+#endif
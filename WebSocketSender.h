@@ -0,0 +1,186 @@
+/*
+ *  WebSocketSender.h
+ *
+ *  Description:
+ *      The part of sending that is the same for WebSocketServer and
+ *      WebSocketClient apart from masking: streamed messages
+ *      (beginMessage()/write()/endMessage()), frames encoded in place
+ *      (reserveFrame()/commitFrame()) and regions sent from where they
+ *      lie (sendRegion() and friends). On the thread that owns the
+ *      connection the pieces go into its WebSocketSendQueue; from any
+ *      other thread they travel through the I/O task's outgoing ring and
+ *      queueOutgoing() puts them in the queue on the owner's side.
+ *
+ *      A message sent in pieces holds the connection for the thread that
+ *      started it until its last piece: no other thread can start one,
+ *      and whole data messages, from the ring or the owner, are held back
+ *      on the owner's side and sent after it, so none lands between its
+ *      frames (RFC 6455 section 5.4). Control frames still go through.
+ */
+
+#ifndef WEBSOCKETSENDER_H_
+#define WEBSOCKETSENDER_H_
+
+#include <Arduino.h>
+#include "WebSocketFrame.h"
+#include "WebSocketSendQueue.h"
+#include "WebSocketRegion.h"
+#include "WebSocketIoTask.h"
+#include "WebSocketMemory.h"
+
+#ifndef CALLBACK_FUNCTIONS
+#define CALLBACK_FUNCTIONS 1
+#endif
+
+class WebSocketSender {
+public:
+    // What the sender needs from the server or client it belongs to.
+    class Connection {
+    public:
+        // The socket is there and still connected.
+        virtual bool sendable() = 0;
+        // Write out queued data, see WebSocketServer::flushQueue().
+        virtual size_t flushQueue(bool force = false) = 0;
+        virtual void disconnectStream() = 0;
+#if CALLBACK_FUNCTIONS
+        // Queue a message another thread sent, as sendOutgoing() does.
+        virtual void sendMessage(WebSocketMessage *message) = 0;
+#endif
+
+    protected:
+        ~Connection() {}
+    };
+
+    // masked is true for a client, whose frames are always masked.
+    WebSocketSender(Connection &connection, WebSocketSendQueue &queue, WebSocketMemory &memory, bool masked);
+    ~WebSocketSender();
+
+#if CALLBACK_FUNCTIONS
+    void setIoTask(WebSocketIoTask *io) { _io = io; }
+#endif
+
+    // Forget a half streamed message, whichever thread sends it, and what
+    // was held back for it, e.g. for a new connection. Owner side.
+    void reset();
+
+    uint8_t *reserveFrame(size_t maxLength);
+    WebSocketSendStatus commitFrame(uint8_t opcode, size_t length, bool final);
+
+    WebSocketSendStatus beginMessage(uint8_t opcode, uint64_t length);
+    WebSocketSendStatus write(const uint8_t *data, size_t length);
+    WebSocketSendStatus endMessage();
+
+    WebSocketSendStatus sendRegion(const uint8_t *data, size_t length, uint8_t opcode,
+                                   WebSocketRegionRelease release, void *context);
+    // sendRegion(), releasing the region when it wasn't taken.
+    WebSocketSendStatus sendMapped(const WebSocketRegion &region, uint8_t opcode);
+#if defined(__linux__)
+    WebSocketSendStatus sendFile(const char *path, uint8_t opcode);
+#endif
+#if defined(ESP32)
+    WebSocketSendStatus sendPartition(const esp_partition_t *partition, size_t offset, size_t length,
+                                      uint8_t opcode);
+#endif
+
+#if CALLBACK_FUNCTIONS
+    // On the owner's side: queue a streamed piece, fragment or region that
+    // another thread handed over. False if message is none of those.
+    bool queueOutgoing(WebSocketMessage *message);
+
+    // On the owner's side: keep a message from the ring back while another
+    // is partly queued, or the queue is too full for it. True if it was
+    // taken, to be sent later.
+    bool hold(WebSocketMessage *message);
+    // The same for a message the owner sends itself, copied; status is
+    // what the send returns, WS_SEND_OVERFLOW while the owner's own message
+    // is open.
+    bool hold(uint8_t opcode, const uint8_t *data, size_t length, WebSocketSendStatus &status);
+    // Send the held messages once nothing is open any more, as far as the
+    // queue takes them; the rest waits for the next call.
+    void releaseHeld();
+#endif
+
+private:
+    Connection &_connection;
+    WebSocketSendQueue &_queue;
+    WebSocketMemory &_memory;
+    bool _masked;
+
+#if CALLBACK_FUNCTIONS
+    WebSocketIoTask *_io;
+    // Thread whose message sent in pieces holds the connection. Only that
+    // thread touches the state below up to _streamRemaining.
+    std::atomic<WebSocketIoTask::ThreadId> _streamThread;
+#else
+    bool _claimed;
+#endif
+
+    // Message being streamed by beginMessage(), or built by commitFrame()
+    bool _streaming;
+    bool _building;
+    bool _streamFragmented;
+    uint8_t _streamOpcode;
+    uint64_t _streamRemaining;
+
+#if CALLBACK_FUNCTIONS
+    // Owner side: part of a message is in the send queue, streamed by the
+    // owner itself or by another thread through the ring
+    bool _ownOpen;
+    bool _ringOpen;
+    // Messages waiting for it, oldest first, and how many are pieces
+    WebSocketMessage *_held;
+    WebSocketMessage *_heldTail;
+    size_t _heldPieces;
+#endif
+
+    // True when the caller has to go through the I/O task's ring.
+    bool offThread() const;
+
+    // The calling thread has a message open, or opens one. claimStream()
+    // fails while another thread's is open or, on the owner's side, still
+    // partly queued; releaseStream() ends it.
+    bool ownsStream() const;
+    bool canClaim() const;
+    bool claimStream();
+    void releaseStream();
+
+    // Status of a send that went into the queue, or into the ring.
+    WebSocketSendStatus queued() const;
+    WebSocketSendStatus handedOver() const;
+
+    // Queue one frame of a fragmented message, without FIN.
+    WebSocketSendStatus queueFragment(uint8_t opcode, const uint8_t *data, size_t length);
+
+    // Queue the header, then the payload, of a frame streamed by
+    // beginMessage().
+    WebSocketSendStatus queueFrameStart(uint8_t first, uint64_t length);
+    WebSocketSendStatus queuePayload(const uint8_t *data, size_t length);
+
+    WebSocketSendStatus queueRegion(uint8_t first, const WebSocketRegion &region);
+    // Queue the last frame of a message, with FIN.
+    WebSocketSendStatus queueFinal(uint8_t opcode, const uint8_t *data, size_t length);
+
+    // Pass the next write() on, as payload of the open frame or as a
+    // fragment.
+    WebSocketSendStatus sendChunk(const uint8_t *data, size_t length, bool known);
+
+#if CALLBACK_FUNCTIONS
+    // Queue pieces of a streamed message on the owner's thread.
+    void ioFrameStart(const uint8_t *header);
+    void ioPayload(const uint8_t *data, size_t length);
+    void ioFragment(uint8_t opcode, const uint8_t *data, size_t length);
+    void ioFinal(uint8_t opcode, const uint8_t *data, size_t length);
+    void ioRegion(const uint8_t *request);
+
+    // Whether a message belongs held back just now; ring is true for one
+    // another thread sent.
+    bool holds(uint8_t opcode, const uint8_t *data, size_t length, bool ring) const;
+    void append(WebSocketMessage *message);
+    void dropHeld();
+#endif
+
+    WebSocketSender(const WebSocketSender &);
+    WebSocketSender &operator=(const WebSocketSender &);
+};
+
+#endif
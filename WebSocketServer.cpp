@@ -14,8 +14,46 @@
 #include "Base64.h"
 
 
+WebSocketServer::WebSocketServer() : _sender(*this, _queue, _memory, false) {
+    socket_client = NULL;
+    _keepaliveInterval = 0;
+    _keepaliveTimeout = 0;
+    _roundTripMicros = 0;
+    _pingSequence = 0;
+    _fragmentLength = WS_FRAGMENT_LENGTH;
+    _closeDelay = WS_CLOSE_DELAY_MS;
+    _decoder.setMemory(&_memory);
+    _decoder.setExpectMasked(true);
+    _queue.setMemory(&_memory);
+    _batch.setMemory(&_memory);
+#if CALLBACK_FUNCTIONS
+    _io.setMemory(&_memory);
+    _sender.setIoTask(&_io);
+#endif
+    hixie76style = false;
+#if WS_LATENCY_HISTOGRAMS
+    _replyStart = 0;
+    _replyPending = false;
+#endif
+}
+
+WebSocketServer::~WebSocketServer() {
+#if CALLBACK_FUNCTIONS
+    _io.end();
+#endif
+}
+
 bool WebSocketServer::handshake(Client &client) {
     socket_client = &client;
+#if CALLBACK_FUNCTIONS
+    _io.claim();
+#endif
+    _decoder.reset();
+    _queue.clear();
+    _sender.reset();
+    _startMillis = millis();
+    _lastPingMillis = _startMillis;
+    _roundTripMicros = 0;
 
     // If there is a connected client->
     if (socket_client->connected()) {
@@ -44,9 +82,61 @@ bool WebSocketServer::handshake(Client &client) {
     }
 }
 
+bool WebSocketServer::preallocate(size_t sendBytes, size_t messageBytes) {
+    bool ok = _queue.preallocate(sendBytes) && _decoder.preallocate(messageBytes);
+
+    // String::reserve() only fails when out of memory
+    ok = _line.reserve(WS_REQUEST_LINE_LENGTH) && ok;
+    ok = _lineLc.reserve(WS_REQUEST_LINE_LENGTH) && ok;
+    ok = _key.reserve(64) && ok;
+    ok = origin.reserve(WS_REQUEST_LINE_LENGTH) && ok;
+    ok = host.reserve(WS_REQUEST_LINE_LENGTH) && ok;
+    return ok;
+}
+
+void WebSocketServer::reset() {
+#if CALLBACK_FUNCTIONS
+    _io.end();
+    _io.onOutgoing(NULL);
+    _callbacks = WebSocketCallbacks();
+#endif
+    socket_client = NULL;
+    _keepaliveInterval = 0;
+    _keepaliveTimeout = 0;
+    _roundTripMicros = 0;
+    _pingSequence = 0;
+    _fragmentLength = WS_FRAGMENT_LENGTH;
+    _closeDelay = WS_CLOSE_DELAY_MS;
+    _sender.reset();
+    hixie76style = false;
+    origin = "";
+    host = "";
+    _decoder.reset();
+    _queue.clear();
+    _queue.setWatermarks(WS_SEND_HIGH_WATER, WS_SEND_LOW_WATER);
+    _queue.setFragmentLength(WS_FRAGMENT_LENGTH);
+    _queue.setCoalescing(0, 0);
+    _batch.clear();
+#if WS_LATENCY_HISTOGRAMS
+    _latency.reset();
+    _replyStart = 0;
+    _replyPending = false;
+#endif
+}
+
+// to = from[start, end), into to's own buffer rather than a substring() copy
+static void assignRange(String &to, const String &from, unsigned int start, unsigned int end) {
+    to = "";
+    for (unsigned int i = start; i < end && i < from.length(); ++i) {
+        to += from.charAt(i);
+    }
+}
+
 bool WebSocketServer::analyzeRequest(int bufferLength) {
-    // Use String library to do some sort of read() magic here.
-    String temp,tempLc;
+    // Use String library to do some sort of read() magic here. The strings
+    // are members so their buffers are reused from one handshake to the next.
+    String &temp = _line;
+    String &tempLc = _lineLc;
     int charpos;
     int bite;
     bool foundupgrade = false;
@@ -54,8 +144,10 @@ bool WebSocketServer::analyzeRequest(int bufferLength) {
     String oldkey[2];
     unsigned long intkey[2];
 #endif
-    String newkey;
+    String &newkey = _key;
 
+    temp = "";
+    newkey = "";
     hixie76style = false;
     
 #ifdef DEBUGGING
@@ -95,11 +187,11 @@ bool WebSocketServer::analyzeRequest(int bufferLength) {
                 foundupgrade = true;
                 hixie76style = false;
             } else if (tempLc.startsWith("origin:")) {
-                origin = temp.substring(7,temp.length() - 2); // Don't save last CR+LF
+                assignRange(origin, temp, 7, temp.length() - 2); // Don't save last CR+LF
             } else
 #ifdef SUPPORT_HIXIE_76
             if (tempLc.startsWith("host:")) {
-                host = temp.substring(5,temp.length() - 2); // Don't save last CR+LF
+                assignRange(host, temp, 5, temp.length() - 2); // Don't save last CR+LF
             } else if (tempLcLc.startsWith("sec-websocket-key1:")) {
                 oldkey[0]=tempLc.substring(19,temp.length() - 2); // Don't save last CR+LF
             } else if (temp.startsWith("sec-websocket-key2:")) {
@@ -107,7 +199,7 @@ bool WebSocketServer::analyzeRequest(int bufferLength) {
             } else
 #endif
             if (tempLc.startsWith("sec-websocket-key:")) {
-                newkey=temp.substring(18,temp.length() - 2); // Don't save last CR+LF
+                assignRange(newkey, temp, 18, temp.length() - 2); // Don't save last CR+LF
             }
             temp = "";        
         }
@@ -200,7 +292,9 @@ bool WebSocketServer::analyzeRequest(int bufferLength) {
             SHA1Context sha;
             int err;
             uint8_t Message_Digest[20];
+#ifdef DEBUGGING
             Serial.println("Calculating");
+#endif
             err = SHA1Reset(&sha);
             err = SHA1Input(&sha, reinterpret_cast<const uint8_t *>(newkey.c_str()), newkey.length());
             err = SHA1Result(&sha, Message_Digest);
@@ -212,14 +306,15 @@ bool WebSocketServer::analyzeRequest(int bufferLength) {
             result[20] = '\0';
 
             base64_encode(b64Result, result, 20);
+#ifdef DEBUGGING
             Serial.println("Sending");
-            char * response = (char*)malloc(200);
-            sprintf(response, "HTTP/1.1 101 Web Socket Protocol Handshake\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", b64Result);
+#endif
+            char response[200];
+            snprintf(response, sizeof(response), "HTTP/1.1 101 Web Socket Protocol Handshake\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", b64Result);
             socket_client->print(response);
 #ifdef DEBUGGING
             Serial.print(response);
 #endif
-            free(response);
             return true;
         } else {
             // something went horribly wrong
@@ -275,88 +370,453 @@ String WebSocketServer::handleHixie76Stream() {
 #endif
 
 String WebSocketServer::handleStream() {
-    uint8_t msgtype;
-    unsigned int length;
-    uint8_t mask[4];
-    unsigned int i;
-
     // String to hold bytes sent by client to server.
     String socketString;
 
-    if (socket_client->connected() && socket_client->available()) {
-        msgtype = timedRead();
-        if (msgtype == 0x88) {
-            disconnectStream();
-            return socketString;
+    // Sketches that only call getData() still need queued output to drain
+    flushQueue();
+
+    while (socket_client->connected()) {
+        if (_decoder.poll(*socket_client)) {
+            uint8_t opcode = _decoder.opcode();
+
+            _startMillis = millis();
+
+#if WS_LATENCY_HISTOGRAMS
+            if (!(opcode & 0x08)) {
+                messageReceived();
+            }
+            WebSocketTicks stringStart = wsTicks();
+#endif
+            if (opcode != WS_OPCODE_CLOSE) {
+                socketString.concat((const char *) _decoder.payload(), _decoder.length());
+            }
+#if WS_LATENCY_HISTOGRAMS
+            if (!(opcode & 0x08)) {
+                _latency.record(WS_STAGE_STRING, stringStart);
+            }
+#endif
+            if (opcode & 0x08) {
+                handleControlFrame();
+            }
+            _decoder.release();
+            break;
         }
-        if (!socket_client->connected()) {
-            return socketString;
+
+        if (_decoder.failed()) {
+            closeStream(_decoder.error());
+            break;
         }
 
-        length = timedRead() & 127;
-        if (!socket_client->connected()) {
-            return socketString;
+        // Nothing has arrived yet, don't wait for it
+        if (!_decoder.busy()) {
+            break;
         }
 
-        if (length == 126) {
-            length = timedRead() << 8;
-            if (!socket_client->connected()) {
-                return socketString;
+        // Rest of the frame is still in flight
+        delay(1);
+    }
+
+    return socketString;
+}
+
+size_t WebSocketServer::receiveBatch(WebSocketMessageView *views, size_t maxMessages) {
+    size_t count = 0;
+
+    _batch.clear();
+    if (socket_client == NULL || hixie76style) {
+        return 0;
+    }
+#if CALLBACK_FUNCTIONS
+    // The I/O task has already decoded the messages
+    if (_io.running()) {
+        WebSocketMessage *message;
+
+        while (count < maxMessages && (message = _io.peekIncoming()) != NULL) {
+            if (message->opcode == WS_OPCODE_TEXT || message->opcode == WS_OPCODE_BINARY) {
+                if (!_batch.append(message->data(), message->length)) {
+                    // Not even one fits: it never will, so give up on it
+                    if (count == 0) {
+                        uint8_t status[2] = { (uint8_t) (WS_CLOSE_TOO_BIG >> 8), (uint8_t) (WS_CLOSE_TOO_BIG & 0xFF) };
+
+                        _io.nextIncoming();
+                        WebSocketMessage::destroy(message);
+                        _io.send(WS_IO_FAIL, status, sizeof(status));
+                    }
+                    break;
+                }
+                views[count].opcode = message->opcode;
+                views[count].length = message->length;
+                count++;
+            } else {
+                _callbacks.dispatch(message->opcode, message->data(), message->length);
             }
-            
-            length |= timedRead();
-            if (!socket_client->connected()) {
-                return socketString;
-            }   
+            _io.nextIncoming();
+            WebSocketMessage::destroy(message);
+        }
+        _batch.resolve(views, count);
+        return count;
+    }
+#endif
 
-        } else if (length == 127) {
-#ifdef DEBUGGING
-            Serial.println(F("No support for over 16 bit sized messages"));
+    flushQueue();
+
+    while (count < maxMessages && socket_client->connected() && _decoder.poll(*socket_client)) {
+        uint8_t opcode = _decoder.opcode();
+
+        _startMillis = millis();
+
+        if (opcode & 0x08) {
+            handleControlFrame();
+        } else {
+            // Out of memory: leave the message for the next call, unless
+            // it is the first, which would never fit
+            if (!_batch.append(_decoder.payload(), _decoder.length())) {
+                if (count == 0) {
+                    _decoder.release();
+                    closeStream(WS_CLOSE_TOO_BIG);
+                }
+                break;
+            }
+#if WS_LATENCY_HISTOGRAMS
+            messageReceived();
 #endif
-            terminateStream(0x89);
-            return socketString;
+            views[count].opcode = opcode;
+            views[count].length = _decoder.length();
+            count++;
         }
+        _decoder.release();
+    }
+
+    if (_decoder.failed() && socket_client->connected()) {
+        closeStream(_decoder.error());
+    }
 
-        // get the mask
-        mask[0] = timedRead();
-        if (!socket_client->connected()) {
-            return socketString;
+    _batch.resolve(views, count);
+    return count;
+}
+
+void WebSocketServer::poll() {
+#if CALLBACK_FUNCTIONS
+    if (_io.running()) {
+        dispatchIncoming();
+        return;
+    }
+    // Messages other threads sent since the last call
+    if (socket_client != NULL && socket_client->connected()) {
+        sendOutgoing();
+    }
+#endif
+    pollSocket();
+#if CALLBACK_FUNCTIONS
+    _io.setBlocked(_queue.blocked());
+#endif
+}
+
+bool WebSocketServer::pollSocket() {
+    bool busy = false;
+
+    if (socket_client == NULL || hixie76style) {
+        return false;
+    }
+
+    while (socket_client->connected() && canNotify() && _decoder.poll(*socket_client)) {
+        uint8_t opcode = _decoder.opcode();
+
+        _startMillis = millis();
+        busy = true;
+
+        if (opcode & 0x08) {
+            handleControlFrame();
+        } else {
+#if WS_LATENCY_HISTOGRAMS
+            messageReceived();
+#endif
+            notify(opcode, _decoder.payload(), _decoder.length());
         }
+        _decoder.release();
+    }
+
+    if (_decoder.failed() && socket_client->connected()) {
+        closeStream(_decoder.error());
+    }
+
+    if (socket_client->connected()) {
+        keepalive();
+    }
+
+    if (socket_client->connected()) {
+        busy |= flushQueue() > 0;
+    }
+    return busy;
+}
+
+void WebSocketServer::notify(uint8_t opcode, const uint8_t *payload, size_t length) {
+#if CALLBACK_FUNCTIONS
+    // With an I/O task the handlers run on the application's thread instead
+    if (_io.running()) {
+        // Out of memory for a copy: fail rather than lose a message silently
+        if (!_io.deliver(opcode, payload, length) && opcode < WS_OPCODE_CLOSE) {
+            closeStream(WS_CLOSE_INTERNAL_ERROR);
+        }
+        return;
+    }
+    dispatch(opcode, payload, length);
+#else
+    (void) opcode;
+    (void) payload;
+    (void) length;
+#endif
+}
+
+bool WebSocketServer::canNotify() const {
+#if CALLBACK_FUNCTIONS
+    // Leave data in the socket while the application is behind
+    return !_io.running() || _io.canDeliver();
+#else
+    return true;
+#endif
+}
+
+#if CALLBACK_FUNCTIONS
+bool WebSocketServer::beginIoTask(int core) {
+    if (socket_client == NULL || hixie76style) {
+        return false;
+    }
+    return _io.begin(ioStep, this, core);
+}
+
+void WebSocketServer::endIoTask() {
+    _io.end();
+}
+
+void WebSocketServer::onOutgoing(WebSocketEventCallback callback, void *context) {
+    _io.onOutgoing(callback, context);
+}
+
+bool WebSocketServer::ioStep(void *owner) {
+    WebSocketServer *server = (WebSocketServer *) owner;
+    bool busy = server->sendOutgoing();
+
+    busy |= server->pollSocket();
+    server->_io.setBlocked(server->_queue.blocked());
+    return busy;
+}
+
+bool WebSocketServer::sendOutgoing() {
+    WebSocketMessage *message;
+    bool busy = false;
+
+    // What the queue had no room for last time goes first
+    _sender.releaseHeld();
+    while ((message = _io.nextOutgoing()) != NULL) {
+        // Whole messages wait while another is partly queued
+        if (!_sender.hold(message)) {
+            sendMessage(message);
+            WebSocketMessage::destroy(message);
+        }
+        busy = true;
+    }
+    return busy;
+}
+
+void WebSocketServer::sendMessage(WebSocketMessage *message) {
+    if (message->opcode == WS_OPCODE_CLOSE) {
+        disconnectStream();
+    } else if (message->opcode == WS_IO_RAW_FRAME) {
+        queueFrame(message->data(), message->length);
+    } else if (message->opcode == WS_IO_FLUSH) {
+        flushQueue(true);
+    } else if (message->opcode == WS_IO_FAIL) {
+        closeStream((message->data()[0] << 8) | message->data()[1]);
+    } else if (_sender.queueOutgoing(message)) {
+        // A streamed piece, fragment or region
+    } else {
+        sendEncodedData(message->data(), message->length, message->opcode);
+    }
+}
+
+void WebSocketServer::dispatchIncoming() {
+    WebSocketMessage *message;
+
+    while ((message = _io.nextIncoming()) != NULL) {
+        dispatch(message->opcode, message->data(), message->length);
+        WebSocketMessage::destroy(message);
+    }
+}
+
+void WebSocketServer::dispatch(uint8_t opcode, const uint8_t *payload, size_t length) {
+#if WS_LATENCY_HISTOGRAMS
+    WebSocketTicks handlerStart = wsTicks();
+#endif
+    _callbacks.dispatch(opcode, payload, length);
+#if WS_LATENCY_HISTOGRAMS
+    if (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BINARY) {
+        _latency.record(WS_STAGE_HANDLER, handlerStart);
+    }
+#endif
+}
+#endif
+
+#if WS_LATENCY_HISTOGRAMS
+void WebSocketServer::messageReceived() {
+    _latency.record(WS_STAGE_RECEIVE, _decoder.startTicks());
+    _latency.recordTicks(WS_STAGE_UNMASK, _decoder.unmaskTicks());
+    _replyStart = _decoder.startTicks();
+    _replyPending = true;
+}
+#endif
+
+bool WebSocketServer::sendable() {
+    return socket_client != NULL && socket_client->connected();
+}
 
-        mask[1] = timedRead();
-        if (!socket_client->connected()) {
+WebSocketSendStatus WebSocketServer::send(const uint8_t *data, size_t length, uint8_t opcode) {
+#if CALLBACK_FUNCTIONS
+    WebSocketSendStatus status;
 
-            return socketString;
+    // The I/O task owns the socket and the send queue
+    if (_io.offThread()) {
+        if (!_io.send(opcode, data, length)) {
+            return WS_SEND_OVERFLOW;
         }
+        return _io.blocked() ? WS_SEND_WOULD_BLOCK : WS_SEND_QUEUED;
+    }
+#endif
+    if (socket_client == NULL || !socket_client->connected()) {
+        return WS_SEND_CLOSED;
+    }
+#if CALLBACK_FUNCTIONS
+    if (_sender.hold(opcode, data, length, status)) {
+        return status;
+    }
+#endif
+    return sendEncodedData(data, length, opcode);
+}
+
+void WebSocketServer::setKeepalive(unsigned long intervalMs, unsigned long timeoutMs) {
+    _keepaliveInterval = intervalMs;
+    _keepaliveTimeout = timeoutMs;
+    _lastPingMillis = millis();
+}
+
+bool WebSocketServer::nextDeadline(unsigned long &atMs) const {
+    unsigned long held = _queue.holdRemaining();
+    bool due = false;
 
-        mask[2] = timedRead();
-        if (!socket_client->connected()) {
-            return socketString;
+    if (_keepaliveTimeout > 0) {
+        atMs = _startMillis + _keepaliveTimeout;
+        due = true;
+    }
+    if (_keepaliveInterval > 0) {
+        unsigned long ping = _lastPingMillis + _keepaliveInterval;
+
+        if (!due || (long) (ping - atMs) < 0) {
+            atMs = ping;
         }
+        due = true;
+    }
+    if (held > 0) {
+        unsigned long flush = millis() + (held + 999) / 1000;
 
-        mask[3] = timedRead();
-        if (!socket_client->connected()) {
-            return socketString;
+        if (!due || (long) (flush - atMs) < 0) {
+            atMs = flush;
         }
+        due = true;
+    }
+    return due;
+}
 
-        for (i=0; i<length; ++i) {
-            socketString += (char) (timedRead() ^ mask[i % 4]);
-            if (!socket_client->connected()) {
-                return socketString;
+void WebSocketServer::keepalive() {
+    unsigned long now = millis();
+
+    if (_keepaliveTimeout > 0 && now - _startMillis >= _keepaliveTimeout) {
+#ifdef DEBUGGING
+        Serial.println(F("Connection idle, closing"));
+#endif
+        closeStream(WS_CLOSE_GOING_AWAY);
+        return;
+    }
+
+    if (_keepaliveInterval > 0 && now - _lastPingMillis >= _keepaliveInterval) {
+        // The payload carries a sequence number so a late pong for an older
+        // ping is not mistaken for the current one.
+        uint8_t payload[4];
+
+        _pingSequence++;
+        payload[0] = (uint8_t) (_pingSequence >> 24);
+        payload[1] = (uint8_t) (_pingSequence >> 16);
+        payload[2] = (uint8_t) (_pingSequence >> 8);
+        payload[3] = (uint8_t) _pingSequence;
+
+        _lastPingMillis = now;
+        _pingSentMicros = micros();
+        sendEncodedData(payload, sizeof(payload), WS_FIN | WS_OPCODE_PING);
+    }
+}
+
+void WebSocketServer::handleControlFrame() {
+    const uint8_t *payload = _decoder.payload();
+    size_t length = _decoder.length();
+
+    switch (_decoder.opcode()) {
+    case WS_OPCODE_PING:
+        sendEncodedData(payload, length, WS_FIN | WS_OPCODE_PONG);
+        notify(WS_OPCODE_PING, payload, length);
+        break;
+
+    case WS_OPCODE_PONG:
+        if (length == 4 && _pingSequence != 0) {
+            uint32_t sequence = ((uint32_t) payload[0] << 24) | ((uint32_t) payload[1] << 16)
+                              | ((uint32_t) payload[2] << 8) | payload[3];
+            if (sequence == _pingSequence) {
+                _roundTripMicros = micros() - _pingSentMicros;
             }
         }
-        if (msgtype == 0x89) {
-            sendPong(socketString);
-        } else if (msgtype == 0x8A) {
 #ifdef DEBUGGING
-            Serial.println(F("Received pong"));
+        Serial.println(F("Received pong"));
 #endif
-            return socketString;
-        }
+        notify(WS_OPCODE_PONG, payload, length);
+        break;
+
+    case WS_OPCODE_CLOSE:
+        notify(WS_OPCODE_CLOSE, payload, length);
+        disconnectStream();
+        break;
     }
+}
 
-    return socketString;
+#if CALLBACK_FUNCTIONS
+void WebSocketServer::onDrain(WebSocketEventCallback callback, void *context) {
+    _callbacks.drain = callback;
+    _callbacks.drainContext = context;
+}
+
+void WebSocketServer::onText(WebSocketDataCallback callback, void *context) {
+    _callbacks.text = callback;
+    _callbacks.textContext = context;
+}
+
+void WebSocketServer::onBinary(WebSocketDataCallback callback, void *context) {
+    _callbacks.binary = callback;
+    _callbacks.binaryContext = context;
+}
+
+void WebSocketServer::onPing(WebSocketDataCallback callback, void *context) {
+    _callbacks.ping = callback;
+    _callbacks.pingContext = context;
+}
+
+void WebSocketServer::onPong(WebSocketDataCallback callback, void *context) {
+    _callbacks.pong = callback;
+    _callbacks.pongContext = context;
+}
+
+void WebSocketServer::onClose(WebSocketCloseCallback callback, void *context) {
+    _callbacks.close = callback;
+    _callbacks.closeContext = context;
 }
+#endif
 
 void WebSocketServer::terminateStream(uint8_t cause) {
 #ifdef DEBUGGING
@@ -372,16 +832,33 @@ void WebSocketServer::terminateStream(uint8_t cause) {
     } else {
 
         // Should send termination sequence (87,88,89) to server to tell it I'm quitting here.
-        socket_client->write((uint8_t) cause);
-        socket_client->write((uint8_t) 0x00);
+        uint8_t frame[2] = { cause, 0x00 };
+        _queue.pushControl(frame, sizeof(frame));
+        _queue.flush(*socket_client);
     }   
     
-    socket_client->flush();
-    delay(10);
-    socket_client->stop();
+    stopStream();
+}
+
+void WebSocketServer::closeStream(uint16_t code) {
+#ifdef DEBUGGING
+    Serial.print(F("Closing socket with status "));
+    Serial.println(code);
+#endif
+    uint8_t status[2] = { (uint8_t) (code >> 8), (uint8_t) (code & 0xFF) };
+
+    sendEncodedData(status, sizeof(status), WS_FIN | WS_OPCODE_CLOSE);
+    stopStream();
 }
 
 void WebSocketServer::disconnectStream() {
+#if CALLBACK_FUNCTIONS
+    // Let the I/O task or the owner close the socket it owns
+    if (_io.offThread()) {
+        _io.send(WS_OPCODE_CLOSE, NULL, 0);
+        return;
+    }
+#endif
 #ifdef DEBUGGING
     Serial.println(F("Disconnecting socket"));
 #endif
@@ -395,18 +872,32 @@ void WebSocketServer::disconnectStream() {
     } else {
 
         // Should send 0x8800 to server to tell it I'm quitting here.
-        socket_client->write((uint8_t) 0x88);
-        socket_client->write((uint8_t) 0x00);
+        uint8_t frame[2] = { 0x88, 0x00 };
+        _queue.pushControl(frame, sizeof(frame));
+        _queue.flush(*socket_client);
     }   
     
+    stopStream();
+}
+
+void WebSocketServer::stopStream() {
     socket_client->flush();
-    delay(10);
+    if (_closeDelay > 0) {
+        delay(_closeDelay);
+    }
     socket_client->stop();
 }
 
 String WebSocketServer::getData() {
     String data;
 
+#if CALLBACK_FUNCTIONS
+    // Messages go to the handlers while the I/O task runs
+    if (_io.running()) {
+        return data;
+    }
+#endif
+
     if (hixie76style) {
 #ifdef SUPPORT_HIXIE_76
         data = handleHixie76Stream();
@@ -418,38 +909,100 @@ String WebSocketServer::getData() {
     return data;
 }
 
-void WebSocketServer::sendData(const char *str) {
+WebSocketSendStatus WebSocketServer::sendData(const char *str) {
 #ifdef DEBUGGING
     Serial.print(F("Sending data: "));
     Serial.println(str);
 #endif
-    if (socket_client->connected()) {
-        if (hixie76style) {
-            socket_client->write(0x00); // Frame start
-            socket_client->print(str);
-            socket_client->write(0xFF); // Frame end            
-        } else {
-            sendEncodedData(str, 0x81);
-        }         
+    if (hixie76style) {
+        socket_client->write(0x00); // Frame start
+        socket_client->print(str);
+        socket_client->write(0xFF); // Frame end            
+        return WS_SEND_QUEUED;
     }
+
+    return send((const uint8_t *) str, strlen(str), 0x81);
 }
 
-void WebSocketServer::sendData(String str) {
-#ifdef DEBUGGING
-    Serial.print(F("Sending data: "));
-    Serial.println(str);
+WebSocketSendStatus WebSocketServer::sendData(String str) {
+    return sendData(str.c_str());
+}
+
+void WebSocketServer::setSendQueueWatermarks(size_t high, size_t low) {
+    _queue.setWatermarks(high, low);
+}
+
+void WebSocketServer::setFragmentSize(size_t length) {
+    _fragmentLength = length;
+    _queue.setFragmentLength(length);
+}
+
+uint8_t *WebSocketServer::reserveFrame(size_t maxLength) {
+    return _sender.reserveFrame(maxLength);
+}
+
+WebSocketSendStatus WebSocketServer::commitFrame(uint8_t opcode, size_t length, bool final) {
+    return _sender.commitFrame(opcode, length, final);
+}
+
+WebSocketSendStatus WebSocketServer::beginMessage(uint8_t opcode, uint64_t length) {
+    return _sender.beginMessage(opcode, length);
+}
+
+WebSocketSendStatus WebSocketServer::write(const uint8_t *data, size_t length) {
+    return _sender.write(data, length);
+}
+
+WebSocketSendStatus WebSocketServer::endMessage() {
+    return _sender.endMessage();
+}
+
+WebSocketSendStatus WebSocketServer::sendRegion(const uint8_t *data, size_t length, uint8_t opcode,
+                                             WebSocketRegionRelease release, void *context) {
+    return _sender.sendRegion(data, length, opcode, release, context);
+}
+
+#if defined(__linux__)
+WebSocketSendStatus WebSocketServer::sendFile(const char *path, uint8_t opcode) {
+    return _sender.sendFile(path, opcode);
+}
 #endif
-    if (socket_client->connected()) {
-        if (hixie76style) {
-            socket_client->write(0x00); // Frame start
-            socket_client->print(str);
-            socket_client->write(0xFF); // Frame end        
-        } else {
-            sendEncodedData(str, 0x81);
-        }
+
+#if defined(ESP32)
+WebSocketSendStatus WebSocketServer::sendPartition(const esp_partition_t *partition, size_t offset, size_t length,
+                                                uint8_t opcode) {
+    return _sender.sendPartition(partition, offset, length, opcode);
+}
+#endif
+
+void WebSocketServer::setCoalescing(size_t bytes, unsigned long windowMicros) {
+    _queue.setCoalescing(bytes, windowMicros);
+}
+
+void WebSocketServer::flush() {
+#if CALLBACK_FUNCTIONS
+    if (_io.offThread()) {
+        _io.send(WS_IO_FLUSH, NULL, 0);
+        return;
+    }
+#endif
+    if (socket_client != NULL && socket_client->connected()) {
+        flushQueue(true);
     }
 }
 
+size_t WebSocketServer::flushQueue(bool force) {
+    if (_queue.empty() || !(force || _queue.due())) {
+        return 0;
+    }
+
+    size_t written = _queue.flush(*socket_client);
+    if (_queue.drained()) {
+        notify(WS_EVENT_DRAIN, NULL, 0);
+    }
+    return written;
+}
+
 int WebSocketServer::timedRead() {
   while (!socket_client->available()) {
     delay(20);  
@@ -458,38 +1011,79 @@ int WebSocketServer::timedRead() {
   return socket_client->read();
 }
 
-void WebSocketServer::sendEncodedData(char *str, uint8_t opcode) {
-    int size = strlen(str);
+WebSocketSendStatus WebSocketServer::sendFrame(const uint8_t *frame, size_t length) {
+#if CALLBACK_FUNCTIONS
+    WebSocketSendStatus status;
 
-    // string type
-    socket_client->write(opcode);
+    if (_io.offThread()) {
+        if (!_io.send(WS_IO_RAW_FRAME, frame, length)) {
+            return WS_SEND_OVERFLOW;
+        }
+        return _io.blocked() ? WS_SEND_WOULD_BLOCK : WS_SEND_QUEUED;
+    }
+#endif
+    if (socket_client == NULL || !socket_client->connected()) {
+        return WS_SEND_CLOSED;
+    }
+#if CALLBACK_FUNCTIONS
+    if (_sender.hold(WS_IO_RAW_FRAME, frame, length, status)) {
+        return status;
+    }
+#endif
+    return queueFrame(frame, length);
+}
 
-    // NOTE: no support for > 16-bit sized messages
-    if (size > 125) {
-        socket_client->write(126);
-        socket_client->write((uint8_t) (size >> 8));
-        socket_client->write((uint8_t) (size & 0xFF));
-    } else {
-        socket_client->write((uint8_t) size);
+WebSocketSendStatus WebSocketServer::queueFrame(const uint8_t *frame, size_t length) {
+    if (!_queue.push(frame, length)) {
+        return WS_SEND_OVERFLOW;
     }
 
-    socket_client->print(str);
+    flushQueue();
+    return _queue.blocked() ? WS_SEND_WOULD_BLOCK : WS_SEND_QUEUED;
 }
 
-void WebSocketServer::sendEncodedData(String str, uint8_t opcode) {
-    int size = str.length() + 1;
-    char cstr[size];
+WebSocketSendStatus WebSocketServer::sendEncodedData(char *str, uint8_t opcode) {
+    return sendEncodedData((const uint8_t *) str, strlen(str), opcode);
+}
+
+WebSocketSendStatus WebSocketServer::sendEncodedData(const uint8_t *data, size_t size, uint8_t opcode) {
+    bool queued;
+#if WS_LATENCY_HISTOGRAMS
+    WebSocketTicks sendStart = wsTicks();
+#endif
 
-    str.toCharArray(cstr, size);
+    // Control frames jump ahead of queued data at the next frame boundary
+    if (opcode & 0x08) {
+        queued = _queue.pushFrame(opcode, data, size, false);
+    } else {
+        queued = _queue.pushMessage(opcode & 0x0F, data, size, false, _fragmentLength);
+    }
+    if (!queued) {
+        return WS_SEND_OVERFLOW;
+    }
+
+    flushQueue();
+#if WS_LATENCY_HISTOGRAMS
+    if (!(opcode & 0x08)) {
+        _latency.record(WS_STAGE_SEND, sendStart);
+        if (_replyPending) {
+            _latency.record(WS_STAGE_TOTAL, _replyStart);
+            _replyPending = false;
+        }
+    }
+#endif
+    return _queue.blocked() ? WS_SEND_WOULD_BLOCK : WS_SEND_QUEUED;
+}
 
-    sendEncodedData(cstr, opcode);
+WebSocketSendStatus WebSocketServer::sendEncodedData(String str, uint8_t opcode) {
+    return sendEncodedData((const uint8_t *) str.c_str(), str.length(), opcode);
 }
 
 void WebSocketServer::sendPing(String str) {
-    sendEncodedData(str, 0x89);
+    sendPing(str.c_str());
 }
 void WebSocketServer::sendPing(const char *str) {
-    sendEncodedData(str, 0x89);
+    send((const uint8_t *) str, strlen(str), 0x89);
 }
 
 void WebSocketServer::sendPong(String str) {
@@ -0,0 +1,113 @@
+/*
+ *  WebSocketSlab.h
+ *
+ *  Description:
+ *      Fixed pool of objects constructed up front in one block, each on its
+ *      own cache lines so neighbouring connections served from different
+ *      cores don't share any. acquire() and release() pop and push a free
+ *      list and never touch the heap, so a server can size the pool for its
+ *      connection limit at startup and then accept and drop connections
+ *      without allocating. Objects keep whatever buffers they grew, and
+ *      the most recently released one is handed out first, while its
+ *      memory is still warm in the cache.
+ */
+
+#ifndef WEBSOCKETSLAB_H_
+#define WEBSOCKETSLAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+
+// Objects in the pool start on a multiple of this many bytes.
+#ifndef WS_CACHE_LINE
+#define WS_CACHE_LINE 64
+#endif
+
+template <typename T>
+class WebSocketSlab {
+public:
+    WebSocketSlab() : _block(NULL), _objects(NULL), _stride(0), _capacity(0), _free(NULL), _freeCount(0) {
+        static_assert((WS_CACHE_LINE & (WS_CACHE_LINE - 1)) == 0, "WS_CACHE_LINE must be a power of two");
+    }
+    ~WebSocketSlab() { end(); }
+
+    // Construct count objects. Replaces an earlier pool, whose objects
+    // must all have been released.
+    bool begin(size_t count) {
+        end();
+        if (count == 0) {
+            return false;
+        }
+
+        size_t align = alignof(T) > WS_CACHE_LINE ? alignof(T) : WS_CACHE_LINE;
+        _stride = (sizeof(T) + align - 1) & ~(align - 1);
+
+        // Over-allocate by one line to align the first object by hand
+        _block = malloc(count * _stride + align);
+        _free = (T **) malloc(count * sizeof(T *));
+        if (_block == NULL || _free == NULL) {
+            free(_block);
+            _block = NULL;
+            free(_free);
+            _free = NULL;
+            return false;
+        }
+        _objects = (uint8_t *) (((uintptr_t) _block + align - 1) & ~(uintptr_t) (align - 1));
+
+        // Handed out lowest first
+        for (size_t i = 0; i < count; ++i) {
+            new (_objects + i * _stride) T();
+            _free[count - 1 - i] = at(i);
+        }
+        _capacity = count;
+        _freeCount = count;
+        return true;
+    }
+
+    void end() {
+        for (size_t i = 0; i < _capacity; ++i) {
+            at(i)->~T();
+        }
+        free(_block);
+        _block = NULL;
+        _objects = NULL;
+        free(_free);
+        _free = NULL;
+        _capacity = 0;
+        _freeCount = 0;
+    }
+
+    // A free object, or NULL when all are in use. It is in whatever state
+    // release() left it.
+    T *acquire() {
+        return _freeCount > 0 ? _free[--_freeCount] : NULL;
+    }
+
+    // Give back an object from this pool, reset by the caller as needed.
+    void release(T *object) {
+        _free[_freeCount++] = object;
+    }
+
+    // Every object by position, e.g. to preallocate their buffers, and an
+    // object's position, which stays fixed for the life of the pool.
+    T *at(size_t index) const { return (T *) (_objects + index * _stride); }
+    size_t indexOf(const T *object) const { return ((const uint8_t *) object - _objects) / _stride; }
+
+    size_t capacity() const { return _capacity; }
+    size_t available() const { return _freeCount; }
+
+private:
+    void *_block;
+    uint8_t *_objects;
+    size_t _stride;
+    size_t _capacity;
+    T **_free;
+    size_t _freeCount;
+
+    WebSocketSlab(const WebSocketSlab &);
+    WebSocketSlab &operator=(const WebSocketSlab &);
+};
+
+#endif
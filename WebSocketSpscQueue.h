@@ -0,0 +1,79 @@
+/*
+ *  WebSocketSpscQueue.h
+ *
+ *  Description:
+ *      Bounded lock-free ring buffer for exactly one producer thread and
+ *      one consumer thread. Used to hand decoded messages from the I/O
+ *      task to the application and outgoing messages back.
+ */
+
+#ifndef WEBSOCKETSPSCQUEUE_H_
+#define WEBSOCKETSPSCQUEUE_H_
+
+#include <stddef.h>
+#include <atomic>
+
+// Capacity must be a power of two. One slot is never used so that a full
+// ring can be told apart from an empty one.
+template <typename T, size_t Capacity>
+class WebSocketSpscQueue {
+public:
+    WebSocketSpscQueue() : _head(0), _tail(0) {
+        static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    }
+
+    // Producer side. Returns false when the ring is full.
+    bool push(const T &item) {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        size_t next = (tail + 1) & (Capacity - 1);
+
+        if (next == _head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        _items[tail] = item;
+        _tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool full() const {
+        size_t next = (_tail.load(std::memory_order_relaxed) + 1) & (Capacity - 1);
+        return next == _head.load(std::memory_order_acquire);
+    }
+
+    // Consumer side. Returns false when the ring is empty.
+    bool pop(T &item) {
+        size_t head = _head.load(std::memory_order_relaxed);
+
+        if (head == _tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = _items[head];
+        _head.store((head + 1) & (Capacity - 1), std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Look at the oldest item without taking it.
+    bool peek(T &item) const {
+        size_t head = _head.load(std::memory_order_relaxed);
+
+        if (head == _tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = _items[head];
+        return true;
+    }
+
+    bool empty() const {
+        return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+    }
+
+private:
+    T _items[Capacity];
+
+    // Head and tail live on separate cache lines so the two threads don't
+    // invalidate each other's line on every operation.
+    alignas(64) std::atomic<size_t> _head;
+    alignas(64) std::atomic<size_t> _tail;
+};
+
+#endif
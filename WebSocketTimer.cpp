@@ -0,0 +1,169 @@
+//#define DEBUGGING
+
+#include "WebSocketTimer.h"
+
+// Ticks the top level reaches; later deadlines are pulled in to this
+#define WS_TIMER_SPAN ((uint32_t) 1 << (WS_TIMER_LEVELS * WS_TIMER_SLOT_BITS))
+
+WebSocketTimerWheel::WebSocketTimerWheel() {
+    for (int level = 0; level < WS_TIMER_LEVELS; ++level) {
+        for (int slot = 0; slot < WS_TIMER_SLOTS; ++slot) {
+            _slots[level][slot].prev = &_slots[level][slot];
+            _slots[level][slot].next = &_slots[level][slot];
+        }
+    }
+    _current = 0;
+    _baseMs = 0;
+    _armed = 0;
+}
+
+void WebSocketTimerWheel::begin(unsigned long nowMs) {
+    for (int level = 0; level < WS_TIMER_LEVELS; ++level) {
+        for (int slot = 0; slot < WS_TIMER_SLOTS; ++slot) {
+            WebSocketTimer &head = _slots[level][slot];
+
+            while (head.next != &head) {
+                unlink(*head.next);
+            }
+        }
+    }
+    _current = 0;
+    _baseMs = nowMs;
+    _armed = 0;
+}
+
+void WebSocketTimerWheel::schedule(WebSocketTimer &timer, unsigned long atMs) {
+    long delta = (long) (atMs - _baseMs);
+    uint32_t ticks;
+
+    if (timer.armed) {
+        unlink(timer);
+    }
+
+    // Rounded up, so a timer never fires early
+    if (delta <= 0) {
+        ticks = 1;
+    } else {
+        unsigned long rounded = ((unsigned long) delta + WS_TIMER_TICK_MS - 1) / WS_TIMER_TICK_MS;
+        ticks = rounded >= WS_TIMER_SPAN ? WS_TIMER_SPAN - 1 : (uint32_t) rounded;
+    }
+
+    timer.expires = _current + ticks;
+    insert(timer);
+}
+
+void WebSocketTimerWheel::cancel(WebSocketTimer &timer) {
+    if (timer.armed) {
+        unlink(timer);
+    }
+}
+
+// Into the lowest level whose span covers the time left; during a cascade
+// that may be the slot about to fire
+void WebSocketTimerWheel::insert(WebSocketTimer &timer) {
+    uint32_t delta = timer.expires - _current;
+    int level = 0;
+
+    while (level < WS_TIMER_LEVELS - 1 && delta >= ((uint32_t) 1 << ((level + 1) * WS_TIMER_SLOT_BITS))) {
+        level++;
+    }
+
+    WebSocketTimer &head = _slots[level][(timer.expires >> (level * WS_TIMER_SLOT_BITS)) & (WS_TIMER_SLOTS - 1)];
+    timer.prev = head.prev;
+    timer.next = &head;
+    head.prev->next = &timer;
+    head.prev = &timer;
+    timer.armed = true;
+    _armed++;
+}
+
+void WebSocketTimerWheel::unlink(WebSocketTimer &timer) {
+    timer.prev->next = timer.next;
+    timer.next->prev = timer.prev;
+    timer.prev = NULL;
+    timer.next = NULL;
+    timer.armed = false;
+    _armed--;
+}
+
+// Spread the slot of level that the current tick has reached over the
+// levels below
+void WebSocketTimerWheel::cascade(int level) {
+    WebSocketTimer &head = _slots[level][(_current >> (level * WS_TIMER_SLOT_BITS)) & (WS_TIMER_SLOTS - 1)];
+
+    while (head.next != &head) {
+        WebSocketTimer &timer = *head.next;
+
+        unlink(timer);
+        insert(timer);
+    }
+}
+
+long WebSocketTimerWheel::nextExpiry(unsigned long nowMs) const {
+    uint32_t ticks = 0;
+
+    if (_armed == 0) {
+        return -1;
+    }
+
+    // The first non-empty slot of each level after the current one; a
+    // higher level's slot counts from the tick that cascades it
+    for (int level = 0; level < WS_TIMER_LEVELS; ++level) {
+        int shift = level * WS_TIMER_SLOT_BITS;
+        uint32_t position = _current >> shift;
+
+        for (uint32_t step = 1; step <= WS_TIMER_SLOTS; ++step) {
+            const WebSocketTimer &head = _slots[level][(position + step) & (WS_TIMER_SLOTS - 1)];
+
+            if (head.next != &head) {
+                uint32_t due = ((position + step) << shift) - _current;
+                if (ticks == 0 || due < ticks) {
+                    ticks = due;
+                }
+                break;
+            }
+        }
+    }
+
+    long wait = (long) (_baseMs + (unsigned long) ticks * WS_TIMER_TICK_MS - nowMs);
+    return wait > 0 ? wait : 0;
+}
+
+size_t WebSocketTimerWheel::advance(unsigned long nowMs, WebSocketTimerCallback callback, void *context) {
+    size_t fired = 0;
+
+    while ((long) (nowMs - _baseMs) >= WS_TIMER_TICK_MS) {
+        if (_armed == 0) {
+            // Nothing to move or fire: skip straight to now
+            unsigned long ticks = (nowMs - _baseMs) / WS_TIMER_TICK_MS;
+
+            _current += (uint32_t) ticks;
+            _baseMs += ticks * WS_TIMER_TICK_MS;
+            break;
+        }
+
+        _current++;
+        _baseMs += WS_TIMER_TICK_MS;
+
+        // Highest level first, so what it hands down is cascaded again
+        int level = 1;
+        while (level < WS_TIMER_LEVELS
+               && ((_current >> ((level - 1) * WS_TIMER_SLOT_BITS)) & (WS_TIMER_SLOTS - 1)) == 0) {
+            level++;
+        }
+        while (--level > 0) {
+            cascade(level);
+        }
+
+        WebSocketTimer &head = _slots[0][_current & (WS_TIMER_SLOTS - 1)];
+        while (head.next != &head) {
+            WebSocketTimer &timer = *head.next;
+
+            unlink(timer);
+            fired++;
+            callback(context, timer);
+        }
+    }
+
+    return fired;
+}
@@ -0,0 +1,87 @@
+/*
+ *  WebSocketTimer.h
+ *
+ *  Description:
+ *      Hierarchical timer wheel for per-connection deadlines: handshakes,
+ *      idle timeouts, keepalive pings. Timers are intrusive list nodes kept
+ *      in the owner (e.g. a reactor connection), so arming, re-arming and
+ *      cancelling are O(1) and never allocate. advance() does a constant
+ *      amount of work per elapsed tick plus the work for the timers that
+ *      are due, however many timers are armed.
+ *
+ *      Level 0 has one slot per tick; each further level covers 64 times
+ *      the span of the one below, and its timers are moved down a level
+ *      when the wheel below wraps. With a 10 ms tick four levels reach out
+ *      to about 46 hours; later deadlines fire then and can be re-armed.
+ *
+ *      Time is whatever clock the caller passes in milliseconds: millis()
+ *      on the device, which is monotonic on Linux hosts too. Wrapping is
+ *      handled as long as no deadline is more than half the range away.
+ */
+
+#ifndef WEBSOCKETTIMER_H_
+#define WEBSOCKETTIMER_H_
+
+#include <Arduino.h>
+
+// Resolution of the wheel. Timers fire up to one tick late.
+#ifndef WS_TIMER_TICK_MS
+#define WS_TIMER_TICK_MS 10
+#endif
+
+#define WS_TIMER_LEVELS 4
+#define WS_TIMER_SLOT_BITS 6
+#define WS_TIMER_SLOTS (1 << WS_TIMER_SLOT_BITS)
+
+class WebSocketTimerWheel;
+
+struct WebSocketTimer {
+    WebSocketTimer() : prev(NULL), next(NULL), expires(0), owner(NULL), armed(false) {}
+
+    WebSocketTimer *prev;
+    WebSocketTimer *next;
+    uint32_t expires;   // in ticks
+    void *owner;        // for the expiry callback
+    bool armed;
+};
+
+typedef void (*WebSocketTimerCallback)(void *context, WebSocketTimer &timer);
+
+class WebSocketTimerWheel {
+public:
+    WebSocketTimerWheel();
+
+    // Start counting from nowMs. Timers still armed are dropped.
+    void begin(unsigned long nowMs);
+
+    // Arm (or re-arm) timer to fire once at atMs. A deadline already
+    // passed fires on the next tick.
+    void schedule(WebSocketTimer &timer, unsigned long atMs);
+    void cancel(WebSocketTimer &timer);
+
+    // Move the wheel up to nowMs and call callback for every timer that
+    // came due, after disarming it. The callback may arm and cancel timers,
+    // including the one it was called for.
+    size_t advance(unsigned long nowMs, WebSocketTimerCallback callback, void *context);
+
+    // Milliseconds from nowMs until advance() next has a timer to fire or
+    // to move down a level, 0 if that is already due, -1 with none armed.
+    // Never later than the earliest deadline, so a caller can sleep that
+    // long and call advance() when it wakes.
+    long nextExpiry(unsigned long nowMs) const;
+
+    size_t armed() const { return _armed; }
+
+private:
+    // Circular lists, each headed by a node that is never armed
+    WebSocketTimer _slots[WS_TIMER_LEVELS][WS_TIMER_SLOTS];
+    uint32_t _current;      // last tick processed
+    unsigned long _baseMs;  // when that tick began
+    size_t _armed;
+
+    void insert(WebSocketTimer &timer);
+    void unlink(WebSocketTimer &timer);
+    void cascade(int level);
+};
+
+#endif
@@ -0,0 +1,1015 @@
+//#define DEBUGGING
+
+#include "WebSocketTls.h"
+
+#if WS_HAVE_TLS
+
+#include <stdio.h>
+
+#if WS_TLS_USE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#endif
+
+#if WS_TLS_USE_MBEDTLS && (defined(MBEDTLS_USE_PSA_CRYPTO) || defined(MBEDTLS_SSL_PROTO_TLS1_3))
+#include <psa/crypto.h>
+#endif
+#if WS_TLS_USE_MBEDTLS
+#if defined(ESP32)
+#include <lwip/sockets.h>
+#else
+#include <arpa/inet.h>
+#endif
+#endif
+
+// IP literals are neither sent as SNI nor checked as host names
+static bool isAddress(const char *host) {
+    for (const char *p = host; *p != '\0'; ++p) {
+        if (*p == ':') {
+            return true;
+        }
+        if (*p != '.' && (*p < '0' || *p > '9')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+WebSocketTlsContext::WebSocketTlsContext() {
+    _server = false;
+    _ready = false;
+    _verify = false;
+    _fullHandshakes = 0;
+    _resumedHandshakes = 0;
+    _useCounter = 0;
+    for (size_t i = 0; i < WS_TLS_SESSION_CACHE; ++i) {
+        _sessions[i].valid = false;
+#if WS_TLS_USE_MBEDTLS
+        mbedtls_ssl_session_init(&_sessions[i].session);
+#else
+        _sessions[i].session = NULL;
+#endif
+    }
+#if WS_TLS_USE_MBEDTLS
+    _sessionFound = false;
+    initCommon();
+#else
+    _ctx = NULL;
+#endif
+}
+
+WebSocketTlsContext::~WebSocketTlsContext() {
+    clearSessions();
+#if WS_TLS_USE_MBEDTLS
+    freeCommon();
+#else
+    end();
+#endif
+}
+
+void WebSocketTlsContext::clearSessions() {
+    for (size_t i = 0; i < WS_TLS_SESSION_CACHE; ++i) {
+        dropSession(_sessions[i]);
+    }
+}
+
+WebSocketTlsContext::CachedSession *WebSocketTlsContext::findSession(const char *host, uint16_t port) {
+    for (size_t i = 0; i < WS_TLS_SESSION_CACHE; ++i) {
+        CachedSession &entry = _sessions[i];
+
+        if (entry.valid && entry.port == port && strcmp(entry.host, host) == 0) {
+            entry.used = ++_useCounter;
+            return &entry;
+        }
+    }
+    return NULL;
+}
+
+// The entry for host and port, else a free one, else the least recently used
+WebSocketTlsContext::CachedSession *WebSocketTlsContext::claimSession(const char *host, uint16_t port) {
+    CachedSession *victim = &_sessions[0];
+
+    for (size_t i = 0; i < WS_TLS_SESSION_CACHE; ++i) {
+        CachedSession &entry = _sessions[i];
+
+        if (entry.valid && entry.port == port && strcmp(entry.host, host) == 0) {
+            victim = &entry;
+            break;
+        }
+        if (!entry.valid) {
+            if (victim->valid) {
+                victim = &entry;
+            }
+        } else if (victim->valid && entry.used < victim->used) {
+            victim = &entry;
+        }
+    }
+
+    dropSession(*victim);
+    strncpy(victim->host, host, sizeof(victim->host) - 1);
+    victim->host[sizeof(victim->host) - 1] = '\0';
+    victim->port = port;
+    victim->used = ++_useCounter;
+    return victim;
+}
+
+void WebSocketTlsContext::dropSession(CachedSession &entry) {
+#if WS_TLS_USE_MBEDTLS
+    if (entry.valid) {
+        mbedtls_ssl_session_free(&entry.session);
+        mbedtls_ssl_session_init(&entry.session);
+    }
+#else
+    if (entry.session != NULL) {
+        SSL_SESSION_free(entry.session);
+        entry.session = NULL;
+    }
+#endif
+    entry.valid = false;
+}
+
+#if WS_TLS_USE_MBEDTLS
+
+void WebSocketTlsContext::initCommon() {
+    mbedtls_ssl_config_init(&_config);
+    mbedtls_entropy_init(&_entropy);
+    mbedtls_ctr_drbg_init(&_drbg);
+    mbedtls_x509_crt_init(&_ca);
+    mbedtls_x509_crt_init(&_cert);
+    mbedtls_pk_init(&_key);
+#if defined(MBEDTLS_SSL_CACHE_C)
+    mbedtls_ssl_cache_init(&_cache);
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_init(&_tickets);
+#endif
+}
+
+void WebSocketTlsContext::freeCommon() {
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_free(&_tickets);
+#endif
+#if defined(MBEDTLS_SSL_CACHE_C)
+    mbedtls_ssl_cache_free(&_cache);
+#endif
+    mbedtls_pk_free(&_key);
+    mbedtls_x509_crt_free(&_cert);
+    mbedtls_x509_crt_free(&_ca);
+    mbedtls_ctr_drbg_free(&_drbg);
+    mbedtls_entropy_free(&_entropy);
+    mbedtls_ssl_config_free(&_config);
+}
+
+void WebSocketTlsContext::end() {
+    clearSessions();
+    freeCommon();
+    initCommon();
+    _ready = false;
+}
+
+bool WebSocketTlsContext::beginCommon(int endpoint) {
+    static const char personal[] = "WebSocketTls";
+
+#if defined(MBEDTLS_USE_PSA_CRYPTO) || defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    // TLS 1.3 and the PSA build take their keys from PSA, which must be up
+    // before the first handshake; a second call is harmless
+    if (psa_crypto_init() != PSA_SUCCESS) {
+        return false;
+    }
+#endif
+    if (mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy,
+                              (const unsigned char *) personal, sizeof(personal) - 1) != 0) {
+        return false;
+    }
+    if (mbedtls_ssl_config_defaults(&_config, endpoint, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+        return false;
+    }
+    mbedtls_ssl_conf_rng(&_config, mbedtls_ctr_drbg_random, &_drbg);
+    return true;
+}
+
+bool WebSocketTlsContext::beginClient(const char *caPem) {
+    end();
+    if (!beginCommon(MBEDTLS_SSL_IS_CLIENT)) {
+        end();
+        return false;
+    }
+
+    if (caPem != NULL) {
+        // The length given to the PEM parser includes the terminator
+        if (mbedtls_x509_crt_parse(&_ca, (const unsigned char *) caPem, strlen(caPem) + 1) != 0) {
+#ifdef DEBUGGING
+            Serial.println(F("Bad CA certificate"));
+#endif
+            end();
+            return false;
+        }
+        mbedtls_ssl_conf_ca_chain(&_config, &_ca, NULL);
+        mbedtls_ssl_conf_authmode(&_config, MBEDTLS_SSL_VERIFY_REQUIRED);
+    } else {
+        // Optional rather than none so the chain still reaches the verify
+        // callback, which tells a full handshake from a resumed one
+        mbedtls_ssl_conf_authmode(&_config, MBEDTLS_SSL_VERIFY_OPTIONAL);
+    }
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&_config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+#if defined(MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED)
+    // TLS 1.3 tickets come after the handshake; fill() keeps them
+    mbedtls_ssl_conf_tls13_enable_signal_new_session_tickets(&_config,
+                                                             MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED);
+#endif
+
+    _server = false;
+    _verify = caPem != NULL;
+    _ready = true;
+    return true;
+}
+
+bool WebSocketTlsContext::beginServer(const char *certPem, const char *keyPem) {
+    int ret;
+
+    end();
+    if (certPem == NULL || keyPem == NULL || !beginCommon(MBEDTLS_SSL_IS_SERVER)) {
+        end();
+        return false;
+    }
+
+    ret = mbedtls_x509_crt_parse(&_cert, (const unsigned char *) certPem, strlen(certPem) + 1);
+    if (ret == 0) {
+#if MBEDTLS_VERSION_MAJOR >= 3
+        ret = mbedtls_pk_parse_key(&_key, (const unsigned char *) keyPem, strlen(keyPem) + 1, NULL, 0,
+                                   mbedtls_ctr_drbg_random, &_drbg);
+#else
+        ret = mbedtls_pk_parse_key(&_key, (const unsigned char *) keyPem, strlen(keyPem) + 1, NULL, 0);
+#endif
+    }
+    if (ret == 0) {
+        ret = mbedtls_ssl_conf_own_cert(&_config, &_cert, &_key);
+    }
+#if defined(MBEDTLS_SSL_TICKET_C)
+    if (ret == 0) {
+        ret = mbedtls_ssl_ticket_setup(&_tickets, mbedtls_ctr_drbg_random, &_drbg,
+                                       MBEDTLS_CIPHER_AES_256_GCM, 86400);
+    }
+#endif
+    if (ret != 0) {
+#ifdef DEBUGGING
+        Serial.print(F("Bad server certificate or key: "));
+        Serial.println(ret);
+#endif
+        end();
+        return false;
+    }
+
+#if defined(MBEDTLS_SSL_CACHE_C)
+    mbedtls_ssl_conf_session_cache(&_config, this, cacheGet, cacheSet);
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_conf_session_tickets_cb(&_config, ticketWrite, ticketParse, this);
+#endif
+
+    _server = true;
+    _verify = false;
+    _ready = true;
+    return true;
+}
+
+// The cache and ticket callbacks only pass through; the wrappers note
+// whether the handshake under way found a session to resume
+#if defined(MBEDTLS_SSL_CACHE_C)
+#if MBEDTLS_VERSION_MAJOR >= 3
+int WebSocketTlsContext::cacheGet(void *context, const unsigned char *id, size_t idLength,
+                                  mbedtls_ssl_session *session) {
+    WebSocketTlsContext *self = (WebSocketTlsContext *) context;
+    int ret = mbedtls_ssl_cache_get(&self->_cache, id, idLength, session);
+
+    if (ret == 0) {
+        self->_sessionFound = true;
+    }
+    return ret;
+}
+
+int WebSocketTlsContext::cacheSet(void *context, const unsigned char *id, size_t idLength,
+                                  const mbedtls_ssl_session *session) {
+    return mbedtls_ssl_cache_set(&((WebSocketTlsContext *) context)->_cache, id, idLength, session);
+}
+#else
+int WebSocketTlsContext::cacheGet(void *context, mbedtls_ssl_session *session) {
+    WebSocketTlsContext *self = (WebSocketTlsContext *) context;
+    int ret = mbedtls_ssl_cache_get(&self->_cache, session);
+
+    if (ret == 0) {
+        self->_sessionFound = true;
+    }
+    return ret;
+}
+
+int WebSocketTlsContext::cacheSet(void *context, const mbedtls_ssl_session *session) {
+    return mbedtls_ssl_cache_set(&((WebSocketTlsContext *) context)->_cache, session);
+}
+#endif
+#endif
+
+#if defined(MBEDTLS_SSL_TICKET_C)
+int WebSocketTlsContext::ticketWrite(void *context, const mbedtls_ssl_session *session, unsigned char *start,
+                                     const unsigned char *end, size_t *length, uint32_t *lifetime) {
+    return mbedtls_ssl_ticket_write(&((WebSocketTlsContext *) context)->_tickets, session, start, end,
+                                    length, lifetime);
+}
+
+int WebSocketTlsContext::ticketParse(void *context, mbedtls_ssl_session *session, unsigned char *buf,
+                                     size_t length) {
+    WebSocketTlsContext *self = (WebSocketTlsContext *) context;
+    int ret = mbedtls_ssl_ticket_parse(&self->_tickets, session, buf, length);
+
+    if (ret == 0) {
+        self->_sessionFound = true;
+    }
+    return ret;
+}
+#endif
+
+#else
+
+void WebSocketTlsContext::end() {
+    clearSessions();
+    if (_ctx != NULL) {
+        SSL_CTX_free(_ctx);
+        _ctx = NULL;
+    }
+    _ready = false;
+}
+
+bool WebSocketTlsContext::beginClient(const char *caPem) {
+    end();
+    _ctx = SSL_CTX_new(TLS_client_method());
+    if (_ctx == NULL) {
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+
+    if (caPem != NULL) {
+        X509_STORE *store = SSL_CTX_get_cert_store(_ctx);
+        BIO *bio = BIO_new_mem_buf(caPem, -1);
+        X509 *cert;
+        int count = 0;
+
+        while (bio != NULL && (cert = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
+            if (X509_STORE_add_cert(store, cert) == 1) {
+                count++;
+            }
+            X509_free(cert);
+        }
+        BIO_free(bio);
+        ERR_clear_error();
+
+        if (count == 0) {
+#ifdef DEBUGGING
+            Serial.println(F("Bad CA certificate"));
+#endif
+            end();
+            return false;
+        }
+        SSL_CTX_set_verify(_ctx, SSL_VERIFY_PEER, NULL);
+    } else {
+        SSL_CTX_set_verify(_ctx, SSL_VERIFY_NONE, NULL);
+    }
+
+    // Sessions are kept per host and port here, not in OpenSSL's cache;
+    // TLS 1.3 tickets arrive after the handshake, hence the callback
+    SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(_ctx, WebSocketTlsClient::newSessionCallback);
+
+    _server = false;
+    _verify = caPem != NULL;
+    _ready = true;
+    return true;
+}
+
+bool WebSocketTlsContext::beginServer(const char *certPem, const char *keyPem) {
+    BIO *bio;
+    X509 *cert;
+    EVP_PKEY *key;
+    bool ok;
+
+    end();
+    if (certPem == NULL || keyPem == NULL) {
+        return false;
+    }
+    _ctx = SSL_CTX_new(TLS_server_method());
+    if (_ctx == NULL) {
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+
+    // The first certificate is the server's own, the rest its chain
+    bio = BIO_new_mem_buf(certPem, -1);
+    cert = bio != NULL ? PEM_read_bio_X509(bio, NULL, NULL, NULL) : NULL;
+    ok = cert != NULL && SSL_CTX_use_certificate(_ctx, cert) == 1;
+    X509_free(cert);
+    while (ok && (cert = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
+        if (SSL_CTX_add_extra_chain_cert(_ctx, cert) != 1) {
+            X509_free(cert);
+            ok = false;
+        }
+    }
+    BIO_free(bio);
+
+    if (ok) {
+        bio = BIO_new_mem_buf(keyPem, -1);
+        key = bio != NULL ? PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL) : NULL;
+        ok = key != NULL && SSL_CTX_use_PrivateKey(_ctx, key) == 1 && SSL_CTX_check_private_key(_ctx) == 1;
+        EVP_PKEY_free(key);
+        BIO_free(bio);
+    }
+    ERR_clear_error();
+
+    if (!ok) {
+#ifdef DEBUGGING
+        Serial.println(F("Bad server certificate or key"));
+#endif
+        end();
+        return false;
+    }
+
+    // Session IDs are cached and tickets issued; one ticket is enough for
+    // a client that keeps a single session per server
+    SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(_ctx, (const unsigned char *) "WebSocketTls", 12);
+    SSL_CTX_set_num_tickets(_ctx, 1);
+
+    _server = true;
+    _verify = false;
+    _ready = true;
+    return true;
+}
+
+#endif
+
+WebSocketTlsClient::WebSocketTlsClient(WebSocketTlsContext &context, Client &transport) {
+    _context = &context;
+    _transport = &transport;
+    _established = false;
+    _eof = false;
+    _failed = false;
+    _resumed = false;
+    _offered = false;
+    _handshakeMicros = 0;
+    _host[0] = '\0';
+    _port = 0;
+    _outStart = 0;
+    _outEnd = 0;
+    _plainStart = 0;
+    _plainEnd = 0;
+#if WS_TLS_USE_MBEDTLS
+    _sslInit = false;
+    _certificateSeen = false;
+#else
+    _ssl = NULL;
+    _rbio = NULL;
+    _wbio = NULL;
+#endif
+}
+
+WebSocketTlsClient::~WebSocketTlsClient() {
+    release();
+}
+
+void WebSocketTlsClient::release() {
+#if WS_TLS_USE_MBEDTLS
+    if (_sslInit) {
+        mbedtls_ssl_free(&_ssl);
+        _sslInit = false;
+    }
+#else
+    if (_ssl != NULL) {
+        // Frees both BIOs with it
+        SSL_free(_ssl);
+        _ssl = NULL;
+        _rbio = NULL;
+        _wbio = NULL;
+    }
+#endif
+    _established = false;
+    _outStart = 0;
+    _outEnd = 0;
+    _plainStart = 0;
+    _plainEnd = 0;
+}
+
+int WebSocketTlsClient::connect(IPAddress ip, uint16_t port) {
+    uint32_t address = (uint32_t) ip;
+
+    release();
+    // Stored in network order, as the socket takes it
+    snprintf(_host, sizeof(_host), "%u.%u.%u.%u", (unsigned) (address & 0xFF), (unsigned) ((address >> 8) & 0xFF),
+             (unsigned) ((address >> 16) & 0xFF), (unsigned) (address >> 24));
+    _port = port;
+
+    if (!_context->_ready || _context->_server || !_transport->connect(ip, port)) {
+        return 0;
+    }
+    return start(false);
+}
+
+int WebSocketTlsClient::connect(const char *host, uint16_t port) {
+    release();
+    if (strlen(host) >= sizeof(_host)) {
+#ifdef DEBUGGING
+        Serial.println(F("Host name too long for TLS"));
+#endif
+        return 0;
+    }
+    strcpy(_host, host);
+    _port = port;
+
+    if (!_context->_ready || _context->_server || !_transport->connect(host, port)) {
+        return 0;
+    }
+    return start(false);
+}
+
+int WebSocketTlsClient::accept() {
+    release();
+    _host[0] = '\0';
+    _port = 0;
+
+    if (!_context->_ready || !_context->_server || !_transport->connected()) {
+        return 0;
+    }
+    return start(true);
+}
+
+bool WebSocketTlsClient::start(bool server) {
+    WebSocketTlsContext::CachedSession *cached = NULL;
+
+    _eof = false;
+    _failed = false;
+    _resumed = false;
+    _offered = false;
+
+#if WS_TLS_USE_MBEDTLS
+    mbedtls_ssl_init(&_ssl);
+    _sslInit = true;
+    _certificateSeen = false;
+    _context->_sessionFound = false;
+
+    bool ok = mbedtls_ssl_setup(&_ssl, &_context->_config) == 0;
+    if (ok && !server) {
+        // NULL for an address says so explicitly; 3.6.3 and later refuse
+        // to verify a chain when no host name was set at all. verifyCallback()
+        // checks the address instead
+        ok = mbedtls_ssl_set_hostname(&_ssl, isAddress(_host) ? NULL : _host) == 0;
+        mbedtls_ssl_set_verify(&_ssl, verifyCallback, this);
+        cached = _context->findSession(_host, _port);
+        if (ok && cached != NULL) {
+            _offered = mbedtls_ssl_set_session(&_ssl, &cached->session) == 0;
+        }
+    }
+    mbedtls_ssl_set_bio(&_ssl, this, sendCallback, recvCallback, NULL);
+#else
+    bool ok;
+
+    _ssl = SSL_new(_context->_ctx);
+    _rbio = BIO_new(BIO_s_mem());
+    _wbio = BIO_new(BIO_s_mem());
+    ok = _ssl != NULL && _rbio != NULL && _wbio != NULL;
+    if (!ok) {
+        BIO_free(_rbio);
+        BIO_free(_wbio);
+        _rbio = NULL;
+        _wbio = NULL;
+    } else {
+        SSL_set_bio(_ssl, _rbio, _wbio);
+        SSL_set_app_data(_ssl, this);
+        if (server) {
+            SSL_set_accept_state(_ssl);
+        } else {
+            SSL_set_connect_state(_ssl);
+            if (isAddress(_host)) {
+                if (_context->_verify) {
+                    ok = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(_ssl), _host) == 1;
+                }
+            } else {
+                ok = SSL_set_tlsext_host_name(_ssl, _host) == 1;
+                if (ok && _context->_verify) {
+                    ok = SSL_set1_host(_ssl, _host) == 1;
+                }
+            }
+            cached = _context->findSession(_host, _port);
+            if (ok && cached != NULL) {
+                _offered = SSL_set_session(_ssl, cached->session) == 1;
+            }
+        }
+    }
+#endif
+
+    if (!ok || !handshake()) {
+        // A session the server no longer takes is not offered again
+        if (cached != NULL && _offered) {
+            _context->dropSession(*cached);
+        }
+        release();
+        _transport->stop();
+        return false;
+    }
+    return true;
+}
+
+bool WebSocketTlsClient::handshake() {
+    unsigned long start = millis();
+    unsigned long began = micros();
+
+    for (;;) {
+        bool progress;
+#if WS_TLS_USE_MBEDTLS
+        int ret = mbedtls_ssl_handshake(&_ssl);
+
+        flushOut();
+        if (ret == 0) {
+            break;
+        }
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+#ifdef DEBUGGING
+            Serial.print(F("TLS handshake failed: -0x"));
+            Serial.println(-ret, HEX);
+#endif
+            return false;
+        }
+        progress = _transport->available() > 0;
+#else
+        int ret = SSL_do_handshake(_ssl);
+
+        flushOut();
+        if (ret == 1) {
+            break;
+        }
+        int error = SSL_get_error(_ssl, ret);
+        if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+#ifdef DEBUGGING
+            char text[120];
+            ERR_error_string_n(ERR_peek_last_error(), text, sizeof(text));
+            Serial.print(F("TLS handshake failed: "));
+            Serial.println(text);
+#endif
+            ERR_clear_error();
+            return false;
+        }
+        progress = pull();
+#endif
+
+        if (!progress) {
+            if (!_transport->connected() || millis() - start >= WS_TLS_HANDSHAKE_TIMEOUT_MS) {
+#ifdef DEBUGGING
+                Serial.println(F("TLS handshake timed out"));
+#endif
+                return false;
+            }
+            delay(1);
+        }
+    }
+
+    _handshakeMicros = micros() - began;
+    _established = true;
+
+#if WS_TLS_USE_MBEDTLS
+    if (_context->_server) {
+        _resumed = _context->_sessionFound;
+    } else {
+        // A resumed handshake carries no certificate to verify
+        _resumed = _offered && !_certificateSeen;
+
+        // Kept for next time; a resumed session may come with a new ticket
+        saveSession();
+    }
+#else
+    _resumed = SSL_session_reused(_ssl) == 1;
+#endif
+
+    if (_resumed) {
+        _context->_resumedHandshakes++;
+    } else {
+        _context->_fullHandshakes++;
+    }
+#ifdef DEBUGGING
+    Serial.print(_resumed ? F("TLS session resumed in ") : F("TLS handshake done in "));
+    Serial.print(_handshakeMicros);
+    Serial.println(F(" us"));
+#endif
+    return true;
+}
+
+bool WebSocketTlsClient::flushOut() {
+    for (;;) {
+        if (_outStart == _outEnd) {
+            _outStart = 0;
+            _outEnd = 0;
+#if WS_TLS_USE_MBEDTLS
+            return true;
+#else
+            int count = _wbio != NULL ? BIO_read(_wbio, _out, sizeof(_out)) : 0;
+            if (count <= 0) {
+                return true;
+            }
+            _outEnd = count;
+#endif
+        }
+
+        size_t written = _transport->write(_out + _outStart, _outEnd - _outStart);
+        if (written == 0) {
+            return false;
+        }
+        _outStart += written;
+    }
+}
+
+#if WS_TLS_USE_MBEDTLS
+
+int WebSocketTlsClient::sendCallback(void *context, const unsigned char *buf, size_t len) {
+    WebSocketTlsClient *self = (WebSocketTlsClient *) context;
+    size_t room;
+
+    self->flushOut();
+    if (self->_outStart > 0) {
+        memmove(self->_out, self->_out + self->_outStart, self->_outEnd - self->_outStart);
+        self->_outEnd -= self->_outStart;
+        self->_outStart = 0;
+    }
+
+    // Staged whole, so a record is never left half written
+    room = sizeof(self->_out) - self->_outEnd;
+    if (room == 0) {
+        return MBEDTLS_ERR_SSL_WANT_WRITE;
+    }
+    if (len > room) {
+        len = room;
+    }
+    memcpy(self->_out + self->_outEnd, buf, len);
+    self->_outEnd += len;
+    self->flushOut();
+    return (int) len;
+}
+
+int WebSocketTlsClient::recvCallback(void *context, unsigned char *buf, size_t len) {
+    WebSocketTlsClient *self = (WebSocketTlsClient *) context;
+    int count = self->_transport->available();
+
+    if (count <= 0) {
+        return self->_transport->connected() ? MBEDTLS_ERR_SSL_WANT_READ : 0;
+    }
+    if ((size_t) count > len) {
+        count = len;
+    }
+    count = self->_transport->read(buf, count);
+    return count > 0 ? count : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+void WebSocketTlsClient::saveSession() {
+    WebSocketTlsContext::CachedSession *entry = _context->claimSession(_host, _port);
+
+    entry->valid = mbedtls_ssl_get_session(&_ssl, &entry->session) == 0;
+}
+
+// Whether the certificate lists the address among its iPAddress names.
+// mbedTLS keeps every subjectAltName entry raw since 2.28; an iPAddress is
+// the context specific tag 7 around the 4 or 16 address bytes.
+static bool namesAddress(const mbedtls_x509_crt *crt, const char *host) {
+    uint8_t address[16];
+    size_t length = 4;
+
+    if (inet_pton(AF_INET, host, address) != 1) {
+        if (inet_pton(AF_INET6, host, address) != 1) {
+            return false;
+        }
+        length = 16;
+    }
+    for (const mbedtls_x509_sequence *name = &crt->subject_alt_names; name != NULL; name = name->next) {
+        if (name->buf.tag == (MBEDTLS_ASN1_CONTEXT_SPECIFIC | 7) && name->buf.len == length
+            && memcmp(name->buf.p, address, length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int WebSocketTlsClient::verifyCallback(void *context, mbedtls_x509_crt *crt, int depth, uint32_t *flags) {
+    WebSocketTlsClient *client = (WebSocketTlsClient *) context;
+
+    client->_certificateSeen = true;
+    // mbedTLS checks host names itself, but not addresses
+    if (depth == 0 && client->_context->_verify && isAddress(client->_host) && !namesAddress(crt, client->_host)) {
+        *flags |= MBEDTLS_X509_BADCERT_CN_MISMATCH;
+    }
+    return 0;
+}
+
+void WebSocketTlsClient::fill() {
+    while (_plainStart == _plainEnd && _established && !_eof && !_failed) {
+        int ret = mbedtls_ssl_read(&_ssl, _plain, sizeof(_plain));
+
+        if (ret > 0) {
+            _plainStart = 0;
+            _plainEnd = ret;
+        } else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            break;
+#if defined(MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET)
+        } else if (ret == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET) {
+            // The session from the handshake had no ticket to resume with
+            saveSession();
+            continue;
+#endif
+        } else if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            _eof = true;
+        } else {
+#ifdef DEBUGGING
+            Serial.print(F("TLS read failed: -0x"));
+            Serial.println(-ret, HEX);
+#endif
+            _failed = true;
+        }
+    }
+    flushOut();
+}
+
+size_t WebSocketTlsClient::write(const uint8_t *buf, size_t size) {
+    int ret;
+
+    // A record is only encrypted once the previous one is out
+    if (!_established || _failed || size == 0 || !flushOut()) {
+        return 0;
+    }
+    if (size > WS_TLS_RECORD) {
+        size = WS_TLS_RECORD;
+    }
+
+    ret = mbedtls_ssl_write(&_ssl, buf, size);
+    if (ret < 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            _failed = true;
+        }
+        return 0;
+    }
+    flushOut();
+    return ret;
+}
+
+#else
+
+int WebSocketTlsClient::newSessionCallback(SSL *ssl, SSL_SESSION *session) {
+    WebSocketTlsClient *self = (WebSocketTlsClient *) SSL_get_app_data(ssl);
+
+    if (self == NULL || self->_context->_server || !SSL_SESSION_is_resumable(session)) {
+        return 0;
+    }
+
+    // The cache takes over our reference
+    WebSocketTlsContext::CachedSession *entry = self->_context->claimSession(self->_host, self->_port);
+    entry->session = session;
+    entry->valid = true;
+    return 1;
+}
+
+bool WebSocketTlsClient::pull() {
+    uint8_t chunk[1024];
+    int count = _transport->available();
+
+    if (count <= 0) {
+        return false;
+    }
+    if ((size_t) count > sizeof(chunk)) {
+        count = sizeof(chunk);
+    }
+    count = _transport->read(chunk, count);
+    if (count <= 0) {
+        return false;
+    }
+    BIO_write(_rbio, chunk, count);
+    return true;
+}
+
+void WebSocketTlsClient::fill() {
+    while (_plainStart == _plainEnd && _established && !_eof && !_failed) {
+        int ret = SSL_read(_ssl, _plain, sizeof(_plain));
+
+        if (ret > 0) {
+            _plainStart = 0;
+            _plainEnd = ret;
+            break;
+        }
+
+        int error = SSL_get_error(_ssl, ret);
+        if (error == SSL_ERROR_WANT_READ) {
+            // Tickets and key updates may want an answer
+            flushOut();
+            if (!pull()) {
+                if (!_transport->connected()) {
+                    _eof = true;
+                }
+                break;
+            }
+        } else if (error == SSL_ERROR_ZERO_RETURN) {
+            _eof = true;
+        } else {
+#ifdef DEBUGGING
+            Serial.println(F("TLS read failed"));
+#endif
+            ERR_clear_error();
+            _failed = true;
+        }
+    }
+    flushOut();
+}
+
+size_t WebSocketTlsClient::write(const uint8_t *buf, size_t size) {
+    int ret;
+
+    // A record is only encrypted once the previous one is out
+    if (!_established || _failed || size == 0 || !flushOut()) {
+        return 0;
+    }
+    if (size > WS_TLS_RECORD) {
+        size = WS_TLS_RECORD;
+    }
+
+    ret = SSL_write(_ssl, buf, size);
+    if (ret <= 0) {
+        ERR_clear_error();
+        _failed = true;
+        return 0;
+    }
+    flushOut();
+    return ret;
+}
+
+#endif
+
+size_t WebSocketTlsClient::write(uint8_t bite) {
+    return write(&bite, 1);
+}
+
+int WebSocketTlsClient::available() {
+    if (_plainStart == _plainEnd) {
+        fill();
+    }
+    return _plainEnd - _plainStart;
+}
+
+int WebSocketTlsClient::read() {
+    if (available() <= 0) {
+        return -1;
+    }
+    return _plain[_plainStart++];
+}
+
+int WebSocketTlsClient::read(uint8_t *buf, size_t size) {
+    size_t count = available();
+
+    if (count > size) {
+        count = size;
+    }
+    memcpy(buf, _plain + _plainStart, count);
+    _plainStart += count;
+    return count;
+}
+
+int WebSocketTlsClient::peek() {
+    if (available() <= 0) {
+        return -1;
+    }
+    return _plain[_plainStart];
+}
+
+void WebSocketTlsClient::flush() {
+    flushOut();
+    _transport->flush();
+}
+
+void WebSocketTlsClient::stop() {
+    if (_established && !_failed) {
+#if WS_TLS_USE_MBEDTLS
+        mbedtls_ssl_close_notify(&_ssl);
+#else
+        SSL_shutdown(_ssl);
+#endif
+        flushOut();
+    }
+    release();
+    _transport->stop();
+}
+
+uint8_t WebSocketTlsClient::connected() {
+    if (_plainStart < _plainEnd) {
+        return 1;
+    }
+    return _established && !_eof && !_failed && _transport->connected();
+}
+
+WebSocketTlsClient::operator bool() {
+    return connected();
+}
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ *  WebSocketTls.h
+ *
+ *  Description:
+ *      TLS for wss://, as an Arduino Client layered over another Client
+ *      (WiFiClient, EthernetClient, PosixClient), so WebSocketClient and
+ *      WebSocketServer run over it unchanged. mbedTLS is used on the ESP32
+ *      (and on Linux when built with WS_TLS_MBEDTLS=1), OpenSSL on Linux
+ *      when built with WS_TLS_OPENSSL=1 (link -lssl -lcrypto).
+ *
+ *      A WebSocketTlsContext holds the certificates and, in the client
+ *      role, the sessions of the last servers connected to, keyed by host
+ *      and port. connect() offers the cached session, so a reconnect to
+ *      the same server resumes with a ticket or session ID instead of a
+ *      full handshake with its certificate checks and key exchange. In the
+ *      server role the context issues tickets and keeps a session ID cache.
+ *
+ *      Ciphertext is staged in a fixed buffer per connection. write()
+ *      encrypts no more than fits and reports the rest as not taken, which
+ *      the send queue already handles, so a slow socket never blocks it.
+ */
+
+#ifndef WEBSOCKETTLS_H_
+#define WEBSOCKETTLS_H_
+
+#include <Arduino.h>
+#include "Client.h"
+
+#if defined(ESP32) || WS_TLS_MBEDTLS
+#define WS_HAVE_TLS 1
+#define WS_TLS_USE_MBEDTLS 1
+#elif defined(__linux__) && WS_TLS_OPENSSL
+#define WS_HAVE_TLS 1
+#define WS_TLS_USE_OPENSSL 1
+#endif
+
+#if WS_HAVE_TLS
+
+#if WS_TLS_USE_MBEDTLS
+#include <mbedtls/version.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+#if defined(MBEDTLS_SSL_CACHE_C)
+#include <mbedtls/ssl_cache.h>
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+#include <mbedtls/ssl_ticket.h>
+#endif
+#else
+struct ssl_ctx_st;
+struct ssl_st;
+struct ssl_session_st;
+struct bio_st;
+#endif
+
+// Servers whose sessions the client role keeps for resumption.
+#ifndef WS_TLS_SESSION_CACHE
+#define WS_TLS_SESSION_CACHE 4
+#endif
+
+// Longest host name a cached session is keyed by.
+#ifndef WS_TLS_HOST_LENGTH
+#define WS_TLS_HOST_LENGTH 64
+#endif
+
+// Plaintext bytes encrypted per write() call, i.e. per record.
+#ifndef WS_TLS_RECORD
+#define WS_TLS_RECORD 4096
+#endif
+
+// Staged ciphertext: a full record plus header, IV and tag.
+#ifndef WS_TLS_OUT_BUFFER
+#define WS_TLS_OUT_BUFFER (WS_TLS_RECORD + 128)
+#endif
+
+// Decrypted bytes buffered for available()/read().
+#ifndef WS_TLS_PLAIN_BUFFER
+#define WS_TLS_PLAIN_BUFFER 512
+#endif
+
+// How long connect() and accept() wait for the TLS handshake.
+#ifndef WS_TLS_HANDSHAKE_TIMEOUT_MS
+#define WS_TLS_HANDSHAKE_TIMEOUT_MS 10000
+#endif
+
+class WebSocketTlsClient;
+
+class WebSocketTlsContext {
+public:
+    WebSocketTlsContext();
+    ~WebSocketTlsContext();
+
+    // Client role. caPem is the PEM bundle the server's chain must lead
+    // to, and the host name passed to connect() must match the
+    // certificate. NULL skips verification; only for testing.
+    bool beginClient(const char *caPem);
+    // Server role with a PEM certificate chain and its private key.
+    bool beginServer(const char *certPem, const char *keyPem);
+    void end();
+
+    // Forget the cached sessions; the next connect() does a full handshake.
+    void clearSessions();
+
+    // Handshakes completed in full and by resuming a session.
+    unsigned long fullHandshakes() const { return _fullHandshakes; }
+    unsigned long resumedHandshakes() const { return _resumedHandshakes; }
+
+private:
+    friend class WebSocketTlsClient;
+
+    struct CachedSession {
+        char host[WS_TLS_HOST_LENGTH];
+        uint16_t port;
+        bool valid;
+        unsigned long used;     // for evicting the least recently used
+#if WS_TLS_USE_MBEDTLS
+        mbedtls_ssl_session session;
+#else
+        struct ssl_session_st *session;
+#endif
+    };
+
+    bool _server;
+    bool _ready;
+    bool _verify;
+    unsigned long _fullHandshakes;
+    unsigned long _resumedHandshakes;
+    unsigned long _useCounter;
+    CachedSession _sessions[WS_TLS_SESSION_CACHE];
+
+#if WS_TLS_USE_MBEDTLS
+    mbedtls_ssl_config _config;
+    mbedtls_entropy_context _entropy;
+    mbedtls_ctr_drbg_context _drbg;
+    mbedtls_x509_crt _ca;
+    mbedtls_x509_crt _cert;
+    mbedtls_pk_context _key;
+#if defined(MBEDTLS_SSL_CACHE_C)
+    mbedtls_ssl_cache_context _cache;
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_context _tickets;
+#endif
+    // Set while a server handshake finds its session in the cache or a
+    // ticket; handshakes on one context run one at a time.
+    bool _sessionFound;
+
+    void initCommon();
+    void freeCommon();
+    bool beginCommon(int endpoint);
+#if defined(MBEDTLS_SSL_CACHE_C)
+#if MBEDTLS_VERSION_MAJOR >= 3
+    static int cacheGet(void *context, const unsigned char *id, size_t idLength,
+                        mbedtls_ssl_session *session);
+    static int cacheSet(void *context, const unsigned char *id, size_t idLength,
+                        const mbedtls_ssl_session *session);
+#else
+    static int cacheGet(void *context, mbedtls_ssl_session *session);
+    static int cacheSet(void *context, const mbedtls_ssl_session *session);
+#endif
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    static int ticketWrite(void *context, const mbedtls_ssl_session *session, unsigned char *start,
+                           const unsigned char *end, size_t *length, uint32_t *lifetime);
+    static int ticketParse(void *context, mbedtls_ssl_session *session, unsigned char *buf,
+                           size_t length);
+#endif
+#else
+    struct ssl_ctx_st *_ctx;
+#endif
+
+    CachedSession *findSession(const char *host, uint16_t port);
+    CachedSession *claimSession(const char *host, uint16_t port);
+    void dropSession(CachedSession &entry);
+};
+
+class WebSocketTlsClient : public Client {
+public:
+    // transport carries the ciphertext and must outlive this object.
+    WebSocketTlsClient(WebSocketTlsContext &context, Client &transport);
+    virtual ~WebSocketTlsClient();
+
+    // Client role: connect the transport, then run the TLS handshake,
+    // resuming the session cached for host and port if there is one.
+    virtual int connect(IPAddress ip, uint16_t port);
+    virtual int connect(const char *host, uint16_t port);
+    // Server role: run the TLS handshake on an accepted transport.
+    int accept();
+
+    virtual size_t write(uint8_t bite);
+    virtual size_t write(const uint8_t *buf, size_t size);
+    virtual int available();
+    virtual int read();
+    virtual int read(uint8_t *buf, size_t size);
+    virtual int peek();
+    virtual void flush();
+    // Sends close_notify and stops the transport.
+    virtual void stop();
+    virtual uint8_t connected();
+    virtual operator bool();
+
+    // The last handshake resumed a session, and how long it took.
+    bool resumed() const { return _resumed; }
+    unsigned long handshakeMicros() const { return _handshakeMicros; }
+
+private:
+    friend class WebSocketTlsContext;
+
+    WebSocketTlsContext *_context;
+    Client *_transport;
+    bool _established;
+    bool _eof;
+    bool _failed;
+    bool _resumed;
+    bool _offered;          // a cached session was offered
+    unsigned long _handshakeMicros;
+    char _host[WS_TLS_HOST_LENGTH];
+    uint16_t _port;
+
+    uint8_t _out[WS_TLS_OUT_BUFFER];
+    size_t _outStart;
+    size_t _outEnd;
+    uint8_t _plain[WS_TLS_PLAIN_BUFFER];
+    size_t _plainStart;
+    size_t _plainEnd;
+
+#if WS_TLS_USE_MBEDTLS
+    mbedtls_ssl_context _ssl;
+    bool _sslInit;
+    bool _certificateSeen;  // a full handshake verifies the chain
+
+    static int sendCallback(void *context, const unsigned char *buf, size_t len);
+    static int recvCallback(void *context, unsigned char *buf, size_t len);
+    static int verifyCallback(void *context, mbedtls_x509_crt *crt, int depth, uint32_t *flags);
+    // Cache the session for the next connect() to the same server.
+    void saveSession();
+#else
+    struct ssl_st *_ssl;
+    struct bio_st *_rbio;
+    struct bio_st *_wbio;
+
+    static int newSessionCallback(struct ssl_st *ssl, struct ssl_session_st *session);
+    // Hand received ciphertext to OpenSSL.
+    bool pull();
+#endif
+
+    // Set up the session and run the handshake; cleans up on failure.
+    bool start(bool server);
+    bool handshake();
+    void release();
+    // Send staged ciphertext. True once none is left.
+    bool flushOut();
+    // Decrypt into the plaintext buffer.
+    void fill();
+};
+
+#endif
+
+#endif
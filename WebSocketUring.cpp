@@ -0,0 +1,317 @@
+//#define DEBUGGING
+
+#include "WebSocketUring.h"
+
+#if WS_HAVE_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+static int uringSetup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uringRegister(int fd, unsigned opcode, void *arg, unsigned count) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+WebSocketUring::WebSocketUring() {
+    _fd = -1;
+    _queued = 0;
+    _sqRing = MAP_FAILED;
+    _cqRing = MAP_FAILED;
+    _sqRingSize = 0;
+    _cqRingSize = 0;
+    _sqes = (struct io_uring_sqe *) MAP_FAILED;
+    _sqesSize = 0;
+}
+
+WebSocketUring::~WebSocketUring() {
+    end();
+}
+
+bool WebSocketUring::begin(unsigned completions, void *buffer, size_t length) {
+    struct io_uring_params params;
+    struct iovec iov;
+
+    end();
+
+    // The kernel refuses a completion queue smaller than the submission queue
+    if (completions < WS_URING_ENTRIES) {
+        completions = WS_URING_ENTRIES;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = completions;
+
+    _fd = uringSetup(WS_URING_ENTRIES, &params);
+    if (_fd < 0) {
+#ifdef DEBUGGING
+        Serial.println(F("io_uring not available"));
+#endif
+        return false;
+    }
+
+    // Without these a full completion queue drops events, or sockets are
+    // served by kernel worker threads; epoll does better then
+    if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_FAST_POLL)) {
+        end();
+        return false;
+    }
+
+    _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (_cqRingSize > _sqRingSize) {
+            _sqRingSize = _cqRingSize;
+        }
+        _cqRingSize = 0;
+    }
+
+    _sqRing = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   _fd, IORING_OFF_SQ_RING);
+    if (_sqRing == MAP_FAILED) {
+        end();
+        return false;
+    }
+    if (_cqRingSize > 0) {
+        _cqRing = mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       _fd, IORING_OFF_CQ_RING);
+        if (_cqRing == MAP_FAILED) {
+            end();
+            return false;
+        }
+    }
+
+    _sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    _sqes = (struct io_uring_sqe *) mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (_sqes == MAP_FAILED) {
+        end();
+        return false;
+    }
+
+    uint8_t *sq = (uint8_t *) _sqRing;
+    uint8_t *cq = (uint8_t *) (_cqRingSize > 0 ? _cqRing : _sqRing);
+
+    _sqHead = (unsigned *) (sq + params.sq_off.head);
+    _sqTail = (unsigned *) (sq + params.sq_off.tail);
+    _sqMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    _sqEntries = params.sq_entries;
+
+    // Entry i of the queue is always sqe i
+    unsigned *array = (unsigned *) (sq + params.sq_off.array);
+    for (unsigned i = 0; i < _sqEntries; ++i) {
+        array[i] = i;
+    }
+
+    _cqHead = (unsigned *) (cq + params.cq_off.head);
+    _cqTail = (unsigned *) (cq + params.cq_off.tail);
+    _cqMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    _cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    if (!supported()) {
+        end();
+        return false;
+    }
+
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+    if (uringRegister(_fd, IORING_REGISTER_BUFFERS, &iov, 1) != 0) {
+#ifdef DEBUGGING
+        Serial.println(F("io_uring buffer registration failed"));
+#endif
+        end();
+        return false;
+    }
+
+    _queued = 0;
+    return true;
+}
+
+bool WebSocketUring::supported() {
+    static const uint8_t needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_TIMEOUT,
+        IORING_OP_POLL_ADD
+    };
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, size);
+    bool result = probe != NULL
+                  && uringRegister(_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+
+    for (size_t i = 0; result && i < sizeof(needed); ++i) {
+        result = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return result;
+}
+
+void WebSocketUring::end() {
+    if (_sqes != MAP_FAILED) {
+        munmap(_sqes, _sqesSize);
+        _sqes = (struct io_uring_sqe *) MAP_FAILED;
+    }
+    if (_cqRing != MAP_FAILED) {
+        munmap(_cqRing, _cqRingSize);
+        _cqRing = MAP_FAILED;
+    }
+    if (_sqRing != MAP_FAILED) {
+        munmap(_sqRing, _sqRingSize);
+        _sqRing = MAP_FAILED;
+    }
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _queued = 0;
+}
+
+struct io_uring_sqe *WebSocketUring::next() {
+    unsigned tail = *_sqTail;
+
+    if (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) {
+        // Full: push this batch to the kernel now and carry on
+        if (submit(false) < 0 || tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &_sqes[tail & _sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+bool WebSocketUring::accept(int fd, uint64_t tag) {
+    struct io_uring_sqe *sqe = next();
+    if (sqe == NULL) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = tag;
+
+    __atomic_store_n(_sqTail, *_sqTail + 1, __ATOMIC_RELEASE);
+    _queued++;
+    return true;
+}
+
+bool WebSocketUring::read(int fd, void *buffer, size_t length, uint64_t tag) {
+    struct io_uring_sqe *sqe = next();
+    if (sqe == NULL) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buffer;
+    sqe->len = length;
+    sqe->buf_index = 0;
+    sqe->user_data = tag;
+
+    __atomic_store_n(_sqTail, *_sqTail + 1, __ATOMIC_RELEASE);
+    _queued++;
+    return true;
+}
+
+bool WebSocketUring::write(int fd, const void *buffer, size_t length, uint64_t tag) {
+    struct io_uring_sqe *sqe = next();
+    if (sqe == NULL) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buffer;
+    sqe->len = length;
+    sqe->buf_index = 0;
+    sqe->user_data = tag;
+
+    __atomic_store_n(_sqTail, *_sqTail + 1, __ATOMIC_RELEASE);
+    _queued++;
+    return true;
+}
+
+bool WebSocketUring::poll(int fd, uint64_t tag) {
+    struct io_uring_sqe *sqe = next();
+    if (sqe == NULL) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+#if defined(IORING_FEAT_POLL_32BITS)
+    sqe->poll32_events = POLLIN;
+#else
+    sqe->poll_events = POLLIN;
+#endif
+    sqe->user_data = tag;
+
+    __atomic_store_n(_sqTail, *_sqTail + 1, __ATOMIC_RELEASE);
+    _queued++;
+    return true;
+}
+
+bool WebSocketUring::timeout(int timeoutMs, uint64_t tag) {
+    struct io_uring_sqe *sqe = next();
+    if (sqe == NULL) {
+        return false;
+    }
+
+    // The kernel copies the timespec when it takes the entry
+    _timeout.tv_sec = timeoutMs / 1000;
+    _timeout.tv_nsec = (long long) (timeoutMs % 1000) * 1000000;
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t) (uintptr_t) &_timeout;
+    sqe->len = 1;
+    sqe->off = 1;
+    sqe->user_data = tag;
+
+    __atomic_store_n(_sqTail, *_sqTail + 1, __ATOMIC_RELEASE);
+    _queued++;
+    return true;
+}
+
+int WebSocketUring::submit(bool wait) {
+    if (_queued == 0 && !wait) {
+        return 0;
+    }
+
+    int submitted = uringEnter(_fd, _queued, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+    if (submitted < 0) {
+        // Interrupted, or completions must be reaped first; both are fine
+        return errno == EINTR || errno == EAGAIN || errno == EBUSY ? 0 : -1;
+    }
+
+    _queued -= submitted;
+    return submitted;
+}
+
+bool WebSocketUring::complete(uint64_t &tag, int &result) {
+    unsigned head = *_cqHead;
+
+    if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    struct io_uring_cqe *cqe = &_cqes[head & _cqMask];
+    tag = cqe->user_data;
+    result = cqe->res;
+
+    __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ *  WebSocketUring.h
+ *
+ *  Description:
+ *      Minimal io_uring ring for the Linux reactor, on the raw system calls
+ *      so there is nothing extra to install. Operations are queued with
+ *      accept()/read()/write()/timeout() and handed to the kernel together
+ *      by submit(), which can also wait for completions in the same call.
+ *      Reads and writes use one registered buffer that holds every
+ *      connection's slots, so the kernel doesn't map pages per operation.
+ */
+
+#ifndef WEBSOCKETURING_H_
+#define WEBSOCKETURING_H_
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// Socket operations without worker threads need 5.7 or newer
+#if defined(IORING_FEAT_FAST_POLL)
+#define WS_HAVE_URING 1
+#endif
+#endif
+#endif
+
+#if WS_HAVE_URING
+
+#include <Arduino.h>
+
+// Submission queue entries, i.e. the most operations queued per submit().
+#ifndef WS_URING_ENTRIES
+#define WS_URING_ENTRIES 256
+#endif
+
+class WebSocketUring {
+public:
+    WebSocketUring();
+    ~WebSocketUring();
+
+    // Set up a ring able to hold completions for that many operations in
+    // flight and register buffer as its fixed buffer. Returns false if the
+    // kernel lacks io_uring or an operation we need.
+    bool begin(unsigned completions, void *buffer, size_t length);
+    void end();
+    bool active() const { return _fd >= 0; }
+
+    // Queue an operation; tag comes back with its completion. Return false
+    // if the submission queue is still full after submitting it.
+    bool accept(int fd, uint64_t tag);
+    bool read(int fd, void *buffer, size_t length, uint64_t tag);
+    bool write(int fd, const void *buffer, size_t length, uint64_t tag);
+    // Completes once fd is readable.
+    bool poll(int fd, uint64_t tag);
+    // Completes after timeoutMs, or as soon as any other operation does.
+    bool timeout(int timeoutMs, uint64_t tag);
+
+    // Hand everything queued to the kernel and, if wait is set, block until
+    // at least one completion is ready. Returns -1 on error.
+    int submit(bool wait);
+
+    // Take the next completion, if there is one.
+    bool complete(uint64_t &tag, int &result);
+
+private:
+    int _fd;
+    unsigned _queued;
+
+    void *_sqRing;
+    void *_cqRing;
+    size_t _sqRingSize;
+    size_t _cqRingSize;
+    struct io_uring_sqe *_sqes;
+    size_t _sqesSize;
+
+    unsigned *_sqHead;
+    unsigned *_sqTail;
+    unsigned _sqMask;
+    unsigned _sqEntries;
+
+    unsigned *_cqHead;
+    unsigned *_cqTail;
+    unsigned _cqMask;
+    struct io_uring_cqe *_cqes;
+
+    struct __kernel_timespec _timeout;
+
+    struct io_uring_sqe *next();
+    bool supported();
+};
+
+#endif
+
+#endif
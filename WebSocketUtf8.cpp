@@ -0,0 +1,302 @@
+//#define DEBUGGING
+
+#include "WebSocketUtf8.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define WS_UTF8_X86 1
+#include <immintrin.h>
+#endif
+
+void WebSocketUtf8Validator::reset() {
+    _failed = false;
+    _remaining = 0;
+    _lower = 0x80;
+    _upper = 0xBF;
+}
+
+size_t WebSocketUtf8Validator::scalar(const uint8_t *data, size_t length) {
+    // 0x80 in every byte of a word
+    const size_t highBits = (size_t) -1 / 0xFF * 0x80;
+    size_t i = 0;
+
+    while (i < length) {
+        uint8_t bite;
+
+        if (_remaining > 0) {
+            bite = data[i++];
+            if (bite < _lower || bite > _upper) {
+                _failed = true;
+                return i;
+            }
+            _remaining--;
+            _lower = 0x80;
+            _upper = 0xBF;
+            continue;
+        }
+
+        // Plain ASCII a word at a time
+        while (i + sizeof(size_t) <= length) {
+            size_t word;
+            memcpy(&word, data + i, sizeof(word));
+            if (word & highBits) {
+                break;
+            }
+            i += sizeof(word);
+        }
+        if (i == length) {
+            break;
+        }
+
+        bite = data[i++];
+        if (bite < 0x80) {
+            continue;
+        }
+
+        // Leading byte: how many continuation bytes follow, and the tighter
+        // range for the first of them that rules out overlong encodings,
+        // surrogates and code points above U+10FFFF
+        if (bite >= 0xC2 && bite <= 0xDF) {
+            _remaining = 1;
+        } else if (bite >= 0xE0 && bite <= 0xEF) {
+            _remaining = 2;
+            if (bite == 0xE0) {
+                _lower = 0xA0;
+            } else if (bite == 0xED) {
+                _upper = 0x9F;
+            }
+        } else if (bite >= 0xF0 && bite <= 0xF4) {
+            _remaining = 3;
+            if (bite == 0xF0) {
+                _lower = 0x90;
+            } else if (bite == 0xF4) {
+                _upper = 0x8F;
+            }
+        } else {
+            _failed = true;
+            return i;
+        }
+    }
+
+    return i;
+}
+
+#if WS_UTF8_X86
+
+// Lookup-table validation (Keiser and Lemire, "Validating UTF-8 In Less
+// Than One Instruction Per Byte"). Each byte is classified together with
+// the one before it by three 16-entry table lookups; every error sets a
+// bit that survives the AND of the three results. The tables are the same
+// for both vector widths.
+
+#define TOO_SHORT      (1 << 0)
+#define TOO_LONG       (1 << 1)
+#define OVERLONG_3     (1 << 2)
+#define TOO_LARGE      (1 << 3)
+#define SURROGATE      (1 << 4)
+#define OVERLONG_2     (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4     (1 << 6)
+#define TWO_CONTS      (1 << 7)
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+// Indexed by the high nibble of the previous byte
+static const int8_t byte1High[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    (int8_t) TWO_CONTS, (int8_t) TWO_CONTS, (int8_t) TWO_CONTS, (int8_t) TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+};
+
+// Indexed by the low nibble of the previous byte
+static const int8_t byte1Low[16] = {
+    (int8_t) (CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4),
+    (int8_t) (CARRY | OVERLONG_2),
+    (int8_t) CARRY,
+    (int8_t) CARRY,
+    (int8_t) (CARRY | TOO_LARGE),
+    (int8_t) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+    (int8_t) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+    (int8_t) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+    (int8_t) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+    (int8_t) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+    (int8_t) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+    (int8_t) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+    (int8_t) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+    (int8_t) (CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE),
+    (int8_t) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+    (int8_t) (CARRY | TOO_LARGE | TOO_LARGE_1000)
+};
+
+// Indexed by the high nibble of the current byte
+static const int8_t byte2High[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    (int8_t) (TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4),
+    (int8_t) (TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE),
+    (int8_t) (TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),
+    (int8_t) (TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+};
+
+// Both kernels start at a character boundary and return how many bytes they
+// covered, a multiple of the vector width. A character running past the end
+// isn't checked yet; update() hands it to the scalar code.
+
+__attribute__((target("ssse3")))
+static size_t validateSse(const uint8_t *data, size_t length, bool &valid) {
+    const __m128i high1 = _mm_loadu_si128((const __m128i *) byte1High);
+    const __m128i low1 = _mm_loadu_si128((const __m128i *) byte1Low);
+    const __m128i high2 = _mm_loadu_si128((const __m128i *) byte2High);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i previous = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128();
+    bool ascii = true;
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i input = _mm_loadu_si128((const __m128i *) (data + i));
+
+        // ASCII after ASCII can't hold an error
+        if (_mm_movemask_epi8(input) == 0 && ascii) {
+            previous = input;
+            continue;
+        }
+        ascii = _mm_movemask_epi8(input) == 0;
+
+        __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+        __m128i special = _mm_and_si128(
+            _mm_and_si128(_mm_shuffle_epi8(high1, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                          _mm_shuffle_epi8(low1, _mm_and_si128(prev1, nibble))),
+            _mm_shuffle_epi8(high2, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+        // Third and fourth bytes of longer sequences must be continuations
+        __m128i prev2 = _mm_alignr_epi8(input, previous, 14);
+        __m128i prev3 = _mm_alignr_epi8(input, previous, 13);
+        __m128i must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8((char) (0xE0 - 0x80))),
+                                      _mm_subs_epu8(prev3, _mm_set1_epi8((char) (0xF0 - 0x80))));
+        must23 = _mm_and_si128(must23, _mm_set1_epi8((char) 0x80));
+
+        error = _mm_or_si128(error, _mm_xor_si128(must23, special));
+        previous = input;
+    }
+
+    valid = _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t validateAvx2(const uint8_t *data, size_t length, bool &valid) {
+    const __m256i high1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) byte1High));
+    const __m256i low1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) byte1Low));
+    const __m256i high2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) byte2High));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i previous = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    bool ascii = true;
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i input = _mm256_loadu_si256((const __m256i *) (data + i));
+
+        // ASCII after ASCII can't hold an error
+        if (_mm256_movemask_epi8(input) == 0 && ascii) {
+            previous = input;
+            continue;
+        }
+        ascii = _mm256_movemask_epi8(input) == 0;
+
+        // alignr works per 128-bit lane, so line up the lane before first
+        __m256i shifted = _mm256_permute2x128_si256(previous, input, 0x21);
+        __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+        __m256i special = _mm256_and_si256(
+            _mm256_and_si256(_mm256_shuffle_epi8(high1, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                             _mm256_shuffle_epi8(low1, _mm256_and_si256(prev1, nibble))),
+            _mm256_shuffle_epi8(high2, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+        // Third and fourth bytes of longer sequences must be continuations
+        __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+        __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+        __m256i must23 = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8((char) (0xE0 - 0x80))),
+                                         _mm256_subs_epu8(prev3, _mm256_set1_epi8((char) (0xF0 - 0x80))));
+        must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char) 0x80));
+
+        error = _mm256_or_si256(error, _mm256_xor_si256(must23, special));
+        previous = input;
+    }
+
+    valid = _mm256_testz_si256(error, error);
+    return i;
+}
+
+typedef size_t (*Kernel)(const uint8_t *data, size_t length, bool &valid);
+
+static Kernel pickKernel() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return validateAvx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return validateSse;
+    }
+    return NULL;
+}
+
+// Below this the setup costs more than the vector loop saves
+#define WS_UTF8_VECTOR_THRESHOLD 64
+
+#endif
+
+bool WebSocketUtf8Validator::update(const uint8_t *data, size_t length) {
+    size_t i = 0;
+
+    if (_failed) {
+        return false;
+    }
+
+    // Finish a character left open by the previous piece
+    while (i < length && _remaining > 0 && !_failed) {
+        i += scalar(data + i, 1);
+    }
+
+#if WS_UTF8_X86
+    static const Kernel kernel = pickKernel();
+
+    if (kernel != NULL && !_failed && length - i >= WS_UTF8_VECTOR_THRESHOLD) {
+        bool valid;
+        size_t end = i + kernel(data + i, length - i, valid);
+
+        if (!valid) {
+            _failed = true;
+            return false;
+        }
+
+        // Back up to the lead byte of a character cut off at the end
+        size_t back = 0;
+        while (back < 3 && end - back > i && (data[end - back - 1] & 0xC0) == 0x80) {
+            back++;
+        }
+        if (end - back > i) {
+            uint8_t lead = data[end - back - 1];
+            size_t needed = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+            if (needed > back + 1) {
+                end -= back + 1;
+            }
+        }
+        i = end;
+    }
+#endif
+
+    if (!_failed) {
+        scalar(data + i, length - i);
+    }
+    return !_failed;
+}
+
+bool WebSocketUtf8Validator::validate(const uint8_t *data, size_t length) {
+    WebSocketUtf8Validator validator;
+
+    return validator.update(data, length) && validator.complete();
+}
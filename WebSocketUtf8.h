@@ -0,0 +1,43 @@
+/*
+ *  WebSocketUtf8.h
+ *
+ *  Description:
+ *      Incremental UTF-8 validator for text messages (RFC 6455 section
+ *      8.1). Payload can be fed in pieces of any size, so a character may
+ *      be split across reads or fragments. Runs of ASCII are skipped a word
+ *      at a time; on x86 long runs go through SSSE3 or AVX2 kernels picked
+ *      at run time, everywhere else a small scalar state machine is used.
+ */
+
+#ifndef WEBSOCKETUTF8_H_
+#define WEBSOCKETUTF8_H_
+
+#include <Arduino.h>
+
+class WebSocketUtf8Validator {
+public:
+    WebSocketUtf8Validator() { reset(); }
+
+    void reset();
+
+    // Check the next piece of the message. Returns false as soon as the
+    // bytes seen so far can't be valid UTF-8; it stays false until reset().
+    bool update(const uint8_t *data, size_t length);
+
+    // The message may end here: valid so far and no character left open.
+    bool complete() const { return !_failed && _remaining == 0; }
+
+    // Validate a complete string in one go.
+    static bool validate(const uint8_t *data, size_t length);
+
+private:
+    bool _failed;
+    // Continuation bytes still expected, and the range the next one must be in
+    uint8_t _remaining;
+    uint8_t _lower;
+    uint8_t _upper;
+
+    size_t scalar(const uint8_t *data, size_t length);
+};
+
+#endif
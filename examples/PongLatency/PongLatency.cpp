@@ -0,0 +1,259 @@
+/*
+ *  PongLatency.cpp
+ *
+ *  Description:
+ *      Host program for Linux that measures how long a pong waits behind
+ *      bulk data. A WebSocketServer keeps a socketpair busy with a 1 MB
+ *      region, or with a queue of many small messages, while the peer
+ *      reads at a fixed rate and pings every few milliseconds. The time
+ *      from each ping to its pong is printed per case: a control frame
+ *      should only ever wait for the frame on the wire, not for the rest
+ *      of the queue.
+ *
+ *      Build it against an Arduino core for Linux (Arduino.h, Client.h
+ *      and String), e.g.
+ *
+ *          g++ -std=gnu++17 -O2 -I<core> -I../.. PongLatency.cpp \
+ *              <library and core sources> -lpthread
+ */
+
+#include <PosixClient.h>
+#include <WebSocketServer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define PINGS 100
+#define PING_INTERVAL_MS 5
+#define SOCKET_BUFFER 4096
+#define REGION_LENGTH (1 << 20)
+
+static const char *request =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+static long long nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Frames from the server, parsed as they trickle in
+struct Reader {
+    uint8_t header[10];
+    size_t headerLength;
+    bool inPayload;
+    uint64_t remaining;
+    uint8_t opcode;
+    uint8_t payload[8];
+    size_t payloadLength;
+};
+
+static bool frameDone(Reader &reader, std::vector<long long> &latencies) {
+    long long sent;
+
+    if (reader.opcode != 0x0A || reader.payloadLength != sizeof(sent)) {
+        return false;
+    }
+    memcpy(&sent, reader.payload, sizeof(sent));
+    latencies.push_back(nowNanos() - sent);
+    return true;
+}
+
+// Returns the number of pongs among the data.
+static int consume(Reader &reader, const uint8_t *data, size_t length, std::vector<long long> &latencies) {
+    int pongs = 0;
+
+    while (length > 0) {
+        if (!reader.inPayload) {
+            reader.header[reader.headerLength++] = *data++;
+            length--;
+
+            size_t need = 2;
+            if (reader.headerLength >= 2) {
+                uint8_t short7 = reader.header[1] & 0x7F;
+                need += short7 == 126 ? 2 : short7 == 127 ? 8 : 0;
+            }
+            if (reader.headerLength < need) {
+                continue;
+            }
+
+            uint64_t payloadLength = reader.header[1] & 0x7F;
+            if (need > 2) {
+                payloadLength = 0;
+                for (size_t i = 2; i < need; ++i) {
+                    payloadLength = (payloadLength << 8) | reader.header[i];
+                }
+            }
+            reader.opcode = reader.header[0] & 0x0F;
+            reader.remaining = payloadLength;
+            reader.payloadLength = 0;
+            reader.headerLength = 0;
+            if (payloadLength > 0) {
+                reader.inPayload = true;
+            } else {
+                pongs += frameDone(reader, latencies);
+            }
+            continue;
+        }
+
+        size_t take = length < reader.remaining ? length : (size_t) reader.remaining;
+        if (reader.opcode == 0x0A) {
+            for (size_t i = 0; i < take && reader.payloadLength < sizeof(reader.payload); ++i) {
+                reader.payload[reader.payloadLength++] = data[i];
+            }
+        }
+        data += take;
+        length -= take;
+        reader.remaining -= take;
+        if (reader.remaining == 0) {
+            reader.inPayload = false;
+            pongs += frameDone(reader, latencies);
+        }
+    }
+    return pongs;
+}
+
+static void sendPing(int fd) {
+    const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    uint8_t frame[2 + sizeof(mask) + 8];
+    long long now = nowNanos();
+
+    frame[0] = 0x89;
+    frame[1] = 0x80 | 8;
+    memcpy(frame + 2, mask, sizeof(mask));
+    memcpy(frame + 6, &now, sizeof(now));
+    for (size_t i = 0; i < 8; ++i) {
+        frame[6 + i] ^= mask[i & 3];
+    }
+    if (send(fd, frame, sizeof(frame), MSG_NOSIGNAL) != (ssize_t) sizeof(frame)) {
+        perror("ping");
+    }
+}
+
+// The client side: ping, read readRate bytes a millisecond, time the pongs.
+static void peer(int fd, size_t readRate, std::vector<long long> &latencies, std::atomic<bool> &done) {
+    uint8_t *buffer = (uint8_t *) malloc(readRate);
+    Reader reader;
+    size_t matched = 0;
+    int outstanding = 0;
+    long long lastPing = 0;
+
+    memset(&reader, 0, sizeof(reader));
+    if (write(fd, request, strlen(request)) < 0) {
+        perror("request");
+    }
+    // The response ends with a blank line
+    while (matched < 4) {
+        uint8_t c;
+        if (read(fd, &c, 1) != 1) {
+            break;
+        }
+        matched = c == "\r\n\r\n"[matched] ? matched + 1 : c == '\r' ? 1 : 0;
+    }
+
+    while (latencies.size() < PINGS) {
+        long long now = nowNanos();
+
+        if (outstanding == 0 && now - lastPing >= PING_INTERVAL_MS * 1000000LL) {
+            sendPing(fd);
+            lastPing = now;
+            outstanding++;
+        }
+        ssize_t count = recv(fd, buffer, readRate, MSG_DONTWAIT);
+        if (count > 0) {
+            outstanding -= consume(reader, buffer, count, latencies);
+        } else if (count == 0) {
+            break;
+        }
+        usleep(1000);
+    }
+    done = true;
+    free(buffer);
+}
+
+static void released(void *context, const uint8_t *data, size_t length) {
+    (void) data;
+    (void) length;
+    *(bool *) context = false;
+}
+
+static void run(const char *name, size_t fragmentLength, bool smallMessages, size_t readRate) {
+    static uint8_t region[REGION_LENGTH];
+    std::vector<long long> latencies;
+    std::atomic<bool> done(false);
+    bool regionQueued = false;
+    int fds[2];
+    int size = SOCKET_BUFFER;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        perror("socketpair");
+        return;
+    }
+    // Small kernel buffers, so the backlog sits in the send queue
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    PosixClient client(fds[0]);
+    WebSocketServer server;
+    std::thread thread(peer, fds[1], readRate, std::ref(latencies), std::ref(done));
+
+    while (!client.headersComplete()) {
+        client.fill();
+        usleep(100);
+    }
+    if (!server.handshake(client)) {
+        printf("%s: handshake failed\n", name);
+        // The peer sees the end and gives up
+        client.stop();
+    }
+    server.setFragmentSize(fragmentLength);
+    if (smallMessages) {
+        server.setSendQueueWatermarks(60000, 30000);
+    }
+
+    std::string text(200, 'x');
+    while (!done) {
+        // Keep the queue full
+        if (smallMessages) {
+            while (server.sendData(text.c_str()) == WS_SEND_QUEUED) {
+            }
+        } else if (!regionQueued) {
+            regionQueued = true;
+            server.sendRegion(region, sizeof(region), WS_OPCODE_BINARY, released, &regionQueued);
+        }
+        server.poll();
+        usleep(50);
+    }
+    thread.join();
+    close(fds[1]);
+
+    if (latencies.empty()) {
+        printf("%s: no pongs\n", name);
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-40s p50 %8.0f us  p99 %8.0f us  max %8.0f us\n", name,
+           latencies[latencies.size() / 2] / 1000.0,
+           latencies[latencies.size() * 99 / 100] / 1000.0,
+           latencies.back() / 1000.0);
+}
+
+int main() {
+    // Read at 16 MB/s, then at 2 MB/s
+    run("1 MB region, sent whole", 0, false, 16384);
+    run("1 MB region, 4096 byte fragments", 4096, false, 16384);
+    run("200 byte messages, 60 KB queued", WS_FRAGMENT_LENGTH, true, 2048);
+    return 0;
+}
@@ -0,0 +1,302 @@
+/*
+ *  SendContention.cpp
+ *
+ *  Description:
+ *      Host program for Linux that hammers one connection from 8 threads
+ *      at once while the owner polls it. Each thread sends its messages in
+ *      a different way: whole with sendData(), frame by frame with
+ *      reserveFrame()/commitFrame(), or streamed with beginMessage() with
+ *      and without a length. The peer checks that no data frame lands
+ *      inside a fragmented message, that every message arrives whole and
+ *      that each thread's messages keep their order, then prints the
+ *      throughput.
+ *
+ *      Build it against an Arduino core for Linux (Arduino.h, Client.h
+ *      and String), e.g.
+ *
+ *          g++ -std=gnu++17 -O2 -I<core> -I../.. SendContention.cpp \
+ *              <library and core sources> -lpthread
+ */
+
+#include <PosixClient.h>
+#include <WebSocketServer.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define THREADS 8
+#define MESSAGES 2000
+#define CHUNK_LENGTH 700
+#define TIMEOUT_MS 30000
+
+static const char *request =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+enum SendKind {
+    SEND_WHOLE,
+    SEND_FRAMES,
+    SEND_STREAM,
+    SEND_STREAM_KNOWN
+};
+
+static const char *kindNames[] = { "sendData()", "reserveFrame()", "beginMessage()", "beginMessage(length)" };
+
+// Set when the run is over, so no sender waits for room any more
+static std::atomic<bool> stopping(false);
+
+// Message index of thread: its numbers, then letters that depend on both
+static std::string body(int thread, int index) {
+    std::string text = std::to_string(thread) + " " + std::to_string(index) + " ";
+    size_t length = 16 + (index * 37 + thread * 101) % 2000;
+
+    for (size_t i = 0; i < length; ++i) {
+        text += (char) ('a' + (thread * 31 + index * 7 + i) % 26);
+    }
+    return text;
+}
+
+// Offer a send until something other than WS_SEND_OVERFLOW comes back.
+template <typename Send>
+static WebSocketSendStatus retry(Send send) {
+    WebSocketSendStatus status;
+
+    while ((status = send()) == WS_SEND_OVERFLOW && !stopping) {
+        std::this_thread::yield();
+    }
+    if (status == WS_SEND_WOULD_BLOCK) {
+        // Queued, but the owner is behind
+        usleep(1000);
+    }
+    return status;
+}
+
+static void sendFrames(WebSocketServer &server, const std::string &text) {
+    const uint8_t *data = (const uint8_t *) text.data();
+
+    for (size_t offset = 0; offset < text.size(); offset += CHUNK_LENGTH) {
+        size_t length = std::min<size_t>(CHUNK_LENGTH, text.size() - offset);
+        uint8_t opcode = offset == 0 ? WS_OPCODE_TEXT : WS_OPCODE_CONTINUATION;
+        bool final = offset + length == text.size();
+
+        retry([&] {
+            uint8_t *frame = server.reserveFrame(length);
+            if (frame == NULL) {
+                return WS_SEND_OVERFLOW;
+            }
+            memcpy(frame, data + offset, length);
+            return server.commitFrame(opcode, length, final);
+        });
+    }
+}
+
+static void sendStream(WebSocketServer &server, const std::string &text, bool known) {
+    const uint8_t *data = (const uint8_t *) text.data();
+
+    retry([&] { return server.beginMessage(WS_OPCODE_TEXT, known ? text.size() : WS_LENGTH_UNKNOWN); });
+    for (size_t offset = 0; offset < text.size(); offset += CHUNK_LENGTH) {
+        size_t length = std::min<size_t>(CHUNK_LENGTH, text.size() - offset);
+        retry([&] { return server.write(data + offset, length); });
+    }
+    retry([&] { return server.endMessage(); });
+}
+
+static void sender(WebSocketServer &server, int thread, std::atomic<int> &finished) {
+    for (int i = 0; i < MESSAGES && !stopping; ++i) {
+        std::string text = body(thread, i);
+
+        switch (thread % 4) {
+        case SEND_WHOLE:
+            retry([&] { return server.sendData(text.c_str()); });
+            break;
+        case SEND_FRAMES:
+            sendFrames(server, text);
+            break;
+        case SEND_STREAM:
+            sendStream(server, text, false);
+            break;
+        case SEND_STREAM_KNOWN:
+            sendStream(server, text, true);
+            break;
+        }
+    }
+    finished++;
+}
+
+// The client side: reassemble messages and check every one of them.
+static void peer(int fd, std::atomic<long> &received, std::atomic<long> &bytes, std::atomic<bool> &failed) {
+    std::vector<uint8_t> buffer;
+    std::string message;
+    bool fragmented = false;
+    int next[THREADS] = { 0 };
+    uint8_t chunk[65536];
+    size_t matched = 0;
+
+    if (write(fd, request, strlen(request)) < 0) {
+        perror("request");
+    }
+    // The response ends with a blank line
+    while (matched < 4) {
+        uint8_t c;
+        if (read(fd, &c, 1) != 1) {
+            failed = true;
+            return;
+        }
+        matched = c == "\r\n\r\n"[matched] ? matched + 1 : c == '\r' ? 1 : 0;
+    }
+
+    while (received < (long) THREADS * MESSAGES && !failed) {
+        ssize_t count = recv(fd, chunk, sizeof(chunk), 0);
+        if (count <= 0) {
+            break;
+        }
+        buffer.insert(buffer.end(), chunk, chunk + count);
+
+        size_t offset = 0;
+        while (buffer.size() - offset >= 2) {
+            uint8_t first = buffer[offset];
+            uint64_t length = buffer[offset + 1] & 0x7F;
+            size_t header = 2;
+
+            if (length == 126) {
+                header = 4;
+            } else if (length == 127) {
+                header = 10;
+            }
+            if (buffer.size() - offset < header) {
+                break;
+            }
+            if (header > 2) {
+                length = 0;
+                for (size_t i = 2; i < header; ++i) {
+                    length = (length << 8) | buffer[offset + i];
+                }
+            }
+            if (buffer.size() - offset < header + length) {
+                break;
+            }
+
+            uint8_t opcode = first & 0x0F;
+            bool final = first & 0x80;
+            std::string payload((const char *) &buffer[offset + header], length);
+            offset += header + length;
+
+            if (opcode & 0x08) {
+                continue;
+            }
+            // RFC 6455 section 5.4: a fragmented message is never interleaved
+            if (opcode == WS_OPCODE_CONTINUATION) {
+                if (!fragmented) {
+                    printf("continuation outside a message\n");
+                    failed = true;
+                    break;
+                }
+                message += payload;
+            } else {
+                if (fragmented) {
+                    printf("data frame inside a fragmented message\n");
+                    failed = true;
+                    break;
+                }
+                message = payload;
+            }
+            fragmented = !final;
+            if (!final) {
+                continue;
+            }
+
+            int thread;
+            int index;
+            if (sscanf(message.c_str(), "%d %d", &thread, &index) != 2 || thread < 0 || thread >= THREADS) {
+                printf("garbled message of %zu bytes\n", message.size());
+                failed = true;
+                break;
+            }
+            if (index != next[thread]) {
+                printf("thread %d: message %d arrived, expected %d\n", thread, index, next[thread]);
+                failed = true;
+                break;
+            }
+            if (message != body(thread, index)) {
+                printf("thread %d: message %d corrupted\n", thread, index);
+                failed = true;
+                break;
+            }
+            next[thread]++;
+            bytes += message.size();
+            received++;
+        }
+        buffer.erase(buffer.begin(), buffer.begin() + offset);
+    }
+}
+
+int main() {
+    std::atomic<long> received(0);
+    std::atomic<long> bytes(0);
+    std::atomic<bool> failed(false);
+    std::atomic<int> finished(0);
+    std::vector<std::thread> senders;
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+
+    PosixClient client(fds[0]);
+    WebSocketServer server;
+    std::thread reader(peer, fds[1], std::ref(received), std::ref(bytes), std::ref(failed));
+
+    while (!client.headersComplete()) {
+        client.fill();
+        usleep(100);
+    }
+    // The thread that shakes hands owns the connection; the others go
+    // through its outgoing ring
+    if (!server.handshake(client)) {
+        printf("handshake failed\n");
+        client.stop();
+        reader.join();
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int thread = 0; thread < THREADS; ++thread) {
+        senders.emplace_back(sender, std::ref(server), thread, std::ref(finished));
+    }
+    while ((finished < THREADS || received < (long) THREADS * MESSAGES) && !failed) {
+        server.poll();
+        if (std::chrono::steady_clock::now() - start > std::chrono::milliseconds(TIMEOUT_MS)) {
+            printf("timed out\n");
+            failed = true;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    stopping = true;
+    shutdown(fds[1], SHUT_RDWR);
+    for (std::thread &thread : senders) {
+        thread.join();
+    }
+    reader.join();
+    close(fds[1]);
+
+    for (int kind = 0; kind < 4; ++kind) {
+        printf("threads %d and %d: %s\n", kind, kind + 4, kindNames[kind]);
+    }
+    printf("%ld of %d messages, %.1f MB in %.0f ms: %.0f messages/s, %.1f MB/s\n", received.load(),
+           THREADS * MESSAGES, bytes / 1e6, seconds * 1000, received / seconds, bytes / 1e6 / seconds);
+    printf(failed ? "FAIL\n" : "PASS\n");
+    return failed ? 1 : 0;
+}
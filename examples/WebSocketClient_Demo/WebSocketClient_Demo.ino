@@ -16,6 +16,7 @@ WiFiClient client;
 
 
 String dataToSend; // update this with the value you wish to send to the server
+unsigned long lastSendMillis;
 
 void setup()
 {
@@ -24,24 +25,27 @@ void setup()
   // try to connect to the wifi
   if(connect() == 0) { return ; }
 
-  // once connected to the wifi, let's reach our server
-  if(initWebSocket() == 0) { return ; }
+  // called from webSocketClient.poll() for every text message
+  webSocketClient.onText(onTextReceived);
+
+  // once connected to the wifi, let's reach our server; poll() connects
+  // again by itself whenever the link drops
+  initWebSocket();
 
 }
 
 void loop() {
-  
-  String data;
  
+  // handles every frame received so far, never waits for more, and
+  // reconnects with backoff while the link is down
+  webSocketClient.poll();
+
   if (client.connected()) {
  
-    webSocketClient.sendData("Info to be echoed back");
- 
-    webSocketClient.getData(data);
-    if (data.length() > 0) {
-      onDataReceived(data);
+    if (millis() - lastSendMillis >= 3000) {
+      webSocketClient.sendData("Info to be echoed back");
+      lastSendMillis = millis();
     }
-    data = "";
 
     if(dataToSend.length() > 0)
     {
@@ -49,12 +53,15 @@ void loop() {
     }
     dataToSend = "";
  
-  } else {
-    Serial.println("Client disconnected.");
   }
  
-  delay(3000);
- 
+}
+
+void onTextReceived(void *context, const uint8_t *payload, size_t length)
+{
+  String data;
+  data.concat((const char *)payload, length);
+  onDataReceived(data);
 }
 
 void onDataReceived(String &data)
@@ -67,23 +74,17 @@ void onDataReceived(String &data)
   }
 }
 
-char initWebSocket()
+void onConnected(void *context)
 {
-  if(!client.connect(HOST, PORT)) {
-    Serial.println("Connection failed.");
-    return 0;
-  }
+  Serial.println("Handshake successful");
+}
 
-  Serial.println("Connected.");
+void initWebSocket()
+{
   webSocketClient.path = PATH;
   webSocketClient.host = HOST;
-
-  if (!webSocketClient.handshake(client)) {
-    Serial.println("Handshake failed.");
-    return 0;
-  }
-  Serial.println("Handshake successful");
-  return 1;
+  webSocketClient.onConnect(onConnected);
+  webSocketClient.setReconnect(client, PORT);
 }
 
 /*
@@ -19,6 +19,9 @@ void setup()
   // try to connect
   if(connect() == 0) { return ; }
 
+  // called from webSocketServer.poll() for every text message
+  webSocketServer.onText(onTextReceived);
+
 }
 
 void loop() {
@@ -65,24 +68,15 @@ void webSocketLoop()
     
     if (client.connected() && webSocketServer.handshake(client)) 
     {
-      String data;      
       while (client.connected()) 
       {
-        data = webSocketServer.getData();
-        if (data.length() > 0) 
-        {
-          onDataReceived(data);
-        }
-        
-        delay(10); // Delay needed for receiving the data correctly
-        data = "";
+        // handles every frame received so far, never waits for more
+        webSocketServer.poll();
         
         if(dataToSend.length() > 0)
         {
           webSocketServer.sendData(dataToSend);
-         
         }
-        delay(10); // Delay needed for sending the data correctly
         dataToSend = "";
       }
  
@@ -94,6 +88,13 @@ void webSocketLoop()
   }
 }
 
+void onTextReceived(void *context, const uint8_t *payload, size_t length)
+{
+  String data;
+  data.concat((const char *)payload, length);
+  onDataReceived(data);
+}
+
 void onDataReceived(String &data)
 {
   Serial.println(data);